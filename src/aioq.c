@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Asynchronous write queue
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <chaste/log/log.h>
+
+#include "aioq.h"
+
+
+int aioq_init(aioq_t* q)
+{
+    memset(q, 0, sizeof(*q));
+    if (syscall(SYS_io_setup, AIOQ_DEPTH, &q->ctx))
+    {
+        ch_log_error("Could not set up async I/O: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void aioq_fini(aioq_t* q)
+{
+    if (!q->ctx)
+    {
+        return;
+    }
+
+    aioq_reap(q, q->submitted);
+    syscall(SYS_io_destroy, q->ctx);
+    q->ctx = 0;
+}
+
+
+int64_t aioq_reap(aioq_t* q, int64_t wait_for)
+{
+    struct io_event events[AIOQ_DEPTH];
+    while (q->completed < q->submitted)
+    {
+        const bool wait = q->completed < wait_for;
+        struct timespec no_wait = {0, 0};
+        const long n = syscall(SYS_io_getevents, q->ctx, wait ? 1 : 0,
+                               AIOQ_DEPTH, events, wait ? NULL : &no_wait);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ch_log_error("Could not get async I/O events: %s\n",
+                         strerror(errno));
+            q->failed = true;
+            break;
+        }
+
+        for (long i = 0; i < n; i++)
+        {
+            const struct iocb* iocb = (struct iocb*)events[i].obj;
+            if (events[i].res != (int64_t)iocb->aio_nbytes)
+            {
+                ch_log_error("Async write of %lluB at %lli failed: %s\n",
+                             iocb->aio_nbytes, iocb->aio_offset,
+                             (int64_t)events[i].res < 0 ?
+                                     strerror(-(int64_t)events[i].res) :
+                                     "short write");
+                q->failed = true;
+            }
+            q->done[events[i].data % AIOQ_DEPTH] = true;
+        }
+
+        /* Move past everything that has finished in order */
+        while (q->completed < q->submitted &&
+               q->done[(q->completed + 1) % AIOQ_DEPTH])
+        {
+            q->completed++;
+            q->done[q->completed % AIOQ_DEPTH] = false;
+        }
+
+        if (!wait)
+        {
+            break;
+        }
+    }
+
+    return q->completed;
+}
+
+
+int64_t aioq_write(aioq_t* q, int fd, const char* buff, int64_t len,
+                   int64_t offset)
+{
+    /* Entries are reused in order, so wait for the oldest to finish */
+    if (q->submitted - q->completed >= AIOQ_DEPTH)
+    {
+        aioq_reap(q, q->submitted - AIOQ_DEPTH + 1);
+    }
+
+    const int64_t seq = q->submitted + 1;
+    struct iocb* iocb = &q->iocbs[seq % AIOQ_DEPTH];
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data       = seq;
+    iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
+    iocb->aio_fildes     = fd;
+    iocb->aio_buf        = (uintptr_t)buff;
+    iocb->aio_nbytes     = len;
+    iocb->aio_offset     = offset;
+
+    struct iocb* iocbp = iocb;
+    while (syscall(SYS_io_submit, q->ctx, 1, &iocbp) != 1)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            continue;
+        }
+        ch_log_error("Could not submit async write: %s\n", strerror(errno));
+        q->failed = true;
+        return -1;
+    }
+
+    q->submitted = seq;
+    return seq;
+}
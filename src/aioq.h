@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: A queue of asynchronous O_DIRECT writes using Linux native
+ *  AIO, so that one thread can keep several disks busy at once. Uses the raw
+ *  system calls so that there is no dependency on libaio.
+ */
+
+
+#ifndef SRC_AIOQ_H_
+#define SRC_AIOQ_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/aio_abi.h>
+
+#define AIOQ_DEPTH (64)
+
+/*
+ * Writes are numbered from 1 in the order they are submitted. They may finish
+ * in any order, but "completed" only counts those that have finished with
+ * every earlier write also finished, so a caller waiting on a write numbered
+ * n can stop waiting once completed >= n.
+ */
+typedef struct
+{
+    aio_context_t ctx;
+    struct iocb iocbs[AIOQ_DEPTH];
+    bool done[AIOQ_DEPTH];
+    int64_t submitted;
+    int64_t completed;
+    bool failed; /* A write failed or was short */
+} aioq_t;
+
+int aioq_init(aioq_t* q);
+void aioq_fini(aioq_t* q);
+
+/* Queue a write of len bytes from buff at offset in fd. Waits for a free
+ * entry if the queue is full. Returns the write's number, or -1 on error */
+int64_t aioq_write(aioq_t* q, int fd, const char* buff, int64_t len,
+                   int64_t offset);
+
+/* Collect finished writes. With "wait_for" > 0, block until write number
+ * "wait_for" and all before it have finished. Returns q->completed */
+int64_t aioq_reap(aioq_t* q, int64_t wait_for);
+
+#endif /* SRC_AIOQ_H_ */
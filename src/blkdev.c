@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Block device I/O geometry discovery
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include <chaste/log/log.h>
+
+#include "blkdev.h"
+
+
+/* Read a single integer from a sysfs file */
+static int read_sysfs_int64(const char* filename, int64_t* value)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f)
+    {
+        return -1;
+    }
+
+    const int result = fscanf(f, "%li", value) == 1 ? 0 : -1;
+    fclose(f);
+    return result;
+}
+
+
+/*
+ * Read an attribute from the request queue of a device. Partitions do not have
+ * a queue of their own, theirs belongs to the disk above them.
+ */
+static int read_queue_attr(const char* sys_path, const char* attr,
+                           int64_t* value)
+{
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/queue/%s", sys_path, attr);
+    if (!read_sysfs_int64(filename, value))
+    {
+        return 0;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/../queue/%s", sys_path, attr);
+    return read_sysfs_int64(filename, value);
+}
+
+
+int blkdev_io_sizes(const char* path, int64_t* logical, int64_t* optimal)
+{
+    *logical = 0;
+    *optimal = 0;
+
+    struct stat st;
+    if (stat(path, &st))
+    {
+        /* Output files are named from a prefix, so look at the directory */
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        if (stat(dirname(dir), &st))
+        {
+            return -1;
+        }
+    }
+
+    const dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    if (major(dev) == 0)
+    {
+        /* Not backed by a block device (e.g. tmpfs or /dev/null) */
+        return -1;
+    }
+
+    char sys_path[128];
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", major(dev),
+             minor(dev));
+    if (read_queue_attr(sys_path, "logical_block_size", logical))
+    {
+        ch_log_debug1("Could not find I/O sizes for %s in %s\n", path,
+                      sys_path);
+        return -1;
+    }
+    read_queue_attr(sys_path, "optimal_io_size", optimal);
+
+    ch_log_debug1("%s is on %s, logical block %liB, optimal I/O %liB\n", path,
+                  sys_path, *logical, *optimal);
+    return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Discovery of the I/O geometry of the block devices that
+ *  output files and raw devices live on. Uses sysfs.
+ */
+
+
+#ifndef SRC_BLKDEV_H_
+#define SRC_BLKDEV_H_
+
+#include <stdint.h>
+
+/*
+ * Logical block size and optimal I/O size (e.g. the stripe width of a RAID
+ * array) of the block device holding path, or of path itself if it is a block
+ * device. If path does not exist, the directory containing it is used instead.
+ * Sizes that cannot be found are set to 0. Returns 0 if the device was found.
+ */
+int blkdev_io_sizes(const char* path, int64_t* logical, int64_t* optimal);
+
+#endif /* SRC_BLKDEV_H_ */
@@ -25,6 +25,8 @@ enum {
     EXPCAP_FLAG_TRNC    = 0x08, //Frame truncated
     EXPCAP_FLAG_SWOVFL  = 0x10, //A software overflow happened
     EXPCAP_FLAG_HWOVFL  = 0x20, //A hardware overflow happened
+    EXPCAP_FLAG_TSTRAILER = 0x40, //Time is from a switch timestamp trailer
+    EXPCAP_FLAG_HASH    = 0x80, //Payload hash before the footer, see expcap_hash.h
 };
 
 
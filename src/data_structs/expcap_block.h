@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Block headers in expcap files. Every slot that a listener hands to a writer
+ *  starts with a block header, wrapped up in a padding record (wire length 0)
+ *  so that standard pcap readers skip over it. The header says how long the
+ *  block is, where its packets end and the padding begins, and what it holds,
+ *  so that readers can skip whole blocks, or skip the padding at the end of
+ *  one, without walking every record. Not every padding record starts a block
+ *  (e.g. the one after the file header), readers should walk records until
+ *  they find the next block header. Blocks from listeners that sample packets
+ *  say how many were left out while the block filled, so that counts can be
+ *  scaled back up.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_EXPCAP_BLOCK_H_
+#define SRC_DATA_STRUCTS_EXPCAP_BLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pcap-structures.h"
+#include "expcap.h"
+
+#define EXPCAP_BLOCK_MAGIC   "EXCAPBLK"
+#define EXPCAP_BLOCK_VERSION 2
+
+/* Each device gets this many bits in the port mask */
+#define EXPCAP_BLOCK_DEV_PORTS 8
+
+enum {
+    EXPCAP_BLOCK_FLAG_NONE  = 0x00, //No flags
+    EXPCAP_BLOCK_FLAG_RAWTS = 0x01, //Times are NIC timestamps (cycles), not UTC
+    EXPCAP_BLOCK_FLAG_SAMPLED = 0x02, //Packets were sampled, see skipped
+};
+
+typedef struct __attribute__ ((packed)) expcap_block {
+    char magic[8];      /* EXPCAP_BLOCK_MAGIC, not null terminated */
+    uint16_t version;
+    uint16_t flags;
+    uint32_t packets;   /* Real packets in the block */
+    uint32_t length;    /* Bytes in the block, from the start of this record */
+    uint32_t data_len;  /* Bytes up to the end of the last packet */
+    uint64_t first_ts;  /* Time of the first and last packets, ns since the */
+    uint64_t last_ts;   /* epoch (or NIC cycles with EXPCAP_BLOCK_FLAG_RAWTS) */
+    uint64_t port_mask; /* Bit dev_id * EXPCAP_BLOCK_DEV_PORTS + port_id */
+    uint64_t skipped;   /* Packets left out by sampling as the block filled */
+    uint64_t skipped_bytes; /* and their wire length */
+} expcap_block_t;
+
+/* The whole padding record holding a block header */
+#define EXPCAP_BLOCK_REC (sizeof(pcap_pkthdr_t) + sizeof(expcap_block_t) + \
+                          sizeof(expcap_pktftr_t))
+
+
+static inline uint64_t expcap_block_port_bit(int dev_id, int port_id)
+{
+    const int bit = dev_id * EXPCAP_BLOCK_DEV_PORTS + port_id;
+    return bit < 64 ? 1ULL << bit : 0;
+}
+
+
+/* Start an empty block header record at hdr. Returns the block header */
+static inline expcap_block_t* expcap_block_init(pcap_pkthdr_t* hdr, uint16_t flags)
+{
+    hdr->ts.raw = 0;
+    hdr->caplen = EXPCAP_BLOCK_REC - sizeof(pcap_pkthdr_t);
+    hdr->len    = 0;
+
+    expcap_block_t* blk = (expcap_block_t*)(hdr + 1);
+    memset(blk, 0, sizeof(expcap_block_t) + sizeof(expcap_pktftr_t));
+    memcpy(blk->magic, EXPCAP_BLOCK_MAGIC, sizeof(blk->magic));
+    blk->version  = EXPCAP_BLOCK_VERSION;
+    blk->flags    = flags;
+    blk->length   = EXPCAP_BLOCK_REC;
+    blk->data_len = EXPCAP_BLOCK_REC;
+    return blk;
+}
+
+
+/* Return the block header in this record, or NULL if it isn't one */
+static inline expcap_block_t* expcap_block_get(pcap_pkthdr_t* hdr)
+{
+    if(hdr->len || hdr->caplen != EXPCAP_BLOCK_REC - sizeof(pcap_pkthdr_t)){
+        return NULL;
+    }
+
+    expcap_block_t* blk = (expcap_block_t*)(hdr + 1);
+    if(memcmp(blk->magic, EXPCAP_BLOCK_MAGIC, sizeof(blk->magic)) ||
+       blk->version != EXPCAP_BLOCK_VERSION ||
+       blk->data_len > blk->length || blk->data_len < EXPCAP_BLOCK_REC){
+        return NULL;
+    }
+
+    return blk;
+}
+
+#endif /* SRC_DATA_STRUCTS_EXPCAP_BLOCK_H_ */
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Clock samples written next to each output file when timestamp conversion
+ *  is deferred. Packets in such files keep the raw NIC timestamp (cycles) in
+ *  their pcap header, and the file "<name>.clk" holds a header followed by one
+ *  sample per ring slot written, mapping a NIC timestamp to UTC. The samples
+ *  are used to convert the timestamps later, see exact-pcap-retime.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_EXPCAP_CLOCK_H_
+#define SRC_DATA_STRUCTS_EXPCAP_CLOCK_H_
+
+#include <stdint.h>
+
+#define EXPCAP_CLOCK_MAGIC   "EXCAPCLK"
+#define EXPCAP_CLOCK_VERSION 1
+#define EXPCAP_CLOCK_SUFFIX  ".clk"
+
+typedef struct __attribute__ ((packed)) expcap_clock_hdr {
+    char magic[8];        /* EXPCAP_CLOCK_MAGIC, not null terminated */
+    uint32_t version;
+    uint32_t sample_size; /* sizeof(expcap_clock_sample_t) */
+} expcap_clock_hdr_t;
+
+typedef struct __attribute__ ((packed)) expcap_clock_sample {
+    uint64_t cycles;      /* NIC timestamp of the first packet of a slot */
+    uint64_t ts_secs;     /* Its time by the NIC's clock model */
+    uint64_t ts_psecs;
+    uint64_t host_ns;     /* Host clock when the slot was written */
+    uint32_t tick_hz;     /* NIC timestamp counter frequency */
+    uint8_t dev_id;
+    uint8_t port_id;
+    uint16_t _reserved;
+} expcap_clock_sample_t;
+
+#endif /* SRC_DATA_STRUCTS_EXPCAP_CLOCK_H_ */
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Footer sidecar files, written next to each output file in plain pcap
+ *  output mode (--format pcap). The packets in such files are standard
+ *  nanosecond pcap records, with no expcap footers and no padding records,
+ *  and the file "<name>.ftr" holds a header followed by one record per packet,
+ *  in the same order, with what the footer would have held that the pcap
+ *  header does not already.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_EXPCAP_FOOTERS_H_
+#define SRC_DATA_STRUCTS_EXPCAP_FOOTERS_H_
+
+#include <stdint.h>
+
+#define EXPCAP_FOOTERS_MAGIC   "EXCAPFTR"
+#define EXPCAP_FOOTERS_VERSION 1
+#define EXPCAP_FOOTERS_SUFFIX  ".ftr"
+
+typedef struct __attribute__ ((packed)) expcap_footers_hdr {
+    char magic[8];        /* EXPCAP_FOOTERS_MAGIC, not null terminated */
+    uint32_t version;
+    uint32_t record_size; /* sizeof(expcap_footer_rec_t) */
+} expcap_footers_hdr_t;
+
+typedef struct __attribute__ ((packed)) expcap_footer_rec {
+    uint16_t ts_psecs;    /* Picoseconds past the pcap header's nanoseconds */
+    uint8_t flags;        /* As in expcap_pktftr_t */
+    uint8_t dev_id;
+    uint8_t port_id;
+    uint8_t _reserved;
+    uint32_t foot;        /* Dropped count or new FCS, as in expcap_pktftr_t */
+} expcap_footer_rec_t;
+
+#endif /* SRC_DATA_STRUCTS_EXPCAP_FOOTERS_H_ */
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Payload hashes, written with --payload-hash. The listener hashes every byte
+ *  of a frame as it arrives, chunk by chunk, including those past the snap
+ *  length, and puts the 64-bit result between the captured bytes and the
+ *  footer, with EXPCAP_FLAG_HASH set in the footer. Capturing only the headers
+ *  of each frame then still says what the rest of it was, so that tools can
+ *  tell frames apart (or find the same frame elsewhere) by their hashes. The
+ *  hash does not depend on how the frame was split into chunks, so tools can
+ *  hash whole frames from other captures and get the same values.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_EXPCAP_HASH_H_
+#define SRC_DATA_STRUCTS_EXPCAP_HASH_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "expcap.h"
+
+#define EXPCAP_HASH_LEN  ((int64_t)sizeof(uint64_t))
+#define EXPCAP_HASH_SEED 0x243F6A8885A308D3ULL
+#define EXPCAP_HASH_MUL  0x9E3779B97F4A7C15ULL
+
+typedef struct {
+    uint64_t h;
+    uint64_t word;  /* Bytes of a word not yet hashed */
+    uint64_t len;   /* Bytes added so far */
+} expcap_hash_t;
+
+
+static inline void expcap_hash_init(expcap_hash_t* st)
+{
+    st->h    = EXPCAP_HASH_SEED;
+    st->word = 0;
+    st->len  = 0;
+}
+
+
+static inline uint64_t expcap_hash_word(uint64_t h, uint64_t word)
+{
+    h = (h ^ word) * EXPCAP_HASH_MUL;
+    return h << 31 | h >> 33;
+}
+
+
+/* Add the next "len" bytes of a frame. Words are little endian */
+static inline void expcap_hash_add(expcap_hash_t* st, const void* data, int64_t len)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+
+    /* Finish off a word left over from the last chunk */
+    for(; (st->len & 7) && p < end; p++, st->len++){
+        st->word |= (uint64_t)*p << (st->len & 7) * 8;
+        if((st->len & 7) == 7){
+            st->h = expcap_hash_word(st->h, st->word);
+            st->word = 0;
+        }
+    }
+
+    st->len += (end - p) & ~7;
+    uint64_t h = st->h;
+    for(; p + 8 <= end; p += 8){
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        h = expcap_hash_word(h, word);
+    }
+    st->h = h;
+
+    for(; p < end; p++, st->len++){
+        st->word |= (uint64_t)*p << (st->len & 7) * 8;
+    }
+}
+
+
+static inline uint64_t expcap_hash_fin(const expcap_hash_t* st)
+{
+    uint64_t h = st->h;
+    if(st->len & 7){
+        h = expcap_hash_word(h, st->word);
+    }
+    h = expcap_hash_word(h, st->len);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/* Hash a whole frame */
+static inline uint64_t expcap_hash(const void* data, int64_t len)
+{
+    expcap_hash_t st;
+    expcap_hash_init(&st);
+    expcap_hash_add(&st, data, len);
+    return expcap_hash_fin(&st);
+}
+
+
+/* The payload hash of the packet with this footer, which must have one */
+static inline uint64_t expcap_hash_get(const expcap_pktftr_t* ftr)
+{
+    uint64_t h;
+    memcpy(&h, (const char*)ftr - EXPCAP_HASH_LEN, sizeof(h));
+    return h;
+}
+
+
+/* Bytes of packet data in a record with this caplen and footer */
+static inline int64_t expcap_data_len(int64_t caplen, const expcap_pktftr_t* ftr)
+{
+    return caplen - (int64_t)sizeof(expcap_pktftr_t) -
+           (ftr->flags & EXPCAP_FLAG_HASH ? EXPCAP_HASH_LEN : 0);
+}
+
+#endif /* SRC_DATA_STRUCTS_EXPCAP_HASH_H_ */
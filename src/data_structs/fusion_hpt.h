@@ -0,0 +1,29 @@
+#ifndef SRC_DATA_STRUCTS_FUSION_HPT_H_
+#define SRC_DATA_STRUCTS_FUSION_HPT_H_
+
+#include <stdint.h>
+#include <endian.h>
+
+#define be40toh(x) (be64toh(x) >> 24)
+
+typedef struct fusion_hpt_trailer  {
+    uint8_t device_id;
+    uint8_t port;
+    uint64_t seconds_since_epoch : 32;
+    uint64_t frac_seconds : 40;
+    uint8_t __reserved;
+    uint32_t new_fcs;
+} __attribute__((packed)) fusion_hpt_trailer_t;
+
+/* Get the time from a trailer. The fraction is in units of 2^-40 seconds, so
+ * psecs = frac * 10^12 / 2^40 = frac * 5^12 / 2^28, split up to fit in 64 bits */
+static inline void fusion_hpt_time(const fusion_hpt_trailer_t* trailer, uint64_t* secs, uint64_t* psecs)
+{
+    const uint64_t frac = be40toh(trailer->frac_seconds);
+    const uint64_t hi = (frac >> 20) * 244140625ULL;
+    const uint64_t lo = (frac & 0xFFFFF) * 244140625ULL;
+    *secs  = be32toh(trailer->seconds_since_epoch);
+    *psecs = (hi >> 8) + ((((hi & 0xFF) << 20) + lo) >> 28);
+}
+
+#endif /* SRC_DATA_STRUCTS_FUSION_HPT_H_ */
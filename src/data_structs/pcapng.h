@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Just enough pcapng to write captures in it: a section header, one
+ *  interface description block per capture port and an enhanced packet block
+ *  per packet. Interfaces have picosecond timestamps (if_tsresol), relative to
+ *  a whole second (if_tsoffset) as picoseconds since the epoch do not fit in
+ *  64 bits. What the expcap footer says about a packet goes into options on
+ *  its packet block: dropped packets as epb_dropcount, corrupt frames as a CRC
+ *  error in epb_flags, and the expcap flags as they are in a custom option.
+ *  Blocks are built in the caller's buffer, little endian like everything else.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_PCAPNG_H_
+#define SRC_DATA_STRUCTS_PCAPNG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "expcap.h"
+
+#define PCAPNG_SHB_TYPE  0x0A0D0D0A
+#define PCAPNG_IDB_TYPE  0x00000001
+#define PCAPNG_EPB_TYPE  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+enum {
+    PCAPNG_OPT_END           = 0,
+    PCAPNG_OPT_IF_NAME       = 2,
+    PCAPNG_OPT_IF_TSRESOL    = 9,
+    PCAPNG_OPT_IF_TSOFFSET   = 14,
+    PCAPNG_OPT_EPB_FLAGS     = 2,
+    PCAPNG_OPT_EPB_DROPCOUNT = 4,
+    PCAPNG_OPT_CUSTOM_BIN    = 19373, //Custom binary option, not to be copied
+};
+
+#define PCAPNG_TSRESOL_PS      12          /* 10^-12 seconds */
+#define PCAPNG_EPB_FLAG_IN     0x00000001  /* Inbound */
+#define PCAPNG_EPB_FLAG_CRCERR 0x01000000  /* CRC error */
+#define PCAPNG_PEN             9           /* For the custom option */
+
+/* Interface times count in picoseconds from a whole second, and 64 bits of
+ * picoseconds is a little over 213 days. Each interface starts a day before its
+ * first packet, so that packets a little earlier than it (e.g. with times from
+ * switch trailers) still fit */
+#define PCAPNG_TS_SPAN   18446743ULL
+#define PCAPNG_TS_MARGIN (24 * 60 * 60ULL)
+
+/* Longest blocks, not counting packet data */
+#define PCAPNG_SHB_LEN     28
+#define PCAPNG_IDB_MAX     64
+#define PCAPNG_EPB_MAX     72
+
+typedef struct __attribute__ ((packed)) pcapng_block_hdr {
+    uint32_t type;
+    uint32_t length;    /* Of the whole block, repeated at its end */
+} pcapng_block_hdr_t;
+
+typedef struct __attribute__ ((packed)) pcapng_epb {
+    pcapng_block_hdr_t hdr;
+    uint32_t if_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t len;
+} pcapng_epb_t;
+
+
+static inline char* pcapng_opt(char* buff, uint16_t code, const void* val, uint16_t len)
+{
+    memcpy(buff, &code, sizeof(code));
+    memcpy(buff + 2, &len, sizeof(len));
+    memcpy(buff + 4, val, len);
+    const uint16_t padded = (len + 3) & ~3;
+    memset(buff + 4 + len, 0, padded - len);
+    return buff + 4 + padded;
+}
+
+/* End the options and the block that starts at "start". Returns its length */
+static inline int64_t pcapng_end(char* start, char* buff, bool opts)
+{
+    if(opts){
+        memset(buff, 0, 4);
+        buff += 4;
+    }
+    const uint32_t length = buff - start + sizeof(uint32_t);
+    ((pcapng_block_hdr_t*)start)->length = length;
+    memcpy(buff, &length, sizeof(length));
+    return length;
+}
+
+
+/* Section header, which starts the file. Returns its length */
+static inline int64_t pcapng_shb(char* buff)
+{
+    pcapng_block_hdr_t* hdr = (pcapng_block_hdr_t*)buff;
+    hdr->type = PCAPNG_SHB_TYPE;
+
+    const uint32_t magic = PCAPNG_BYTE_ORDER_MAGIC;
+    const uint16_t version[2] = { 1, 0 };
+    const int64_t section_len = -1; /* Unknown */
+    char* p = buff + sizeof(*hdr);
+    memcpy(p, &magic, sizeof(magic));
+    memcpy(p + 4, version, sizeof(version));
+    memcpy(p + 8, &section_len, sizeof(section_len));
+    return pcapng_end(buff, p + 16, false);
+}
+
+
+/*
+ * Interface description for a capture port, named after it, with timestamps
+ * in picoseconds from "ts_secs". Returns its length.
+ */
+static inline int64_t pcapng_idb(char* buff, uint32_t snaplen, uint8_t dev_id,
+                                 uint8_t port_id, uint64_t ts_secs)
+{
+    pcapng_block_hdr_t* hdr = (pcapng_block_hdr_t*)buff;
+    hdr->type = PCAPNG_IDB_TYPE;
+
+    const uint16_t linktype = 1; /* DLT_EN10MB */
+    const uint16_t reserved = 0;
+    char* p = buff + sizeof(*hdr);
+    memcpy(p, &linktype, sizeof(linktype));
+    memcpy(p + 2, &reserved, sizeof(reserved));
+    memcpy(p + 4, &snaplen, sizeof(snaplen));
+    p += 8;
+
+    char name[16];
+    const int name_len = snprintf(name, sizeof(name), "exanic%u:%u", dev_id, port_id);
+    const uint8_t tsresol = PCAPNG_TSRESOL_PS;
+    p = pcapng_opt(p, PCAPNG_OPT_IF_NAME, name, name_len);
+    p = pcapng_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    p = pcapng_opt(p, PCAPNG_OPT_IF_TSOFFSET, &ts_secs, sizeof(ts_secs));
+    return pcapng_end(buff, p, true);
+}
+
+
+/* The if_tsoffset for an interface whose first packet is at "ts_secs" */
+static inline uint64_t pcapng_if_secs(uint64_t ts_secs)
+{
+    return ts_secs > PCAPNG_TS_MARGIN ? ts_secs - PCAPNG_TS_MARGIN : 0;
+}
+
+/* Can a time be given on an interface with this if_tsoffset? If not, the
+ * port needs a new interface */
+static inline bool pcapng_ts_fits(uint64_t ts_secs, uint64_t if_secs)
+{
+    return ts_secs >= if_secs && ts_secs - if_secs < PCAPNG_TS_SPAN;
+}
+
+
+/*
+ * Enhanced packet block on interface "if_id" for a packet with the given time
+ * and footer, "data" being "caplen" of its "len" bytes. The time must fit the
+ * interface, see pcapng_ts_fits(). Returns its length.
+ */
+static inline int64_t pcapng_epb(char* buff, uint32_t if_id, uint64_t ts_secs,
+                                 uint64_t ts_psecs, uint64_t if_secs,
+                                 const void* data, uint32_t caplen, uint32_t len,
+                                 const expcap_pktftr_t* ftr)
+{
+    const uint64_t ts = (ts_secs - if_secs) * 1000ULL * 1000 * 1000 * 1000 + ts_psecs;
+
+    pcapng_epb_t* epb = (pcapng_epb_t*)buff;
+    epb->hdr.type = PCAPNG_EPB_TYPE;
+    epb->if_id    = if_id;
+    epb->ts_high  = ts >> 32;
+    epb->ts_low   = ts;
+    epb->caplen   = caplen;
+    epb->len      = len;
+
+    char* p = (char*)(epb + 1);
+    memcpy(p, data, caplen);
+    const uint32_t padded = (caplen + 3) & ~3;
+    memset(p + caplen, 0, padded - caplen);
+    p += padded;
+
+    const bool opts = ftr->flags || ftr->foot.extra.dropped;
+    if(ftr->flags & EXPCAP_FLAG_CRPT){
+        const uint32_t flags = PCAPNG_EPB_FLAG_IN | PCAPNG_EPB_FLAG_CRCERR;
+        p = pcapng_opt(p, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+    }
+    if(!(ftr->flags & EXPCAP_FLAG_HASCRC) && ftr->foot.extra.dropped){
+        const uint64_t dropped = ftr->foot.extra.dropped;
+        p = pcapng_opt(p, PCAPNG_OPT_EPB_DROPCOUNT, &dropped, sizeof(dropped));
+    }
+    if(ftr->flags){
+        const uint32_t pen = PCAPNG_PEN;
+        char val[5];
+        memcpy(val, &pen, sizeof(pen));
+        val[4] = ftr->flags;
+        p = pcapng_opt(p, PCAPNG_OPT_CUSTOM_BIN, val, sizeof(val));
+    }
+    return pcapng_end(buff, p, opts);
+}
+
+#endif /* SRC_DATA_STRUCTS_PCAPNG_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  On-disk layout of a raw block device written by Exact Capture. The device
+ *  starts with a catalog header block, followed by a fixed number of catalog
+ *  blocks holding one entry per segment, followed by the data. Each segment
+ *  is a contiguous run of blocks holding exactly what an .expcap file would,
+ *  so exporting a segment is a straight copy.
+ */
+
+
+#ifndef SRC_DATA_STRUCTS_RAW_CATALOG_H_
+#define SRC_DATA_STRUCTS_RAW_CATALOG_H_
+
+#include <stdint.h>
+
+#define RAW_CATALOG_MAGIC   "EXCAPRAW"
+#define RAW_CATALOG_VERSION 2
+#define RAW_BLOCK           4096
+
+typedef struct __attribute__ ((packed)) raw_catalog_hdr {
+    char magic[8];         /* RAW_CATALOG_MAGIC, not null terminated */
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t data_start;   /* Device offset of the first segment */
+    uint64_t data_end;     /* Device offset of the end of the last segment */
+    uint64_t segments;     /* Catalog entries in use */
+    uint64_t max_segments;
+} raw_catalog_hdr_t;
+
+enum {
+    RAW_SEG_OPEN = 0x01, /* Still being written, or the writer stopped early */
+};
+
+#define RAW_SEG_PORTS 80
+
+/* 128B per entry. Times are the pcap timestamps (ns since the epoch) of the
+ * first packet of the first and last writes to the segment, so they are only
+ * accurate to within one write (one ring slot) */
+typedef struct __attribute__ ((packed)) raw_segment {
+    uint64_t start;       /* Device offset of the segment */
+    uint64_t end;         /* Device offset of the end of the segment */
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint32_t flags;
+    uint32_t _reserved;
+    uint64_t port_mask;   /* Bit dev_id * 8 + port_id, as in expcap_block_t */
+    char ports[RAW_SEG_PORTS]; /* Interfaces captured, comma separated, may be cut short */
+} raw_segment_t;
+
+#define RAW_CATALOG_BLOCKS    (256)
+#define RAW_SEGS_PER_BLOCK    (RAW_BLOCK / sizeof(raw_segment_t))
+#define RAW_MAX_SEGMENTS      (RAW_CATALOG_BLOCKS * RAW_SEGS_PER_BLOCK)
+#define RAW_DATA_START        ((1 + RAW_CATALOG_BLOCKS) * RAW_BLOCK)
+
+/* Device offset of the catalog block holding entry "seg" */
+#define RAW_SEG_BLOCK_OFF(seg) ((1 + (seg) / RAW_SEGS_PER_BLOCK) * RAW_BLOCK)
+
+#endif /* SRC_DATA_STRUCTS_RAW_CATALOG_H_ */
@@ -14,22 +14,61 @@
  *  requirements. It only has about 60ns to handle each fragment and maintain
  *  line rate. The writer requires that all data is 4K aligned. To solve this
  *  the listener inserts "dummy" packets to pad out to 4K whenever it syncs to
- *  the writer.
+ *  the writer. Packets can be sampled, in which case those left out are let go
+ *  by before any of them is copied, and counted in the block headers. Frames
+ *  can be hashed as they are copied, in which case the hash of every byte goes
+ *  in before the footer, however few of them the snap length lets through.
  */
 
 #include "exact-capture-listener.h"
 #include "data_structs/expcap.h"
+#include "data_structs/expcap_block.h"
+#include "data_structs/expcap_hash.h"
 #include "utils.h"
+#include "numa.h"
 
 extern volatile bool lstop;
 extern int64_t max_pkt_len;
 extern int64_t min_pcap_rec;
 extern int64_t max_pcap_rec;
+extern int64_t flush_max_latency_ns;
+extern double flush_max_padding;
+extern int64_t sample_every;
+extern int64_t sample_interval_ns;
+extern int64_t flow_budget;
+extern bool payload_hash;
 
 static __thread int dev_id;
 static __thread int port_id;
 static __thread lstats_t* lstats;
 
+/* Flows tracked for budgets, direct mapped by hash. Must be a power of 2 */
+#define SAMPLE_FLOWS 4096
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t start; /* NIC time that the flow's current second began */
+    int64_t count;  /* Packets kept since then */
+} sample_flow_t;
+
+typedef struct
+{
+    bool on;
+    int64_t every_count;
+    uint64_t interval_cycles;
+    uint64_t next_cycles;
+    uint64_t tick_hz;
+    sample_flow_t* flows;
+    int64_t block_skipped;  /* Left out since the last block was finished */
+    int64_t block_sbytes;
+} sample_state_t;
+
+static __thread sample_state_t sampler;
+
+/* Hash of the frame being copied, with --payload-hash */
+static __thread expcap_hash_t pkt_hash;
+
 /*Assumes there there never more than 64 listener threads!*/
 extern lstats_t lstats_all[MAX_ITHREADS];
 
@@ -41,117 +80,112 @@ typedef struct
 } ostream_state_t;
 
 
-static inline void add_dummy_packet(char* obuff,
-                                    char* dummy_data, int64_t dummy_rec_len,
-                                    int64_t prev_pkt_hw_time)
+/* Start a new buffer with a block header, disguised as a padding record.
+ * Return the number of bytes added */
+static inline int64_t start_block(char* obuff)
 {
+    expcap_block_t* blk = expcap_block_init((pcap_pkthdr_t*) (obuff),
+                                            EXPCAP_BLOCK_FLAG_RAWTS |
+                                            (sampler.on ? EXPCAP_BLOCK_FLAG_SAMPLED : 0));
+    blk->port_mask = expcap_block_port_bit(dev_id, port_id);
 
+    /* Give it a port so that tools reading it know which clock it is on */
+    expcap_pktftr_t* ftr = (expcap_pktftr_t*) (blk + 1);
+    ftr->dev_id  = dev_id;
+    ftr->port_id = port_id;
 
-    const int64_t dummy_payload_len = dummy_rec_len - sizeof(pcap_pkthdr_t) -
-            sizeof(expcap_pktftr_t);
-
-    ch_log_debug1("Adding dummy of pcap record of len=%li (payload=%li) to %p\n",
-                  dummy_rec_len, dummy_payload_len, obuff);
-
-    pcap_pkthdr_t* dummy_hdr = (pcap_pkthdr_t*) (obuff);
-    obuff += sizeof(pcap_pkthdr_t);
-
-    //Use the last ts value so the writer thread doesn't break
-    dummy_hdr->ts.raw = prev_pkt_hw_time;
-    dummy_hdr->caplen = dummy_rec_len - sizeof(pcap_pkthdr_t);
-    dummy_hdr->len = 0; /*This is an invalid dummy packet, 0 wire length */
-
-    memset(obuff, 0xFF, dummy_payload_len);
-    //memcpy (obuff, dummy_data, dummy_payload_len);
-    obuff += dummy_payload_len;
-
-    memset(obuff, 0xFF, sizeof(expcap_pktftr_t));
-    (void)dummy_data;
-    return;
-    expcap_pktftr_t* pkt_ftr = (expcap_pktftr_t*)(obuff);
-
-    obuff += sizeof(expcap_pktftr_t);
-    pkt_ftr->flags = 0;
-    pkt_ftr->foot.extra.dropped = 0;
+    return EXPCAP_BLOCK_REC;
+}
 
-    ch_log_debug1("Updated obuff to %p.\n", obuff);
 
+/* Fill in the block header once the buffer is complete */
+static inline void finish_block(char* obuff, int64_t data_len, int64_t length,
+                                int64_t packets, int64_t last_ts)
+{
+    pcap_pkthdr_t* hdr = (pcap_pkthdr_t*) (obuff);
+    expcap_block_t* blk = (expcap_block_t*) (hdr + 1);
+    const pcap_pkthdr_t* first = (pcap_pkthdr_t*) (obuff + EXPCAP_BLOCK_REC);
+
+    /* The writer converts this along with the packets' times */
+    hdr->ts.raw = packets ? first->ts.raw : last_ts;
+
+    blk->packets  = packets;
+    blk->length   = length;
+    blk->data_len = data_len;
+    blk->first_ts = hdr->ts.raw;
+    blk->last_ts  = last_ts;
+
+    /* Everything sampling left out while the block filled */
+    blk->skipped       = sampler.block_skipped;
+    blk->skipped_bytes = sampler.block_sbytes;
+    sampler.block_skipped = 0;
+    sampler.block_sbytes  = 0;
 }
 
 
-static inline void flush_buffer(eio_stream_t* ostream, int64_t bytes_added,
+/* Pad the buffer out to the next disk block and hand it to the writer. Returns
+ * the number of padding bytes that were added */
+static inline int64_t flush_buffer(eio_stream_t* ostream, int64_t bytes_added,
                   int64_t obuff_len, char* obuff, int64_t prev_pkt_hw_time,
-                  char* dummy_data)
+                  int64_t packets)
 {
 
     //Nothing to do if nothing was added
     if(bytes_added == 0)
     {
-        return;
+        return 0;
     }
 
     ch_log_debug1("Flushing at offset %li, buffer_start=%p, buffer_fin=%p\n",
                   bytes_added,
                   obuff,
                   obuff+obuff_len-1);
-    /* What is the minimum sized packet that we can squeeze in?
-     * Just a header and a footer, no content */
+    const int64_t padding = pad_to_block(obuff, bytes_added, obuff_len,
+                                         prev_pkt_hw_time);
+    finish_block(obuff, bytes_added, bytes_added + padding, packets,
+                 prev_pkt_hw_time);
+    bytes_added += padding;
+
+    /* At this point, we've padded up to the disk block boundary.
+     * Flush out to disk thread writer*/
+    eio_wr_rel(ostream, bytes_added, NULL);
 
-    ch_log_debug1("max pcap record=%li min pcap record=%li\n", max_pcap_rec,
-                  min_pcap_rec);
+    ch_log_debug1("Done flushing at %li bytes added\n", bytes_added);
+    return padding;
+}
 
-    /* Find the next disk block boundary with space for adding a minimum packet*/
-    const int64_t block_bytes = round_up(bytes_added + min_pcap_rec, DISK_BLOCK);
 
-    ch_log_debug1("Block bytes=%li\n", block_bytes);
-    ifunlikely(block_bytes > obuff_len)
+/*
+ * Work out how long to wait before flushing a partially filled buffer. The
+ * padding added by a flush is at most about one disk block, so to keep the
+ * padding below flush_max_padding of each flush we need to collect at least
+ * DISK_BLOCK / flush_max_padding bytes. The (EWMA) receive rate tells us how
+ * long that will take. The result is bounded below by FLUSH_MIN_NS (so that
+ * moderate rates don't generate more flushes than a fixed timeout would) and
+ * above by the maximum allowed latency.
+ */
+static inline int64_t flush_timeout_ns(double rate_bpns)
+{
+    ifunlikely(flush_max_latency_ns <= FLUSH_MIN_NS || flush_max_padding >= 1.0)
     {
-        ch_log_fatal("Assumption violated %li > %li\n", block_bytes, obuff_len);
+        return MIN(flush_max_latency_ns, FLUSH_MIN_NS);
     }
 
-    /* How many bytes do we need to write? */
-    int64_t remain = block_bytes - bytes_added;
+    const double need_bytes = DISK_BLOCK / flush_max_padding;
+    const double need_ns = rate_bpns > 0 ? need_bytes / rate_bpns :
+                                           flush_max_latency_ns;
 
-    ch_log_debug1("Remain bytes=%li\n", remain);
-
-    /* Fill out the remaining space with packets no smaller than min_packet, and
-     * no larger than max_packet. Assume that remain is at least as big as a
-     * minimum sized packet (which is enforced above).
-     */
-    while(remain > 0)
+    if(need_ns <= FLUSH_MIN_NS)
     {
-        ch_log_debug1("Remain:%li, added:%li max %li (problem=%i)\n",
-                      remain, bytes_added, obuff_len, bytes_added > obuff_len);
-
-        if(remain <= max_pcap_rec){
-            add_dummy_packet(obuff + bytes_added, dummy_data, remain,
-                             prev_pkt_hw_time);
-            ch_log_debug1("Added dummy of size %li\n", remain);
-            bytes_added += remain;
-            remain -= remain;
-            break;
-        }
-        else if(remain - max_pcap_rec < min_pcap_rec){
-            add_dummy_packet(obuff + bytes_added, dummy_data, min_pcap_rec,
-                             prev_pkt_hw_time);
-            ch_log_debug1("Added dummy of size %li\n", min_pcap_rec);
-            remain -= min_pcap_rec;
-            bytes_added += min_pcap_rec;
-        }
-        else{
-            add_dummy_packet(obuff + bytes_added, dummy_data, max_pcap_rec,
-                             prev_pkt_hw_time);
-            ch_log_debug1("Added dummy of size %li\n", max_pcap_rec);
-            remain -= max_pcap_rec;
-            bytes_added += max_pcap_rec;
-        }
+        return FLUSH_MIN_NS;
     }
 
-    /* At this point, we've padded up to the disk block boundary.
-     * Flush out to disk thread writer*/
-    eio_wr_rel(ostream, bytes_added, NULL);
+    if(need_ns >= flush_max_latency_ns)
+    {
+        return flush_max_latency_ns;
+    }
 
-    ch_log_debug1("Done flushing at %li bytes added\n", bytes_added);
+    return (int64_t)need_ns;
 }
 
 /* Finish off a packet in the obuff by adding a footer. Return the number of bytes added */
@@ -159,19 +193,33 @@ static inline int64_t fin_packet(pcap_pkthdr_t* hdr, char* obuff, uint8_t flags,
         int64_t* dropped, int dev_id, int port_id)
 {
 
-    expcap_pktftr_t* pkt_ftr = (expcap_pktftr_t*) (obuff);
+    int64_t added = 0;
+
+    /* The payload hash goes between the data and the footer */
+    ifunlikely(payload_hash)
+    {
+        const uint64_t hash = expcap_hash_fin (&pkt_hash);
+        memcpy (obuff, &hash, sizeof(hash));
+        hdr->caplen += EXPCAP_HASH_LEN;
+        added += EXPCAP_HASH_LEN;
+        flags |= EXPCAP_FLAG_HASH;
+    }
+
+    expcap_pktftr_t* pkt_ftr = (expcap_pktftr_t*) (obuff + added);
 
     /* Are we sure? Doing this means that caplen > len, which is technically a
      * PCAP violation? But the bytes here didn't come off the wire? */
     hdr->caplen += sizeof(expcap_pktftr_t);
     pkt_ftr->flags = flags;
+    pkt_ftr->ts_secs  = 0; /* Filled in by the writer, or exact-pcap-retime */
+    pkt_ftr->ts_psecs = 0;
     pkt_ftr->foot.extra.dropped = *dropped;
     pkt_ftr->dev_id  = dev_id;
     pkt_ftr->port_id = port_id;
     *dropped = 0;
 
 
-    return sizeof(expcap_pktftr_t);
+    return added + sizeof(expcap_pktftr_t);
 }
 
 
@@ -180,6 +228,13 @@ static inline int64_t cpy_frag(pcap_pkthdr_t* hdr, char* const obuff,
                                char* ibuff, int64_t ibuff_len)
 {
     int64_t added = 0;
+
+    /* Hash all of it, not just what is copied */
+    ifunlikely(payload_hash)
+    {
+        expcap_hash_add (&pkt_hash, ibuff, ibuff_len);
+    }
+
     /* Only copy as much as the caplen */
     iflikely(hdr->len < max_pkt_len)
     {
@@ -202,6 +257,180 @@ static inline int64_t cpy_frag(pcap_pkthdr_t* hdr, char* const obuff,
 }
 
 
+static inline uint64_t hash_mix (uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+
+/* Hash the 5-tuple of a frame, from its first chunk. Frames that are not IP
+ * use their MACs and ethertype instead */
+static inline uint64_t flow_hash (const uint8_t* frame, int64_t len)
+{
+    int64_t off = 12;
+    if (len < off + 2)
+    {
+        return 0;
+    }
+
+    /* Skip VLAN tags */
+    uint16_t type = frame[off] << 8 | frame[off + 1];
+    while ((type == 0x8100 || type == 0x88A8) && len >= off + 6)
+    {
+        off += 4;
+        type = frame[off] << 8 | frame[off + 1];
+    }
+    off += 2;
+
+    uint64_t h = 0;
+    uint64_t word = 0;
+    int64_t l4 = 0; /* Offset of the ports, if there are any */
+    uint8_t proto = 0;
+    if (type == 0x0800 && len >= off + 20)
+    {
+        proto = frame[off + 9];
+        memcpy (&word, frame + off + 12, sizeof(word));
+        h = hash_mix (h, word);
+
+        /* Only the first fragment of a datagram has ports */
+        const bool later_frag = (frame[off + 6] & 0x1F) | frame[off + 7];
+        l4 = later_frag ? 0 : off + (frame[off] & 0x0F) * 4;
+    }
+    else if (type == 0x86DD && len >= off + 40)
+    {
+        proto = frame[off + 6];
+        for (int i = 0; i < 32; i += sizeof(word))
+        {
+            memcpy (&word, frame + off + 8 + i, sizeof(word));
+            h = hash_mix (h, word);
+        }
+        l4 = off + 40;
+    }
+    else
+    {
+        memcpy (&word, frame, sizeof(word));
+        h = hash_mix (h, word);
+        uint32_t rest = 0;
+        memcpy (&rest, frame + 8, sizeof(rest));
+        return hash_mix (h, (uint64_t)type << 32 | rest);
+    }
+
+    h = hash_mix (h, proto);
+    if (l4 && (proto == 6 || proto == 17 || proto == 132) && len >= l4 + 4)
+    {
+        uint32_t ports = 0;
+        memcpy (&ports, frame + l4, sizeof(ports));
+        h = hash_mix (h, ports);
+    }
+    return h;
+}
+
+
+/* Decide whether to keep a packet, from its first chunk, before any of it is
+ * copied. It must get past each of the sampling policies that is on */
+static inline bool sample_keep (const char* frame, int64_t len, uint64_t now)
+{
+    /* One in every N */
+    if (sample_every > 1 && sampler.every_count++ % sample_every)
+    {
+        return false;
+    }
+
+    /* At most one per interval */
+    if (sampler.interval_cycles)
+    {
+        if (now < sampler.next_cycles)
+        {
+            return false;
+        }
+        sampler.next_cycles = now + sampler.interval_cycles;
+    }
+
+    /* At most flow_budget per flow per second. A flow that finds another in
+     * its place in the table takes it over, starting a new second */
+    if (sampler.flows)
+    {
+        const uint64_t hash = flow_hash ((const uint8_t*)frame, len);
+        sample_flow_t* flow = &sampler.flows[hash & (SAMPLE_FLOWS - 1)];
+        if (flow->hash != hash || now - flow->start >= sampler.tick_hz)
+        {
+            flow->hash  = hash;
+            flow->start = now;
+            flow->count = 0;
+        }
+        if (flow->count >= flow_budget)
+        {
+            return false;
+        }
+        flow->count++;
+    }
+
+    return true;
+}
+
+
+/* Let a packet that sampling leaves out go by, without copying any of it. The
+ * first chunk has already been acquired. Returns 0 as nothing was added */
+static inline int64_t skip_packet (eio_stream_t* istream, eio_error_t err,
+                                   char* ibuff, int64_t ibuff_len)
+{
+    int64_t len = 0;
+    for (;; err = eio_rd_acq (istream, &ibuff, &ibuff_len, NULL),
+            lstats->spinsP_rx++)
+    {
+        switch(err)
+        {
+            case EIO_ETRYAGAIN:
+                continue;
+
+            case EIO_EFRAG_CPT:
+            case EIO_EFRAG_ABT:
+                lstats->errors++;
+                /* Fall through */
+            case EIO_EFRAG_MOR:
+            case EIO_ENONE:
+                len += ibuff_len;
+                break;
+
+            /* Overflows lose the rest of the packet, as in rx_packet() */
+            case EIO_ESWOVFL:
+                lstats->swofl++;
+                eio_rd_rel(istream, NULL);
+                err = eio_rd_acq(istream, NULL, NULL, NULL);
+                eio_rd_rel(istream, NULL);
+                return 0;
+
+            case EIO_EHWOVFL:
+                lstats->hwofl++;
+                eio_rd_rel(istream, NULL);
+                err = eio_rd_acq(istream, NULL, NULL, NULL);
+                eio_rd_rel(istream, NULL);
+                return 0;
+
+            default:
+                ch_log_fatal("Unexpected error code %i\n", err);
+        }
+
+        if(eio_rd_rel(istream, NULL)){
+            return 0;
+        }
+
+        if(err != EIO_EFRAG_MOR){
+            break;
+        }
+    }
+
+    lstats->packets_rx++;
+    lstats->bytes_rx += len;
+    lstats->skipped++;
+    lstats->sbytes += len;
+    sampler.block_skipped++;
+    sampler.block_sbytes += len;
+    return 0;
+}
+
+
 static i64 rx_packets = 0;
 
 /* This func tries to rx one packet and returns the number of bytes RX'd.
@@ -251,6 +480,19 @@ static inline int64_t rx_packet ( eio_stream_t* istream,  char* const obuff,
     }
 
     rx_packets++;
+
+    /* Leave the packet out now, if sampling says to, before copying it */
+    ifunlikely(sampler.on && err != EIO_ESWOVFL && err != EIO_EHWOVFL &&
+               !sample_keep (ibuff, ibuff_len, *rx_time))
+    {
+        return skip_packet (istream, err, ibuff, ibuff_len);
+    }
+
+    ifunlikely(payload_hash)
+    {
+        expcap_hash_init (&pkt_hash);
+    }
+
     /* Note, no use of lstop: don't stop in the middle of RX'ing a packet */
     for (;; err = eio_rd_acq (istream, &ibuff, &ibuff_len, NULL),
             lstats->spinsP_rx++)
@@ -392,7 +634,8 @@ static inline int get_obuff(int64_t curr_ostream, int64_t num_ostreams,
  * requirements. It only has about 60ns to handle each fragment and maintain
  * line rate. The writer requires that all data is 4K aligned. To solve this the
  * listener inserts "dummy" packets to pad out to 4K whenever it syncs to the
- * writer.
+ * writer. Each buffer starts with a block header describing it (see
+ * data_structs/expcap_block.h).
  */
 
 void* listener_thread (void* params)
@@ -401,23 +644,35 @@ void* listener_thread (void* params)
     ch_log_debug1("Creating exanic listener thread id=%li on interface=%s\n",
                     lparams->ltid, lparams->interface);
 
-    /*
-     * Set up a dummy packet to pad out extra space when needed
-     * dummy packet areas are per thread to avoid falsely sharing memory
-     */
-    char dummy_data[DISK_BLOCK * 2];
-    init_dummy_data(dummy_data, DISK_BLOCK *2);
-
     const CH_VECTOR(cstr)* dests = lparams->dests;
     const int64_t num_ostreams = dests->count;
+    const int64_t output_writers = lparams->output_writers;
     char* iface = lparams->interface;
     const int64_t ltid = lparams->ltid; /* Listener thread id */
+    const int64_t warmup_start_ns = time_now_ns();
 
     /* Thread local storage parameters */
     dev_id  = lparams->exanic_dev_num;
     port_id = lparams->exanic_port;
     lstats  = &lstats_all[ltid];
 
+    /* Sampling times are in NIC timestamp cycles */
+    sampler.on = sample_every > 1 || sample_interval_ns > 0 || flow_budget > 0;
+    sampler.tick_hz = exanic_get_tick_hz (lparams->nic);
+    if (sample_interval_ns > 0)
+    {
+        sampler.interval_cycles = MAX(1, (uint64_t)((double)sample_interval_ns *
+                                                    sampler.tick_hz / 1e9));
+    }
+    if (flow_budget > 0)
+    {
+        sampler.flows = calloc (SAMPLE_FLOWS, sizeof(sample_flow_t));
+        if (!sampler.flows)
+        {
+            ch_log_fatal("Could not allocate memory for flow budgets\n");
+        }
+    }
+
     eio_stream_t* istream = NULL;
     eio_args_t inargs;
     bzero(&inargs,sizeof(inargs));
@@ -430,6 +685,7 @@ void* listener_thread (void* params)
     if (err)
     {
         ch_log_fatal("Could not create listener input stream %s\n");
+        lparams->failed = true;
         return NULL;
     }
 
@@ -447,6 +703,7 @@ void* listener_thread (void* params)
         if (err)
         {
             ch_log_error("Could not create listener input stream %s\n");
+            lparams->failed = true;
             return NULL;
         }
     }
@@ -461,6 +718,7 @@ void* listener_thread (void* params)
     char bring_name[BRING_NAME_LEN + 1] = {0}; /* +1 = space for null terminator */
 
     ostream_state_t ostreams[num_ostreams];
+    eio_stream_t* brings[num_ostreams];
     for (int ostr_idx = 0; ostr_idx < num_ostreams; ostr_idx++)
     {
         const char* dest = dests->first[ostr_idx];
@@ -507,6 +765,10 @@ void* listener_thread (void* params)
         outargs.args.bring.isserver = 1;
         outargs.args.bring.slot_size  = BRING_SLOT_SIZE;
         outargs.args.bring.slot_count = BRING_SLOT_COUNT;
+        outargs.args.bring.unidirectional = 1;
+        outargs.args.bring.numa_bind  = lparams->numa_node != NUMA_NODE_UNKNOWN;
+        outargs.args.bring.numa_node  = lparams->numa_node;
+        outargs.args.bring.defer_connect = 1;
         ch_log_debug1("slots=%li, slot_count=%li\n", outargs.args.bring.slot_size,
                       outargs.args.bring.slot_count);
         if (eio_new (&outargs, &ostream))
@@ -514,8 +776,10 @@ void* listener_thread (void* params)
             ch_log_error(
                     "Could not create listener output stream with name %s\n",
                     bring_name);
+            lparams->failed = true;
             return NULL;
         }
+        brings[ostr_idx] = ostream;
 
         if (lparams->dummy_ostream)
         {
@@ -530,6 +794,7 @@ void* listener_thread (void* params)
                 ch_log_error(
                         "Could not create listener output stream with name %s\n",
                         bring_name);
+                lparams->failed = true;
                 return NULL;
             }
             ch_log_debug1(
@@ -541,10 +806,26 @@ void* listener_thread (void* params)
         ostreams[ostr_idx].ostream = ostream;
         ostreams[ostr_idx].pcap_hdr = false;
     }
+
+    /* All brings exist now, so writers can connect to them in any order */
+    for (int ostr_idx = 0; ostr_idx < num_ostreams; ostr_idx++)
+    {
+        if (bring_wait_client (brings[ostr_idx]))
+        {
+            ch_log_error("Writer did not connect to listener output stream %i\n",
+                         ostr_idx);
+            lparams->failed = true;
+            return NULL;
+        }
+    }
     ch_log_debug1(
             "Done setting up exanic listener bring streams for interface %s\n",
             iface);
 
+    lparams->warmup_ns = time_now_ns() - warmup_start_ns;
+    __sync_synchronize();
+    lparams->ready = true;
+
     //**************************************************************************
     //Listener - Real work begins here!
     //**************************************************************************
@@ -554,12 +835,17 @@ void* listener_thread (void* params)
     /* May want to change this depending on scheduling goals */
     int64_t curr_ostream = ltid;
     int64_t bytes_added = 0;
+    int64_t block_packets = 0;
 
 
+    /* Adaptive flush timeout. Track the receive rate with an EWMA so that
+     * we can decide how long to wait before flushing a partial buffer */
+    const double rate_alpha = 0.25;
+    double rate_bpns = 0; /* Bytes per nanosecond */
     int64_t now;
-    const int64_t maxwaitns = 1000 * 1000 * 100;
     eio_nowns (&now);
-    int64_t timeout = now + maxwaitns; //100ms timeout
+    int64_t buff_start = now;
+    int64_t timeout = now + flush_timeout_ns(rate_bpns);
     exanic_cycles_t prev_pkt_hw_time = 0;
 
     int64_t dropped = 0;
@@ -567,7 +853,8 @@ void* listener_thread (void* params)
     const int64_t expcap_foot_size = (int64_t)sizeof(expcap_pktftr_t);
     const int64_t pcap_head_size = (int64_t)sizeof(pcap_pkthdr_t);
     const int64_t max_pcap_rec = max_pkt_len + pcap_head_size
-                                        + expcap_foot_size;
+                                        + expcap_foot_size
+                                        + (payload_hash ? EXPCAP_HASH_LEN : 0);
 
 
     while (!lstop)
@@ -583,27 +870,40 @@ void* listener_thread (void* params)
          * buffer to be block aligned size for high speed writes to disk.
          *
          * 2) There has been a timeout and there are packets waiting (not just a
-         * pre-prepared pcap header. We do this so that packets don't wait too
-         * long before timestamp conversions and things happen.
+         * block header). We do this so that packets don't wait too long before
+         * timestamp conversions and things happen.
          */
 
         const bool buff_full = obuff_len - bytes_added <  max_pcap_rec * 2;
-        const bool timed_out = now >= timeout && bytes_added > pcap_head_size;
+        const bool timed_out = now >= timeout && block_packets > 0;
         ifunlikely( obuff && (buff_full || timed_out))
         {
             ch_log_debug1( "Buffer flush: buff_full=%i, timed_out =%i, obuff_len (%li) - bytes_added (%li) = %li < full_packet_size x 2 (%li) = (%li)\n",
                     buff_full, timed_out, obuff_len, bytes_added, obuff_len - bytes_added, max_pcap_rec * 2);
 
-            flush_buffer(ostreams[curr_ostream].ostream, bytes_added,
-                    obuff_len, obuff, prev_pkt_hw_time,
-                    dummy_data);
+            lstats->pbytes += flush_buffer(ostreams[curr_ostream].ostream,
+                    bytes_added, obuff_len, obuff, prev_pkt_hw_time,
+                    block_packets);
+
+            /* Take turns between the writers of an output, so that they
+             * share its load evenly */
+            ifunlikely(output_writers > 1)
+            {
+                const int64_t first = curr_ostream - curr_ostream % output_writers;
+                curr_ostream = first + (curr_ostream + 1 - first) % output_writers;
+            }
 
-            /* Reset the timer and the buffer */
+            /* Update the rate estimate, reset the timer and the buffer */
             eio_nowns(&now);
-            timeout = now + maxwaitns;
+            const int64_t fill_ns = MAX(now - buff_start, 1);
+            rate_bpns = rate_alpha * ((double)bytes_added / fill_ns) +
+                        (1 - rate_alpha) * rate_bpns;
+            buff_start = now;
+            timeout = now + flush_timeout_ns(rate_bpns);
             obuff = NULL;
             obuff_len = 0;
             bytes_added = 0;
+            block_packets = 0;
         }
 
         while(!obuff && !lstop)
@@ -648,6 +948,12 @@ void* listener_thread (void* params)
             goto finished;
         }
 
+        /* Every buffer starts with a block header */
+        ifunlikely(bytes_added == 0)
+        {
+            bytes_added = start_block(obuff);
+        }
+
         /* This func tries to rx one packet it returns the number of bytes RX'd
          * this may be zero if no packet was RX'd, or if there was an error */
         const int64_t rx_bytes = rx_packet(istream, obuff + bytes_added, obuff +
@@ -667,6 +973,7 @@ void* listener_thread (void* params)
         }
 
         bytes_added += rx_bytes;
+        block_packets += rx_bytes > 0;
 
         ifassert(bytes_added > obuff_len)
         {
@@ -684,21 +991,23 @@ finished:
                 lparams->interface);
 
 
-    //Remove any last headers that are waiting
-    if(bytes_added == sizeof(pcap_pkthdr_t))
+    //Remove a block header that has no packets after it
+    if(block_packets == 0)
     {
         bytes_added = 0;
     }
 
     if(obuff){
-        flush_buffer(ostreams[curr_ostream].ostream, bytes_added, obuff_len,
-                obuff, prev_pkt_hw_time, dummy_data);
+        lstats->pbytes += flush_buffer(ostreams[curr_ostream].ostream,
+                bytes_added, obuff_len, obuff, prev_pkt_hw_time,
+                block_packets);
     }
 
     ch_log_debug1("Listener thread %i for %s done.\n", lparams->ltid,
                 lparams->interface);
 
     eio_des (istream); 
+    free (sampler.flows);
     //free(params); ??
     return NULL;
 }
@@ -41,6 +41,7 @@ typedef struct
 {
     char* interface;
     CH_VECTOR(cstr)* dests;
+    int64_t output_writers; /* Consecutive dests that share an output */
     volatile bool* stop;
     bool dummy_istream;
     bool dummy_ostream;
@@ -54,6 +55,14 @@ typedef struct
     bool kernel_bypass;
     bool promisc;
 
+    int numa_node; /* Node to allocate bring memory on */
+
+    /* Set once all brings are created and warm, just before polling begins,
+     * or "failed" if they could not be */
+    volatile bool ready;
+    volatile bool failed;
+    int64_t warmup_ns;
+
 } listener_params_t;
 
 void* listener_thread (void* params);
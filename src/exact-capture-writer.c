@@ -14,15 +14,39 @@
 
 #include "exact-capture-writer.h"
 #include "data_structs/expcap.h"
+#include "data_structs/expcap_clock.h"
+#include "data_structs/expcap_hash.h"
+#include "data_structs/fusion_hpt.h"
+#include "data_structs/raw_catalog.h"
+#include "trigger.h"
+#include "blkdev.h"
 
 #include <netinet/ip.h>
+#include <errno.h>
+#include <time.h>
 
 
 extern volatile bool wstop;
 extern const bool nsec_pcap;
 extern int64_t max_pkt_len;
 extern int64_t max_file_size;
+extern int64_t rotate_ns;
+extern int64_t ring_files;
+extern int64_t ring_ns;
 extern int64_t max_pcap_rec;
+extern int64_t min_pcap_rec;
+extern int64_t coalesce_bytes;
+extern int64_t flush_max_latency_ns;
+extern int64_t burst_bytes;
+extern int64_t trigger_pre_ns;
+extern int64_t trigger_post_ns;
+extern int64_t stripe_bytes;
+extern bool buffered_io;
+extern bool defer_ts;
+extern bool raw_init;
+extern int64_t merge_ns;
+extern ts_trailer_t ts_trailer;
+extern out_format_t out_format;
 
 extern wstats_t wstats[MAX_OTHREADS];
 
@@ -51,31 +75,47 @@ int set_direct (int desc, bool on)
 }
 
 
+/* Fill in a pcap file header */
+static inline void init_pcap_header (pcap_file_header_t* hdr, bool nsec_pcap,
+                                     int16_t snaplen)
+{
+    hdr->magic = nsec_pcap ? NSEC_TCPDUMP_MAGIC : TCPDUMP_MAGIC;
+    hdr->version_major = PCAP_VERSION_MAJOR;
+    hdr->version_minor = PCAP_VERSION_MINOR;
+    hdr->thiszone = 0;
+    hdr->sigfigs = 0; /* 9? libpcap always writes 0 */
+    hdr->snaplen = snaplen;
+    hdr->linktype = DLT_EN10MB;
+}
+
+
 /**
  * This function writes out a pcap file header to the given ostream. It pads
- * the write so that it is 4K aligned.
+ * the write so that it is 4K aligned, or out to a whole stripe so that the
+ * packet data after it starts on a stripe boundary.
  */
 static inline eio_error_t write_pcap_header (eio_stream_t* ostream,
-                                             bool nsec_pcap, int16_t snaplen)
+                                             bool nsec_pcap, int16_t snaplen,
+                                             const io_geom_t* geom)
 {
 
     char dummy_data[DISK_BLOCK];
     init_dummy_data(dummy_data, DISK_BLOCK);
 
+    const int64_t head_len = geom->stripe ? geom->stripe : DISK_BLOCK;
 
     ch_log_debug1("*** Creating pcap header\n");
-    char* pcap_head_block = aligned_alloc (DISK_BLOCK, DISK_BLOCK);
+    char* pcap_head_block = aligned_alloc (geom->block, head_len);
+    if (!pcap_head_block)
+    {
+        ch_log_error("Could not allocate %liB pcap header\n", head_len);
+        return EIO_ENOMEM;
+    }
 
     ch_log_debug1("Block size=%li\n", DISK_BLOCK);
 
     pcap_file_header_t* hdr = (pcap_file_header_t*) pcap_head_block;
-    hdr->magic = nsec_pcap ? NSEC_TCPDUMP_MAGIC : TCPDUMP_MAGIC;
-    hdr->version_major = PCAP_VERSION_MAJOR;
-    hdr->version_minor = PCAP_VERSION_MINOR;
-    hdr->thiszone = 0;
-    hdr->sigfigs = 0; /* 9? libpcap always writes 0 */
-    hdr->snaplen = snaplen;
-    hdr->linktype = DLT_EN10MB;
+    init_pcap_header (hdr, nsec_pcap, snaplen);
 
     ch_log_debug1("*** PCAP HDR size=%li\n", sizeof(pcap_file_header_t));
 
@@ -92,8 +132,14 @@ static inline eio_error_t write_pcap_header (eio_stream_t* ostream,
     char* pkt_data = (char*) (pkt_hdr + 1);
     memcpy (pkt_data, dummy_data, dummy_packet_len);
 
+    /* Fill the rest of the stripe with dummy records that readers skip */
+    if (head_len > DISK_BLOCK)
+    {
+        pad_to_size (pcap_head_block, DISK_BLOCK, head_len, head_len, 0);
+    }
+
     char* wr_buff = pcap_head_block;
-    int64_t len = DISK_BLOCK;
+    int64_t len = head_len;
     eio_error_t err = eio_wr_acq (ostream, &wr_buff, &len, NULL);
     if (err)
     {
@@ -103,7 +149,7 @@ static inline eio_error_t write_pcap_header (eio_stream_t* ostream,
     }
 
     //Now flush to disk
-    err = eio_wr_rel (ostream, DISK_BLOCK, NULL);
+    err = eio_wr_rel (ostream, head_len, NULL);
     if (err)
     {
         ch_log_error("Could not write to disk with unexpected error %i\n", err);
@@ -114,30 +160,180 @@ static inline eio_error_t write_pcap_header (eio_stream_t* ostream,
 }
 
 /*
- * Open a new output file with the path "dest". An ISO timestamp is added to
- * the path and a PCAP header written into the file.
+ * Output file names are "<dest>-<id>.expcap". With time based rotation the
+ * UTC start and length of the file's window are included too, as
+ * "<dest>-<YYYYmmddTHHMMSSZ>-<secs>s-<id>.expcap", where the id counts files
+ * within the window. Plain pcap and pcapng files end in ".pcap" and ".pcapng"
+ * instead.
+ */
+static void file_name (char* buff, int64_t len, char* dest, int64_t window_ns,
+                       int64_t file_id)
+{
+    const char* ext = out_format == OUT_FORMAT_PCAP   ? "pcap" :
+                      out_format == OUT_FORMAT_PCAPNG ? "pcapng" : "expcap";
+    if (rotate_ns <= 0)
+    {
+        snprintf(buff, len, "%s-%li.%s", dest, file_id, ext);
+        return;
+    }
+
+    char start[32] = {0};
+    struct tm tm;
+    const time_t secs = window_ns / (1000 * 1000 * 1000);
+    gmtime_r (&secs, &tm);
+    strftime (start, sizeof(start), "%Y%m%dT%H%M%SZ", &tm);
+    snprintf(buff, len, "%s-%s-%lis-%li.%s", dest, start,
+             rotate_ns / (1000 * 1000 * 1000), file_id, ext);
+}
+
+
+/* Name of a file prepared ahead of time, before it is given its real name */
+static void file_name_prep (char* buff, int64_t len, char* dest,
+                            int64_t prep_id)
+{
+    snprintf(buff, len, "%s.%li.prep", dest, prep_id);
+}
+
+
+/*
+ * A file can run past max_file_size by up to one slot before it is rotated,
+ * plus the header and the padding that makes the last write whole blocks.
+ */
+int64_t file_prealloc_size (const io_geom_t* geom)
+{
+    if (max_file_size <= 0)
+    {
+        return 0;
+    }
+
+    const int64_t head_len = geom->stripe ? geom->stripe : DISK_BLOCK;
+    const int64_t pad_len = geom->block > DISK_BLOCK ? geom->block : 0;
+    return max_file_size + BRING_SLOT_SIZE + head_len + pad_len;
+}
+
+
+/*
+ * Some file systems (tmpfs, some network and overlay file systems) refuse
+ * O_DIRECT. Find out up front with a throw away file in the output directory,
+ * unnamed where the file system allows it. Anything that stops the probe
+ * being made is taken to mean no, opening the real files will say why.
  */
-eio_error_t open_file (char* dest, bool null_ostream,
-                       eio_stream_t** ostream, int64_t file_id)
+static bool direct_supported (const char* destination)
+{
+    char dir[1024];
+    snprintf (dir, sizeof(dir), "%s", destination);
+    char* slash = strrchr (dir, '/');
+    if (!slash)
+    {
+        snprintf (dir, sizeof(dir), ".");
+    }
+    else
+    {
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+
+    int fd = open (dir, O_TMPFILE | O_WRONLY | O_DIRECT, 0600);
+    if (fd < 0 && errno != EINVAL)
+    {
+        /* No O_TMPFILE here. Clear out any probe left behind by a crash */
+        char probe[1024];
+        snprintf (probe, sizeof(probe), "%s.direct-probe", destination);
+        unlink (probe);
+        fd = open (probe, O_WRONLY | O_CREAT | O_EXCL | O_DIRECT, 0600);
+        unlink (probe);
+    }
+    if (fd < 0)
+    {
+        return false;
+    }
+    close (fd);
+    return true;
+}
+
+
+void dest_geometry (const char* destination, io_geom_t* geom)
 {
+    const bool raw = !strncmp (destination, RAW_DEST_PREFIX,
+                               strlen(RAW_DEST_PREFIX));
+    const char* path = destination + (raw ? strlen(RAW_DEST_PREFIX) : 0);
+
+    int64_t logical = 0;
+    int64_t optimal = 0;
+    blkdev_io_sizes (path, &logical, &optimal);
+
+    geom->block = MAX(logical, DISK_BLOCK);
+    if (geom->block % DISK_BLOCK || geom->block > MAX_STRIPE)
+    {
+        ch_log_warn("Ignoring unusual %liB logical block size of %s\n",
+                    logical, path);
+        geom->block = DISK_BLOCK;
+        optimal = 0;
+    }
+
+    /* An optimal size that is not whole blocks is no help, ignore it */
+    int64_t stripe = stripe_bytes > 0 ? stripe_bytes : optimal;
+    if (stripe % geom->block || stripe > MAX_STRIPE)
+    {
+        ch_log_warn("Ignoring %liB stripe on %s, it is not a multiple of the "
+                    "%liB block size or is over %iMB\n", stripe, path,
+                    geom->block, MAX_STRIPE / 1024 / 1024);
+        stripe = 0;
+    }
+
+    /* Large sector devices still need whole sectors */
+    stripe = MAX(stripe, geom->block);
+    geom->stripe = stripe > DISK_BLOCK ? stripe : 0;
+
+    ch_log_debug1("Destination %s has %liB blocks, %liB stripes\n",
+                  destination, geom->block, geom->stripe);
 
-    char final_format[1024] = {0};
-    snprintf(final_format, 1024, "%s-%li.expcap", dest, file_id  );
+    /* Raw devices are always written with O_DIRECT */
+    if (raw)
+    {
+        return;
+    }
+
+    geom->writeback = 0;
+    if (buffered_io)
+    {
+        geom->writeback = WRITEBACK_CHUNK;
+    }
+    else if (!direct_supported (destination))
+    {
+        ch_log_warn("%s does not support O_DIRECT, falling back to buffered "
+                    "writes\n", destination);
+        geom->writeback = WRITEBACK_CHUNK;
+    }
+    ch_log_info("Output %s: %s I/O\n", destination,
+                geom->writeback ? "buffered (paced writeback)" : "direct");
+}
 
 
+/*
+ * Open a new output file called "filename" and write a PCAP header into it.
+ * With "overwrite", an existing file is written over in place, reusing its
+ * disk blocks. Plain pcap and pcapng files get their header with the first packets
+ * instead, see plain_open().
+ */
+eio_error_t open_file (char* filename, bool null_ostream, bool overwrite,
+                       const io_geom_t* geom, eio_stream_t** ostream)
+{
     /* Buffers are supplied buy the reader so no internal buffer is needed */
     const int64_t write_buff_size = 0;
-    ch_log_debug3("Opening disk file %s\n", final_format);
+    ch_log_debug3("Opening disk file %s\n", filename);
     eio_args_t outargs = { 0 };
     outargs.type = EIO_FILE;
 
-    outargs.args.file.filename = final_format;
+    outargs.args.file.filename = filename;
     outargs.args.file.read_buff_size = 0;      //We don't read from this stream
     outargs.args.file.write_buff_size = write_buff_size;
+    outargs.args.file.prealloc_size = file_prealloc_size(geom);
+    outargs.args.file.overwrite = overwrite;
+    outargs.args.file.writeback = geom->writeback;
     eio_error_t err = eio_new (&outargs, ostream);
     if (err)
     {
-        ch_log_error("Could not create writer output %s\n", dest);
+        ch_log_error("Could not create writer output %s\n", filename);
         goto finished;
     }
 
@@ -145,304 +341,2248 @@ eio_error_t open_file (char* dest, bool null_ostream,
     if (null_ostream)
     {
         ch_log_debug1("Creating null output stream in place of disk name: %s\n",
-                    dest);
+                    filename);
         outargs.type = EIO_DUMMY;
         outargs.args.dummy.read_buff_size = 0;   /* We don't read form this stream */
         outargs.args.dummy.write_buff_size = write_buff_size;
         err = eio_new (&outargs, ostream);
         if (err)
         {
-            ch_log_error("Could not create writer output %s\n", dest);
+            ch_log_error("Could not create writer output %s\n", filename);
             goto finished;
         }
     }
 
-    set_direct ((*ostream)->fd, true);
-    err = write_pcap_header ((*ostream), nsec_pcap, max_pkt_len);
+    if (!null_ostream && !geom->writeback &&
+        set_direct ((*ostream)->fd, true))
+    {
+        ch_log_warn("Could not use O_DIRECT for %s, writes will be buffered\n",
+                    filename);
+    }
+    if (out_format == OUT_FORMAT_EXPCAP)
+    {
+        err = write_pcap_header ((*ostream), nsec_pcap, max_pkt_len, geom);
+    }
 
     finished:
     return err;
 }
 
 
-
-
-
-
-
-/**
- * The writer thread listens to a collection of rings for listener threads. It
- * takes blocks 4K aliged, pcap formatted data, updates the timestamps and
- * writes to disk as quickly as it can.
+/*
+ * Start a new segment on a raw block device and write a PCAP header into it.
  */
-void* writer_thread (void* params)
+static eio_error_t open_raw (char* device, char* ports, uint64_t port_mask,
+                             bool null_ostream, const io_geom_t* geom,
+                             eio_stream_t** ostream)
 {
+    eio_args_t outargs = { 0 };
+    if (null_ostream)
+    {
+        ch_log_debug1("Creating null output stream in place of raw device: %s\n",
+                      device);
+        outargs.type = EIO_DUMMY;
+    }
+    else
+    {
+        outargs.type = EIO_RAW;
+        outargs.args.raw.device = device;
+        outargs.args.raw.ports = ports;
+        outargs.args.raw.port_mask = port_mask;
+        outargs.args.raw.init = raw_init;
+        outargs.args.raw.align = geom->stripe;
+    }
 
-    writer_params_t* wparams = params;
-    ch_log_debug1("Setting up ostream %s\n", wparams->destination);
+    eio_error_t err = eio_new (&outargs, ostream);
+    if (err)
+    {
+        ch_log_error("Could not create writer output %s\n", device);
+        return err;
+    }
 
-    CH_VECTOR(cstr)* ifaces = wparams->interfaces;
-    char* dest = wparams->destination;
+    return write_pcap_header ((*ostream), nsec_pcap, max_pkt_len, geom);
+}
 
-    char bring_name[BRING_NAME_LEN + 1]; /* +1 = space for null terminator */
 
-    const int64_t num_istreams = ifaces->count;
-    istream_state_t istreams[num_istreams];
-    for (int iface_idx = 0; iface_idx < num_istreams; iface_idx++)
+/* Open the destination's next file, or raw device segment, in line */
+static eio_error_t dest_open (dest_state_t* dst)
+{
+    if (dst->raw)
     {
-        istreams[iface_idx].dev_id   = wparams->exanic_dev_id[iface_idx];
-        istreams[iface_idx].port_num = wparams->exanic_port_id[iface_idx];
-
-        const char* iface = ifaces->first[iface_idx];
+        return open_raw (dst->destination + strlen(RAW_DEST_PREFIX),
+                         dst->ports, dst->port_mask, dst->dummy_ostream,
+                         &dst->geom,
+                         &dst->ostream);
+    }
 
-        bzero (bring_name, BRING_NAME_LEN);
-        ch_word bring_name_chars = sprintf(bring_name,"EXCAP_%04X", getpid());
-        for (size_t i = 0;
-                i < strlen (iface) && bring_name_chars < BRING_NAME_LEN; i++)
-        {
-            if (isalnum(iface[i]))
-            {
-                bring_name[bring_name_chars] = iface[i];
-                bring_name_chars++;
-            }
-        }
+    return open_file (dst->filename, dst->dummy_ostream, false, &dst->geom,
+                      &dst->ostream);
+}
 
-        bring_name[bring_name_chars] = '_';
-        bring_name_chars++;
 
-        for (size_t i = 0;
-                i < strlen (dest) && bring_name_chars < BRING_NAME_LEN; i++)
+/*
+ * Take the next prepared file from the pool, asking for it to be renamed to
+ * "filename". The helper normally has one waiting, if it has fallen behind
+ * there is nothing better to do than wait.
+ */
+static eio_error_t pool_take (file_pool_t* pool, char* filename,
+                              eio_stream_t** ostream)
+{
+    while (pool->head == pool->tail)
+    {
+        if (pool->failed || wstop)
         {
-            if (isalnum(dest[i]))
-            {
-                bring_name[bring_name_chars] = dest[i];
-                bring_name_chars++;
-            }
-            else{
-                bring_name[bring_name_chars] = '_';
-                bring_name_chars++;
-            }
+            return EIO_ECLOSED;
         }
+        __asm__ __volatile__ ("pause");
+    }
+    __sync_synchronize();
+
+    const int64_t idx = pool->head % FILE_POOL_DEPTH;
+    *ostream = pool->files[idx];
+    snprintf(pool->names[idx], sizeof(pool->names[idx]), "%s", filename);
+    __sync_synchronize();
+    pool->head++;
+    return EIO_ENONE;
+}
 
 
-        eio_stream_t* istream = NULL;
-        eio_args_t inargs = { 0 };
-        ch_log_debug1("Connecting to bring input stream with name: %s\n", bring_name);
-        inargs.type = EIO_BRING;
-        inargs.args.bring.filename = bring_name;
-        inargs.args.bring.isserver = 0;
-        if (eio_new (&inargs, &istream))
+/*
+ * Hand a finished file back to the helper to be closed. Closing trims the
+ * preallocation, which can take a while on some file systems.
+ */
+static void pool_retire (file_pool_t* pool, eio_stream_t* ostream,
+                         char* filename, int64_t window_ns)
+{
+    while (pool->rtail - pool->rhead >= FILE_POOL_DEPTH)
+    {
+        if (wstop)
         {
-            ch_log_error("Could not create reader istream\n");
-            return NULL;
+            eio_des (ostream);
+            return;
         }
+        __asm__ __volatile__ ("pause");
+    }
 
-        /* Replace the bring with a null stream for testing, but make sure the
-         * bring exists  so that other threads will continue */
-        if (wparams->dummy_istream)
-        {
-            ch_log_debug1(
-                    "Creating null input stream in place of bring name: %s\n",
-                    bring_name);
-            inargs.type = EIO_DUMMY;
+    retired_file_t* retired = &pool->retired[pool->rtail % FILE_POOL_DEPTH];
+    retired->ostream = ostream;
+    retired->window_ns = window_ns;
+    snprintf(retired->name, sizeof(retired->name), "%s", filename);
+    __sync_synchronize();
+    pool->rtail++;
+}
 
-            /* This must be a multiple of the disk block size (assume 4kB)
-             * This value is imported across by the bring, so please be careful to
-             * keep it up to date*/
-            const int64_t bring_slot_size = 2 * 1024 * 1024; /* 1MB */
-            inargs.args.dummy.read_buff_size = bring_slot_size;
-            inargs.args.dummy.rd_mode = DUMMY_MODE_EXPCAP;
-            inargs.args.dummy.expcap_bytes = 512;
-            inargs.args.dummy.write_buff_size = 0;
-            if (eio_new (&inargs, &istream))
-            {
-                ch_log_error("Could not create writer istream\n");
-                return NULL;
-            }
-        }
 
-        istreams[iface_idx].istream = istream;
+/* Is it time to move on to a new file? */
+static inline bool dest_expired (dest_state_t* dst, int64_t now_ns)
+{
+    return (max_file_size > 0 && dst->bytes_written >= max_file_size) ||
+           (rotate_ns > 0 && now_ns >= dst->window_ns + rotate_ns);
+}
 
-        /*
-         * The writer thread needs to know which exanic the data came from
-         * so that it can do time stamp conversions
-         */
-        eio_stream_t* exa_stream = NULL;
-        eio_args_t exaargs = { 0 };
-        exaargs.type = EIO_EXA;
-        exaargs.args.exa.interface_rx = (char*) iface;
-        exaargs.args.exa.interface_tx = NULL;
-        int err = eio_new (&exaargs, &exa_stream);
-        if (err)
-        {
-            ch_log_error("Could not create listener input stream %s\n");
-            return NULL;
-        }
-        istreams[iface_idx].exa_istream = exa_stream;
-    }
 
-    eio_stream_t* ostream = NULL;
-    int64_t file_id = 0;
-    if (open_file (dest, wparams->dummy_ostream, &ostream, 0))
+/*
+ * Queue a write without waiting for it, at the destination's own idea of the
+ * end of the file. Ring slots are held on to by the caller until their writes
+ * are done. Anything else is waited for only when it is about to be reused,
+ * see dest_swap().
+ */
+static eio_error_t dest_write_async (dest_state_t* dst, char* buff,
+                                     int64_t len, wstats_t* stats)
+{
+    const int64_t seq = aioq_write (dst->aio, dst->ostream->fd, buff, len,
+                                    dst->file_off);
+    if (seq < 0 || dst->aio->failed)
     {
-        ch_log_error("Could not open new output file\n");
-        goto finished;
+        ch_log_error("Asynchronous write to %s failed\n", dst->filename);
+        return EIO_ECLOSED;
     }
-    file_id++;
+    dst->file_off += len;
 
+    if (dst->slot && buff >= dst->slot && buff < dst->slot + dst->slot_len)
+    {
+        dst->slot_seq = seq;
+    }
+    else
+    {
+        dst->buff_seq = seq;
+    }
 
-    //**************************************************************************
-    //Writer - Real work begins here!
-    //**************************************************************************
+    stats->dbytes += len;
+    stats->writes++;
 
-    int64_t curr_istream = wparams->wtid;
-    char* rd_buff = NULL;
-    int64_t rd_buff_len = 0;
-    int64_t bytes_written = 0;
+    return EIO_ENONE;
+}
 
-    wstats_t* stats = &wstats[curr_istream];
 
-    while (!wstop)
+/* Wait for write number "seq" if it is still going */
+static inline void dest_wait (dest_state_t* dst, int64_t seq)
+{
+    if (dst->aio && seq > dst->aio->completed)
     {
+        aioq_reap (dst->aio, seq);
+    }
+}
 
-        //Find a buffer
-        for (; !wstop; curr_istream++, stats->spins++)
-        {
-            //ch_log_debug3("Looking at istream %li/%li\n", curr_istream,
-            //              num_istreams);
-            curr_istream = curr_istream >= num_istreams ? 0 : curr_istream;
-            eio_stream_t* istream = istreams[curr_istream].istream;
-            eio_error_t err = eio_rd_acq (istream, &rd_buff, &rd_buff_len,
-                                          NULL);
-            if (err == EIO_ETRYAGAIN)
-            {
-                /* relax the CPU in this tight loop */
-                __asm__ __volatile__ ("pause");
-                continue; /* Look at the next ring */
-            }
-            if (err != EIO_ENONE)
-            {
-                ch_log_error(
-                        "Unexpected error %i trying to get istream buffer\n",
-                        err);
-                return NULL;
-            }
-
-            ch_log_debug1("Got buffer of size %li (0x%08x)\n", rd_buff_len,
-                          rd_buff_len);
-            ifassert(rd_buff_len == 0)
-            {
-                ch_log_error("Unexpected packet size of 0\n");
-                goto finished;
-            }
-
-            break;
-        }
-        if (wstop) goto finished;
 
-        /* At this point we have a buffer full of packets */
+/*
+ * Internal buffers are double buffered when writing asynchronously. Once one
+ * half has been handed to dest_write_out(), the other half takes its place,
+ * after waiting for its own last write (if that is still going).
+ */
+static inline void dest_swap (dest_state_t* dst, char** buff, char** spare,
+                              int64_t* spare_seq)
+{
+    if (!*spare)
+    {
+        return;
+    }
 
+    dest_wait (dst, *spare_seq);
+    char* const next = *spare;
+    *spare = *buff;
+    *buff = next;
+    *spare_seq = dst->buff_seq;
+}
 
-        /* Update the timestamps / stats in the packets */
-        pcap_pkthdr_t* pkt_hdr = (pcap_pkthdr_t*) rd_buff;
-        expcap_pktftr_t* pkt_ftr = NULL;
-        eio_stream_t* exa_istream = istreams[curr_istream].exa_istream;
-        struct exanic_timespecps tsps = {0,0};
 
-#if !defined(NDEBUG) || !defined(NOIFASSERT)
-        int64_t hdrs_count = -1;
-#endif
+/*
+ * Asynchronous writes do not move the file position, so it is picked up when
+ * a file is started and put back (once everything is written) before the file
+ * is closed, which trims the preallocation to the right size.
+ */
+static inline void dest_aio_start (dest_state_t* dst)
+{
+    if (dst->aio && dst->ostream)
+    {
+        dst->file_off = lseek (dst->ostream->fd, 0, SEEK_CUR);
+    }
+}
 
-        for(; (char*) pkt_hdr < rd_buff + rd_buff_len;  )
-        {
-            ch_log_debug2("Looking at packet %i, offset %iB, len=%li ts=%li.%09li\n",
-                          ++hdrs_count, ((char*)pkt_hdr-rd_buff), pkt_hdr->caplen,
-                          pkt_hdr->ts.ns.ts_sec, pkt_hdr->ts.ns.ts_nsec);
+static inline void dest_aio_stop (dest_state_t* dst)
+{
+    if (dst->aio && dst->ostream)
+    {
+        aioq_reap (dst->aio, dst->aio->submitted);
+        lseek (dst->ostream->fd, dst->file_off, SEEK_SET);
+    }
+}
 
-            /* preload for performance */
-            const pcap_pkthdr_t *  pkt_hdr_next = (pcap_pkthdr_t*)PKT_OFF(pkt_hdr,pkt_hdr->caplen);
-            __builtin_prefetch(&pkt_hdr_next->caplen);
 
-            iflikely(pkt_hdr->len)
-            {
-                //We don't need to count this packet beacuse it's a dummy
-                stats->packets++;
-                stats->pcbytes += pkt_hdr->caplen - sizeof(pcap_pkthdr_t);
-                stats->plbytes += pkt_hdr->len;
-            }
+/*
+ * With deferred timestamps, each output file gets a file of clock samples next
+ * to it, see data_structs/expcap_clock.h. Samples are small, so they are
+ * buffered by stdio.
+ */
+static eio_error_t clock_open (dest_state_t* dst)
+{
+    if (!defer_ts || dst->dummy_ostream)
+    {
+        return EIO_ENONE;
+    }
+
+    char name[sizeof(dst->filename) + sizeof(EXPCAP_CLOCK_SUFFIX)];
+    snprintf (name, sizeof(name), "%s%s", dst->filename, EXPCAP_CLOCK_SUFFIX);
+    dst->clk = fopen (name, "w");
+    if (!dst->clk)
+    {
+        ch_log_error("Could not open clock file %s: %s\n", name,
+                     strerror(errno));
+        return EIO_ECLOSED;
+    }
+
+    expcap_clock_hdr_t hdr = {{0}};
+    memcpy (hdr.magic, EXPCAP_CLOCK_MAGIC, sizeof(hdr.magic));
+    hdr.version     = EXPCAP_CLOCK_VERSION;
+    hdr.sample_size = sizeof(expcap_clock_sample_t);
+    fwrite (&hdr, sizeof(hdr), 1, dst->clk);
+    return EIO_ENONE;
+}
+
+static void clock_close (dest_state_t* dst)
+{
+    if (dst->clk)
+    {
+        fclose (dst->clk);
+        dst->clk = NULL;
+    }
+}
+
+/* Note how to convert the times of a slot's packets, from its first one */
+static inline void clock_sample (dest_state_t* dst,
+                                 const istream_state_t* istream,
+                                 const pcap_pkthdr_t* pkt_hdr)
+{
+    if (!dst->clk || !pkt_hdr->ts.raw)
+    {
+        return;
+    }
+
+    struct exanic_timespecps tsps = {0,0};
+    exa_rxcycles_to_timespecps(istream->exa_istream, pkt_hdr->ts.raw, &tsps);
+
+    expcap_clock_sample_t sample = {0};
+    sample.cycles   = pkt_hdr->ts.raw;
+    sample.ts_secs  = tsps.tv_sec;
+    sample.ts_psecs = tsps.tv_psec;
+    sample.host_ns  = time_now_ns();
+    sample.tick_hz  = istream->tick_hz;
+    sample.dev_id   = istream->dev_id;
+    sample.port_id  = istream->port_num;
+    fwrite (&sample, sizeof(sample), 1, dst->clk);
+}
+
+
+/*
+ * Hand a block aligned buffer straight over to the destination's output
+ * stream. "ts_ns" is the time of the first packet in it, for streams that keep
+ * an index of what they hold.
+ */
+static eio_error_t dest_write_out (dest_state_t* dst, char* buff, int64_t len,
+                                   int64_t ts_ns, wstats_t* stats)
+{
+    ifunlikely(dst->aio)
+    {
+        return dest_write_async (dst, buff, len, stats);
+    }
+
+    eio_error_t err = eio_wr_acq (dst->ostream, &buff, &len, &ts_ns);
+    if (err)
+    {
+        ch_log_error("Could not get writer buffer with unexpected error %i\n",
+                     err);
+        if (err == EIO_ECLOSED)
+        {
+            return err;
+        }
+    }
+
+    /* Now flush to disk */
+    eio_wr_rel (dst->ostream, len, NULL);
+
+    /*  Stats */
+    stats->dbytes += len;
+    stats->writes++;
+
+    return EIO_ENONE;
+}
+
+
+/*
+ * Gather data into whole stripes, which are written at stripe aligned offsets
+ * as the header is a whole stripe too. Whole stripes are written straight
+ * from the caller's buffer (zero copy) when it is aligned well enough for
+ * O_DIRECT, otherwise they are copied and written together. Only the ends that
+ * do not make up a whole stripe are held on to.
+ */
+static eio_error_t stripe_write (dest_state_t* dst, char* buff, int64_t len,
+                                 int64_t ts_ns, wstats_t* stats)
+{
+    const int64_t stripe = dst->geom.stripe;
+    eio_error_t err = EIO_ENONE;
+    for (int64_t off = 0; off < len; )
+    {
+        iflikely(!dst->stripe_len && len - off >= stripe)
+        {
+            int64_t whole = (len - off) / stripe * stripe;
+            ifunlikely((uintptr_t)(buff + off) % dst->geom.block)
+            {
+                whole = MIN(whole, dst->stripe_cap);
+                memcpy (dst->stripe_buff, buff + off, whole);
+                err = dest_write_out (dst, dst->stripe_buff, whole, ts_ns,
+                                      stats);
+                dest_swap (dst, &dst->stripe_buff, &dst->stripe_spare,
+                           &dst->stripe_seq);
+            }
+            else
+            {
+                err = dest_write_out (dst, buff + off, whole, ts_ns, stats);
+            }
+            if (err)
+            {
+                return err;
+            }
+            off += whole;
+            continue;
+        }
+
+        if (!dst->stripe_len)
+        {
+            dst->stripe_ts = ts_ns;
+        }
+        const int64_t n = MIN(len - off, stripe - dst->stripe_len);
+        memcpy (dst->stripe_buff + dst->stripe_len, buff + off, n);
+        dst->stripe_len += n;
+        off += n;
+
+        if (dst->stripe_len == stripe)
+        {
+            dst->stripe_len = 0;
+            err = dest_write_out (dst, dst->stripe_buff, stripe, dst->stripe_ts,
+                                  stats);
+            dest_swap (dst, &dst->stripe_buff, &dst->stripe_spare,
+                       &dst->stripe_seq);
+            if (err)
+            {
+                return err;
+            }
+        }
+    }
+
+    return EIO_ENONE;
+}
+
+
+/*
+ * Write out a partly gathered stripe before the file is closed. Callers only
+ * hand over whole slots, so it always ends on a record boundary and can be
+ * padded out to whole blocks with dummy records if need be.
+ */
+static eio_error_t stripe_flush (dest_state_t* dst, wstats_t* stats)
+{
+    if (!dst->stripe_len || !dst->ostream)
+    {
+        return EIO_ENONE;
+    }
+
+    int64_t len = dst->stripe_len;
+    if (len % dst->geom.block)
+    {
+        len += pad_to_size (dst->stripe_buff, len,
+                            dst->stripe_cap + dst->geom.block,
+                            dst->geom.block, 0);
+    }
+    dst->stripe_len = 0;
+    const eio_error_t err = dest_write_out (dst, dst->stripe_buff, len,
+                                            dst->stripe_ts, stats);
+    dest_swap (dst, &dst->stripe_buff, &dst->stripe_spare, &dst->stripe_seq);
+    return err;
+}
+
+
+/*
+ * In plain pcap and pcapng output modes (--format pcap/pcapng), footers and
+ * padding records are taken out as data goes to the destination. What is
+ * left is gathered into whole blocks (or stripes), with the part that does
+ * not fill one kept for next time. Only the last write of a file is padded,
+ * with zeros that are trimmed off again once it is written.
+ *
+ * Pcap footers go to a sidecar file, see data_structs/expcap_footers.h, and
+ * are small, so they are buffered by stdio. Pcapng keeps what is in them in
+ * the file, with an interface for each port, see data_structs/pcapng.h.
+ */
+static eio_error_t plain_open (dest_state_t* dst)
+{
+    if (!dst->plain_buff)
+    {
+        return EIO_ENONE;
+    }
+
+    if (out_format == OUT_FORMAT_PCAPNG)
+    {
+        dst->plain_len = pcapng_shb (dst->plain_buff);
+        dst->ng_count = 0;
+        dst->ng_last = -1;
+        dst->ng_ids = 0;
+        return EIO_ENONE;
+    }
+
+    init_pcap_header ((pcap_file_header_t*)dst->plain_buff, nsec_pcap,
+                      max_pkt_len);
+    dst->plain_len = sizeof(pcap_file_header_t);
+
+    if (dst->dummy_ostream)
+    {
+        return EIO_ENONE;
+    }
+
+    char name[sizeof(dst->filename) + sizeof(EXPCAP_FOOTERS_SUFFIX)];
+    snprintf (name, sizeof(name), "%s%s", dst->filename, EXPCAP_FOOTERS_SUFFIX);
+    dst->ftr = fopen (name, "w");
+    if (!dst->ftr)
+    {
+        ch_log_error("Could not open footer file %s: %s\n", name,
+                     strerror(errno));
+        return EIO_ECLOSED;
+    }
+
+    expcap_footers_hdr_t hdr = {{0}};
+    memcpy (hdr.magic, EXPCAP_FOOTERS_MAGIC, sizeof(hdr.magic));
+    hdr.version     = EXPCAP_FOOTERS_VERSION;
+    hdr.record_size = sizeof(expcap_footer_rec_t);
+    fwrite (&hdr, sizeof(hdr), 1, dst->ftr);
+    return EIO_ENONE;
+}
+
+
+/*
+ * Make a pcapng packet block for a packet, after an interface description
+ * block if it is the first packet from its port in this file, or its time
+ * does not fit the port's interface. Ports are looked up from the last one, as
+ * packets mostly come in runs from one port. Returns the bytes made.
+ */
+static inline int64_t ng_packet (dest_state_t* dst, char* out,
+                                 const pcap_pkthdr_t* pkt_hdr, int64_t data_len,
+                                 const expcap_pktftr_t* pkt_ftr)
+{
+    const uint16_t key = pkt_ftr->dev_id << 8 | pkt_ftr->port_id;
+    int64_t idx = dst->ng_last;
+    int64_t len = 0;
+    ifunlikely(idx < 0 || dst->ng_ifs[idx].key != key ||
+               !pcapng_ts_fits (pkt_ftr->ts_secs, dst->ng_ifs[idx].ts_secs))
+    {
+        for (idx = 0; idx < dst->ng_count; idx++)
+        {
+            if (dst->ng_ifs[idx].key == key)
+            {
+                break;
+            }
+        }
+
+        if (idx == dst->ng_count && idx == MAX_ITHREADS)
+        {
+            idx = 0; /* More ports than rings, which can't happen */
+        }
+
+        ng_if_t* ng_if = &dst->ng_ifs[idx];
+        if (idx == dst->ng_count || ng_if->key != key ||
+            !pcapng_ts_fits (pkt_ftr->ts_secs, ng_if->ts_secs))
+        {
+            dst->ng_count += idx == dst->ng_count;
+            ng_if->key = key;
+            ng_if->if_id = dst->ng_ids++;
+            ng_if->ts_secs = pcapng_if_secs (pkt_ftr->ts_secs);
+            len = pcapng_idb (out, max_pkt_len, pkt_ftr->dev_id,
+                              pkt_ftr->port_id, ng_if->ts_secs);
+        }
+        dst->ng_last = idx;
+    }
+
+    const ng_if_t* ng_if = &dst->ng_ifs[idx];
+    return len + pcapng_epb (out + len, ng_if->if_id, pkt_ftr->ts_secs,
+                             pkt_ftr->ts_psecs, ng_if->ts_secs,
+                             pkt_hdr + 1, data_len, pkt_hdr->len, pkt_ftr);
+}
+
+
+/*
+ * Copy the real packets in a buffer of expcap records into the plain pcap
+ * buffer and write out whatever whole blocks that makes. Block headers say
+ * where the padding at the end of each block starts, so it is skipped in one
+ * go. "out_len" is set to the bytes of plain pcap made.
+ */
+static eio_error_t plain_write (dest_state_t* dst, char* buff, int64_t len,
+                                int64_t ts_ns, int64_t* out_len,
+                                wstats_t* stats)
+{
+    char* out = dst->plain_buff + dst->plain_len;
+    expcap_footer_rec_t* rec = dst->ftr_recs;
+    int64_t skip_from = -1;
+    int64_t skip_to = 0;
+
+    for (int64_t off = 0; off < len; )
+    {
+        ifunlikely(off == skip_from)
+        {
+            off = skip_to;
+            continue;
+        }
+
+        pcap_pkthdr_t* pkt_hdr = (pcap_pkthdr_t*)(buff + off);
+        const int64_t rec_len = sizeof(pcap_pkthdr_t) + pkt_hdr->caplen;
+        ifunlikely(!pkt_hdr->len)
+        {
+            const expcap_block_t* blk = expcap_block_get (pkt_hdr);
+            if (blk && blk->length > blk->data_len)
+            {
+                skip_from = off + blk->data_len;
+                skip_to   = off + blk->length;
+            }
+            off += rec_len;
+            continue;
+        }
+
+        const expcap_pktftr_t* pkt_ftr =
+                (expcap_pktftr_t*)(buff + off + rec_len) - 1;
+        const int64_t data_len = pkt_hdr->caplen - sizeof(expcap_pktftr_t);
+        ifunlikely(out_format == OUT_FORMAT_PCAPNG)
+        {
+            out += ng_packet (dst, out, pkt_hdr, data_len, pkt_ftr);
+            off += rec_len;
+            continue;
+        }
+
+        pcap_pkthdr_t* out_hdr = (pcap_pkthdr_t*)out;
+        out_hdr->ts     = pkt_hdr->ts;
+        out_hdr->caplen = data_len;
+        out_hdr->len    = pkt_hdr->len;
+        memcpy (out_hdr + 1, pkt_hdr + 1, data_len);
+        out += sizeof(pcap_pkthdr_t) + data_len;
+
+        rec->ts_psecs = pkt_ftr->ts_psecs % 1000;
+        rec->flags    = pkt_ftr->flags;
+        rec->dev_id   = pkt_ftr->dev_id;
+        rec->port_id  = pkt_ftr->port_id;
+        rec->foot     = pkt_ftr->foot.new_fcs;
+        rec++;
+
+        off += rec_len;
+    }
+
+    if (dst->ftr)
+    {
+        fwrite (dst->ftr_recs, sizeof(expcap_footer_rec_t),
+                rec - dst->ftr_recs, dst->ftr);
+    }
+
+    *out_len = out - (dst->plain_buff + dst->plain_len);
+    dst->plain_len = out - dst->plain_buff;
+
+    const int64_t unit = dst->geom.stripe ? dst->geom.stripe : dst->geom.block;
+    const int64_t whole = dst->plain_len / unit * unit;
+    if (!whole)
+    {
+        return EIO_ENONE;
+    }
+
+    const eio_error_t err = dest_write_out (dst, dst->plain_buff, whole, ts_ns,
+                                            stats);
+    dst->plain_len -= whole;
+    if (dst->plain_spare)
+    {
+        /* What is left carries on at the start of the other half */
+        dest_swap (dst, &dst->plain_buff, &dst->plain_spare, &dst->plain_seq);
+        memcpy (dst->plain_buff, dst->plain_spare + whole, dst->plain_len);
+    }
+    else
+    {
+        memmove (dst->plain_buff, dst->plain_buff + whole, dst->plain_len);
+    }
+    return err;
+}
+
+
+/* Write out what is left before the file is closed, padded to whole blocks */
+static eio_error_t plain_flush (dest_state_t* dst, wstats_t* stats)
+{
+    if (!dst->plain_len || !dst->ostream)
+    {
+        return EIO_ENONE;
+    }
+
+    const int64_t len = round_up(dst->plain_len, dst->geom.block);
+    memset (dst->plain_buff + dst->plain_len, 0, len - dst->plain_len);
+    dst->plain_trim = len - dst->plain_len;
+    dst->plain_len = 0;
+    const eio_error_t err = dest_write_out (dst, dst->plain_buff, len, 0,
+                                            stats);
+    dest_swap (dst, &dst->plain_buff, &dst->plain_spare, &dst->plain_seq);
+    return err;
+}
+
+
+/* Trim off the padding once it is written, and finish the footer file */
+static void plain_close (dest_state_t* dst)
+{
+    if (dst->plain_trim && dst->ostream && !dst->dummy_ostream)
+    {
+        const int fd = dst->ostream->fd;
+        const off_t end = lseek (fd, 0, SEEK_CUR) - dst->plain_trim;
+        if (end < 0 || ftruncate (fd, end) || lseek (fd, end, SEEK_SET) < 0)
+        {
+            ch_log_warn("Could not trim padding from %s: %s\n",
+                        dst->filename, strerror(errno));
+        }
+    }
+    dst->plain_trim = 0;
+
+    if (dst->ftr)
+    {
+        fclose (dst->ftr);
+        dst->ftr = NULL;
+    }
+}
+
+
+/*
+ * Move on to the next file, because the current one is full or its time
+ * window is over. Windows start on multiples of the rotation period of wall
+ * clock time, so every writer moves on at the same time.
+ */
+static eio_error_t dest_rotate (dest_state_t* dst, int64_t now_ns,
+                                wstats_t* stats)
+{
+    if (stripe_flush (dst, stats) == EIO_ECLOSED ||
+        plain_flush (dst, stats) == EIO_ECLOSED)
+    {
+        return EIO_ECLOSED;
+    }
+    dest_aio_stop (dst);
+    clock_close (dst);
+    plain_close (dst);
+
+    if (dst->pool)
+    {
+        pool_retire (dst->pool, dst->ostream, dst->filename, dst->window_ns);
+    }
+    else
+    {
+        eio_des (dst->ostream);
+    }
+    dst->ostream = NULL;
+
+    if (rotate_ns > 0 && now_ns >= dst->window_ns + rotate_ns)
+    {
+        dst->window_ns = now_ns - now_ns % rotate_ns;
+        dst->file_id = 0;
+    }
+    else
+    {
+        dst->file_id++;
+    }
+
+    file_name (dst->filename, sizeof(dst->filename), dst->destination,
+               dst->window_ns, dst->file_id);
+
+    if (dst->pool)
+    {
+        if (pool_take (dst->pool, dst->filename, &dst->ostream))
+        {
+            ch_log_error("Could not get prepared output file\n");
+            return EIO_ECLOSED;
+        }
+    }
+    else
+    {
+        if (dest_open (dst))
+        {
+            ch_log_error("Could not open new output file\n");
+            return EIO_ECLOSED;
+        }
+    }
+    dest_aio_start (dst);
+
+    dst->bytes_written = 0;
+    if (clock_open (dst))
+    {
+        return EIO_ECLOSED;
+    }
+    return plain_open (dst);
+}
+
+
+/*
+ * Hand a block aligned buffer over to the destination's output stream (zero
+ * copy), gathering it into whole stripes if the destination wants them, and
+ * start a new file if the current one is done with.
+ */
+static eio_error_t dest_write (dest_state_t* dst, char* buff, int64_t len,
+                               wstats_t* stats)
+{
+    const pcap_pkthdr_t* pkt_hdr = (pcap_pkthdr_t*) buff;
+    const int64_t ts_ns = pkt_hdr->ts.ns.ts_sec * 1000ULL * 1000 * 1000 +
+                          pkt_hdr->ts.ns.ts_nsec;
+
+    eio_error_t err;
+    ifunlikely(dst->plain_buff)
+    {
+        err = plain_write (dst, buff, len, ts_ns, &len, stats);
+    }
+    else ifunlikely(dst->geom.stripe)
+    {
+        err = stripe_write (dst, buff, len, ts_ns, stats);
+    }
+    else
+    {
+        err = dest_write_out (dst, buff, len, ts_ns, stats);
+    }
+    if (err)
+    {
+        return err;
+    }
+    dst->bytes_written += len;
+
+    /* Is the file too big, or its window over? Make a new one! */
+    const int64_t now_ns = rotate_ns > 0 ? time_now_ns() : 0;
+    ifunlikely(dest_expired (dst, now_ns))
+    {
+        return dest_rotate (dst, now_ns, stats);
+    }
+
+    return EIO_ENONE;
+}
+
+
+/*
+ * Allocate the burst buffer, from huge pages if there are enough reserved.
+ * It is faulted in here so that the pages come from this thread's NUMA node.
+ */
+static int burst_init (burst_state_t* burst, int64_t bytes)
+{
+    burst->entries = bytes / BRING_SLOT_SIZE;
+    burst->mem_len = burst->entries * BRING_SLOT_SIZE;
+    burst->mem = mmap (NULL, burst->mem_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                       -1, 0);
+    if (burst->mem == MAP_FAILED)
+    {
+        ch_log_warn("Could not allocate %liMB burst buffer from huge pages, "
+                    "using normal pages\n", burst->mem_len / 1024 / 1024);
+        burst->mem = mmap (NULL, burst->mem_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (burst->mem == MAP_FAILED)
+        {
+            burst->mem = NULL;
+            return -1;
+        }
+        madvise (burst->mem, burst->mem_len, MADV_HUGEPAGE);
+        memset (burst->mem, 0, burst->mem_len);
+    }
+
+    burst->lens = calloc (burst->entries, sizeof(int64_t));
+    burst->times = calloc (burst->entries, sizeof(int64_t));
+    burst->seqs = calloc (burst->entries, sizeof(int64_t));
+    if (!burst->lens || !burst->times || !burst->seqs)
+    {
+        free (burst->lens);
+        free (burst->times);
+        free (burst->seqs);
+        munmap (burst->mem, burst->mem_len);
+        burst->mem = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write the oldest entry in the burst buffer to disk.
+ */
+static eio_error_t burst_drain (dest_state_t* dst, wstats_t* stats)
+{
+    burst_state_t* burst = &dst->burst;
+    char* buff = burst->mem + burst->head * BRING_SLOT_SIZE;
+    const eio_error_t err = dest_write (dst, buff, burst->lens[burst->head],
+                                        stats);
+    burst->seqs[burst->head] = dst->buff_seq;
+    burst->head++;
+    burst->head = burst->head < burst->entries ? burst->head : 0;
+    burst->count--;
+    dst->keep -= dst->keep > 0;
+    return err;
+}
+
+
+/* Throw away the oldest entry in the burst buffer */
+static inline void burst_drop (burst_state_t* burst)
+{
+    burst->head++;
+    burst->head = burst->head < burst->entries ? burst->head : 0;
+    burst->count--;
+}
+
+
+/* Throw away entries added to the burst buffer before "oldest_ns" */
+static void burst_expire (burst_state_t* burst, int64_t oldest_ns)
+{
+    while (burst->count && burst->times[burst->head] < oldest_ns)
+    {
+        burst_drop (burst);
+    }
+}
+
+
+/*
+ * In trigger mode, hold on to data in the burst buffer until there is a
+ * trigger, then write out the history and everything up to trigger_post_ns
+ * after it.
+ */
+static void trigger_update (dest_state_t* dst, int64_t now_ns)
+{
+    const int64_t fired_ns = trigger_ns;
+    const bool hold = !fired_ns || now_ns >= fired_ns + trigger_post_ns;
+    if (dst->hold && !hold)
+    {
+        if (!dst->keep)
+        {
+            burst_expire (&dst->burst, fired_ns - trigger_pre_ns);
+        }
+        dst->keep = 0;
+        ch_log_info("Triggered, writing %liMB of history to %s\n",
+                    dst->burst.count * BRING_SLOT_SIZE / 1024 / 1024,
+                    dst->destination);
+    }
+    else if (!dst->hold && hold)
+    {
+        /* Whatever was captured around the trigger still goes to disk */
+        dst->keep = dst->burst.count;
+        ch_log_info("Trigger done, holding data for %s\n", dst->destination);
+    }
+    dst->hold = hold;
+}
+
+
+/*
+ * Write a block aligned buffer to disk, or copy it into the burst buffer if
+ * the disk is falling behind. Once anything is in the burst buffer everything
+ * has to go through it, so that order is preserved. While holding for a
+ * trigger, the oldest data is dropped to make room.
+ */
+static eio_error_t dest_queue (dest_state_t* dst, char* buff, int64_t len,
+                               wstats_t* stats)
+{
+    burst_state_t* burst = &dst->burst;
+    iflikely(!burst->count && !dst->behind && !dst->hold)
+    {
+        return dest_write (dst, buff, len, stats);
+    }
+
+    int64_t now_ns;
+    eio_nowns (&now_ns);
+    ifunlikely(dst->hold && !dst->keep)
+    {
+        burst_expire (burst, now_ns - trigger_pre_ns);
+        ifunlikely(burst->count == burst->entries)
+        {
+            burst_drop (burst);
+        }
+    }
+
+    ifunlikely(burst->count == burst->entries)
+    {
+        const eio_error_t err = burst_drain (dst, stats);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    int64_t tail = burst->head + burst->count;
+    tail = tail < burst->entries ? tail : tail - burst->entries;
+    dest_wait (dst, burst->seqs[tail]);
+    memcpy (burst->mem + tail * BRING_SLOT_SIZE, buff, len);
+    burst->lens[tail] = len;
+    burst->times[tail] = now_ns;
+    burst->count++;
+    stats->bbytes += len;
+
+    return EIO_ENONE;
+}
+
+
+/*
+ * Pad out and write whatever has been coalesced in the staging buffer.
+ */
+static eio_error_t flush_staging (coalesce_state_t* staging, dest_state_t* dst,
+                                  wstats_t* stats)
+{
+    if (!staging->len)
+    {
+        return EIO_ENONE;
+    }
+
+    const int64_t padding = pad_to_block (staging->buff, staging->len,
+                                          BRING_SLOT_SIZE, staging->ts_raw);
+    staging->len += padding;
+
+    /* The padding belongs to the last block, so that readers skip it too */
+    if (staging->block)
+    {
+        staging->block->length += padding;
+        staging->block = NULL;
+    }
+
+    const eio_error_t err = dest_queue (dst, staging->buff, staging->len, stats);
+    staging->len = 0;
+    dest_swap (dst, &staging->buff, &staging->spare, &staging->spare_seq);
+    return err;
+}
+
+
+/* The footer of a packet, and its time once converted */
+static inline expcap_pktftr_t* pkt_footer (const pcap_pkthdr_t* hdr)
+{
+    return (expcap_pktftr_t*)((char*)(hdr + 1) + hdr->caplen -
+                              sizeof(expcap_pktftr_t));
+}
+
+static inline uint64_t footer_ns (const expcap_pktftr_t* ftr)
+{
+    return ftr->ts_secs * 1000ULL * 1000 * 1000 + ftr->ts_psecs / 1000;
+}
+
+
+/* Set a block header's times from its first and last packets, once their
+ * times are converted */
+static inline void block_times (expcap_block_t* blk,
+                                const expcap_pktftr_t* first,
+                                const expcap_pktftr_t* last)
+{
+    blk->first_ts = footer_ns (first);
+    blk->last_ts  = footer_ns (last);
+    blk->flags &= ~EXPCAP_BLOCK_FLAG_RAWTS;
+}
+
+
+/*
+ * Take a packet's time from the switch timestamp trailer on the end of it,
+ * rather than from the NIC time already in "tsps". Returns false if the
+ * packet is too short or has been snapped, so the trailer isn't there.
+ * Packets that did not come through a timestamping switch end in ordinary
+ * data, so a trailer time more than TRAILER_MAX_SKEW_PS from the NIC time is
+ * not believed either.
+ */
+#define TRAILER_MAX_SKEW_PS (1000LL * 1000 * 1000 * 1000)
+static inline bool trailer_time (const pcap_pkthdr_t* pkt_hdr,
+                                 expcap_pktftr_t* pkt_ftr,
+                                 struct exanic_timespecps* tsps)
+{
+    const int64_t data_len = expcap_data_len (pkt_hdr->caplen, pkt_ftr);
+    if (pkt_hdr->len < sizeof(fusion_hpt_trailer_t) || data_len < pkt_hdr->len)
+    {
+        return false;
+    }
+
+    const fusion_hpt_trailer_t* trailer = (const fusion_hpt_trailer_t*)
+            (PKT(pkt_hdr) + pkt_hdr->len - sizeof(fusion_hpt_trailer_t));
+    uint64_t secs = 0;
+    uint64_t psecs = 0;
+    fusion_hpt_time (trailer, &secs, &psecs);
+
+    const int64_t skew_ps = ((int64_t)secs - (int64_t)tsps->tv_sec) *
+                            1000LL * 1000 * 1000 * 1000 +
+                            ((int64_t)psecs - (int64_t)tsps->tv_psec);
+    if (skew_ps > TRAILER_MAX_SKEW_PS || skew_ps < -TRAILER_MAX_SKEW_PS)
+    {
+        return false;
+    }
+
+    tsps->tv_sec  = secs;
+    tsps->tv_psec = psecs;
+    pkt_ftr->flags |= EXPCAP_FLAG_TSTRAILER;
+    return true;
+}
+
+
+/* Allocate a buffer for disk writes, faulted in now rather than on the first
+ * write */
+static char* buff_alloc (int64_t align, int64_t len)
+{
+    char* buff = aligned_alloc (align, len);
+    if (buff)
+    {
+        memset (buff, 0, len);
+        if (mlock (buff, len))
+        {
+            ch_log_warn("Could not lock write buffer, prefaulting only. "
+                        "Error=%s\n", strerror(errno));
+        }
+    }
+    return buff;
+}
+
+
+/*
+ * Connect to the rings feeding one output and get it ready to write. Returns
+ * 0 on success, -1 on failure.
+ */
+static int writer_dest_init (writer_dest_t* wd, writer_params_t* wparams,
+                             bool async)
+{
+    ch_log_debug1("Setting up ostream %s\n", wparams->destination);
+
+    CH_VECTOR(cstr)* ifaces = wparams->interfaces;
+    char* dest = wparams->destination;
+
+    char bring_name[BRING_NAME_LEN + 1]; /* +1 = space for null terminator */
+
+    wd->wparams = wparams;
+    wd->num_istreams = ifaces->count;
+    istream_state_t* istreams = wd->istreams;
+    for (int iface_idx = 0; iface_idx < wd->num_istreams; iface_idx++)
+    {
+        istreams[iface_idx].dev_id   = wparams->exanic_dev_id[iface_idx];
+        istreams[iface_idx].port_num = wparams->exanic_port_id[iface_idx];
+
+        const char* iface = ifaces->first[iface_idx];
+
+        bzero (bring_name, BRING_NAME_LEN);
+        ch_word bring_name_chars = sprintf(bring_name,"EXCAP_%04X", getpid());
+        for (size_t i = 0;
+                i < strlen (iface) && bring_name_chars < BRING_NAME_LEN; i++)
+        {
+            if (isalnum(iface[i]))
+            {
+                bring_name[bring_name_chars] = iface[i];
+                bring_name_chars++;
+            }
+        }
+
+        bring_name[bring_name_chars] = '_';
+        bring_name_chars++;
+
+        for (size_t i = 0;
+                i < strlen (dest) && bring_name_chars < BRING_NAME_LEN; i++)
+        {
+            if (isalnum(dest[i]))
+            {
+                bring_name[bring_name_chars] = dest[i];
+                bring_name_chars++;
+            }
+            else{
+                bring_name[bring_name_chars] = '_';
+                bring_name_chars++;
+            }
+        }
+
+
+        eio_stream_t* istream = NULL;
+        eio_args_t inargs = { 0 };
+        ch_log_debug1("Connecting to bring input stream with name: %s\n", bring_name);
+        inargs.type = EIO_BRING;
+        inargs.args.bring.filename = bring_name;
+        inargs.args.bring.isserver = 0;
+        if (eio_new (&inargs, &istream))
+        {
+            ch_log_error("Could not create reader istream\n");
+            return -1;
+        }
+
+        /* Replace the bring with a null stream for testing, but make sure the
+         * bring exists  so that other threads will continue */
+        if (wparams->dummy_istream)
+        {
+            ch_log_debug1(
+                    "Creating null input stream in place of bring name: %s\n",
+                    bring_name);
+            inargs.type = EIO_DUMMY;
+
+            /* This must be a multiple of the disk block size (assume 4kB)
+             * This value is imported across by the bring, so please be careful to
+             * keep it up to date*/
+            const int64_t bring_slot_size = 2 * 1024 * 1024; /* 1MB */
+            inargs.args.dummy.read_buff_size = bring_slot_size;
+            inargs.args.dummy.rd_mode = DUMMY_MODE_EXPCAP;
+            inargs.args.dummy.expcap_bytes = 512;
+            inargs.args.dummy.write_buff_size = 0;
+            if (eio_new (&inargs, &istream))
+            {
+                ch_log_error("Could not create writer istream\n");
+                return -1;
+            }
+        }
+
+        istreams[iface_idx].istream = istream;
+        istreams[iface_idx].bring = !wparams->dummy_istream;
+
+        /*
+         * The writer thread needs to know which exanic the data came from
+         * so that it can do time stamp conversions
+         */
+        eio_stream_t* exa_stream = NULL;
+        eio_args_t exaargs = { 0 };
+        exaargs.type = EIO_EXA;
+        exaargs.args.exa.interface_rx = (char*) iface;
+        exaargs.args.exa.interface_tx = NULL;
+        int err = eio_new (&exaargs, &exa_stream);
+        if (err)
+        {
+            ch_log_error("Could not create listener input stream %s\n");
+            return -1;
+        }
+        istreams[iface_idx].exa_istream = exa_stream;
+        if (defer_ts)
+        {
+            istreams[iface_idx].tick_hz = exa_rx_tick_hz (exa_stream);
+        }
+    }
+
+    wd->stats = &wstats[wparams->wtid];
+    wd->curr_istream = wparams->wtid % wd->num_istreams;
+
+    dest_state_t* dst = &wd->dst;
+    dst->destination   = dest;
+    dst->dummy_ostream = wparams->dummy_ostream;
+    dst->pool          = wparams->pool;
+    dst->geom          = wparams->geom;
+    dst->raw           = !strncmp (dest, RAW_DEST_PREFIX,
+                                   strlen(RAW_DEST_PREFIX));
+    for (int64_t i = 0; i < wd->num_istreams; i++)
+    {
+        const int64_t used = strlen (dst->ports);
+        snprintf (dst->ports + used, sizeof(dst->ports) - used, "%s%s",
+                  i ? "," : "", ifaces->first[i]);
+        dst->port_mask |= expcap_block_port_bit (istreams[i].dev_id,
+                                                 istreams[i].port_num);
+    }
+    if (dst->raw && strlen (dst->ports) >= RAW_SEG_PORTS)
+    {
+        ch_log_warn("Too many interfaces to list in the catalog on %s, only "
+                    "the first %i characters are kept, and the port mask\n",
+                    dest, RAW_SEG_PORTS - 1);
+    }
+
+    /* Null, raw and buffered outputs are always written in line */
+    if (async && !dst->dummy_ostream && !dst->raw && !dst->geom.writeback)
+    {
+        if (aioq_init (&wd->aio))
+        {
+            ch_log_error("Could not set up asynchronous writes for %s\n",
+                         dest);
+            return -1;
+        }
+        dst->aio = &wd->aio;
+    }
+
+    /* When coalescing, slots with only a little packet data are gathered into
+     * a staging buffer and written out together */
+    coalesce_state_t* staging = &wd->staging;
+    if (coalesce_bytes > 0 || merge_ns > 0)
+    {
+        staging->buff = buff_alloc (DISK_BLOCK, BRING_SLOT_SIZE);
+        staging->spare = dst->aio ? buff_alloc (DISK_BLOCK, BRING_SLOT_SIZE)
+                                  : NULL;
+        if (!staging->buff || (dst->aio && !staging->spare))
+        {
+            ch_log_error("Could not allocate coalescing buffer\n");
+            return -1;
+        }
+    }
+
+    /* Room for a whole stripe, plus padding out to a block when flushing.
+     * Slots may not be aligned to large sectors, then they are copied in and
+     * written a slot at a time */
+    if (dst->geom.stripe)
+    {
+        dst->stripe_cap = dst->geom.block > DISK_BLOCK ?
+                round_up(BRING_SLOT_SIZE, dst->geom.stripe) : dst->geom.stripe;
+        const int64_t stripe_buff_len = dst->stripe_cap + dst->geom.block;
+        dst->stripe_buff = buff_alloc (dst->geom.block, stripe_buff_len);
+        dst->stripe_spare = dst->aio ?
+                buff_alloc (dst->geom.block, stripe_buff_len) : NULL;
+        if (!dst->stripe_buff || (dst->aio && !dst->stripe_spare))
+        {
+            ch_log_error("Could not allocate stripe buffer\n");
+            return -1;
+        }
+    }
+
+    /* Room for a slot's worth of plain pcap, on top of what is left over
+     * from last time and padding out to a block. Pcapng blocks can be bigger
+     * than the records they are made from */
+    if (out_format != OUT_FORMAT_EXPCAP)
+    {
+        const int64_t unit = dst->geom.stripe ? dst->geom.stripe :
+                                                dst->geom.block;
+        const int64_t max_pkts = BRING_SLOT_SIZE / min_pcap_rec + 1;
+        int64_t plain_cap = BRING_SLOT_SIZE + unit;
+        if (out_format == OUT_FORMAT_PCAPNG)
+        {
+            plain_cap += max_pkts * (PCAPNG_EPB_MAX + PCAPNG_IDB_MAX);
+        }
+        plain_cap = round_up(plain_cap, dst->geom.block);
+        dst->plain_buff = buff_alloc (dst->geom.block, plain_cap);
+        dst->plain_spare = dst->aio ? buff_alloc (dst->geom.block, plain_cap)
+                                    : NULL;
+        if (out_format == OUT_FORMAT_PCAP)
+        {
+            dst->ftr_recs = calloc (max_pkts, sizeof(expcap_footer_rec_t));
+        }
+        if (!dst->plain_buff || (dst->aio && !dst->plain_spare) ||
+            (out_format == OUT_FORMAT_PCAP && !dst->ftr_recs))
+        {
+            ch_log_error("Could not allocate plain pcap buffer\n");
+            return -1;
+        }
+    }
+
+    if (burst_bytes > 0 && burst_init (&dst->burst, burst_bytes))
+    {
+        ch_log_error("Could not allocate burst buffer\n");
+        return -1;
+    }
+    dst->hold = trigger_pre_ns > 0;
+
+    if (rotate_ns > 0)
+    {
+        const int64_t now_ns = time_now_ns();
+        dst->window_ns = now_ns - now_ns % rotate_ns;
+    }
+    file_name (dst->filename, sizeof(dst->filename), dest, dst->window_ns,
+               dst->file_id);
+    if (dest_open (dst))
+    {
+        ch_log_error("Could not open new output file\n");
+        return -1;
+    }
+    dest_aio_start (dst);
+
+    return clock_open (dst) || plain_open (dst) ? -1 : 0;
+}
+
+
+/*
+ * Let go of the ring slots held for asynchronous writes once they are written,
+ * oldest first. Returns true if there is room to hold on to another.
+ */
+static inline bool writer_dest_unhold (writer_dest_t* wd,
+                                       istream_state_t* istream, bool wait)
+{
+    while (istream->held)
+    {
+        const int64_t seq = istream->held_seqs[istream->held_head];
+        if (aioq_reap (&wd->aio, wait ? seq : 0) < seq)
+        {
+            break;
+        }
+
+        /* A dummy stream only has the one slot, which it still has out */
+        if (istream->bring)
+        {
+            bring_rd_free (istream->istream);
+        }
+        else
+        {
+            eio_rd_rel (istream->istream, NULL);
+        }
+        istream->held--;
+        istream->held_head = (istream->held_head + 1) % SLOTS_IN_FLIGHT;
+    }
+
+    return istream->held < (istream->bring ? SLOTS_IN_FLIGHT : 1);
+}
+
+
+/*
+ * Idle time work for when there is nothing to read: flushing, rotating,
+ * triggers and the burst buffer. The first three are only done once all of
+ * the rings have been looked at. Returns 1 if the burst buffer was written
+ * from, 0 if there was nothing to do and -1 if the output has failed.
+ */
+static int writer_dest_quiet (writer_dest_t* wd, bool pass_done)
+{
+    wstats_t* stats = wd->stats;
+    dest_state_t* dst = &wd->dst;
+    coalesce_state_t* staging = &wd->staging;
+
+    /* Don't hold coalesced data for too long when things are
+     * quiet. Check once per pass over the rings */
+    ifunlikely(staging->len && pass_done)
+    {
+        int64_t now;
+        eio_nowns(&now);
+        if (now - staging->start_ns >= flush_max_latency_ns &&
+            flush_staging(staging, dst, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+    }
+
+    /* Start the next time window's file even if nothing arrives */
+    ifunlikely(rotate_ns > 0 && pass_done)
+    {
+        const int64_t now_ns = time_now_ns();
+        if (now_ns >= dst->window_ns + rotate_ns &&
+            dest_rotate(dst, now_ns, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+    }
+
+    /* Age out history, and notice triggers when it is quiet */
+    ifunlikely(trigger_pre_ns > 0 && pass_done)
+    {
+        int64_t now_ns;
+        eio_nowns(&now_ns);
+        trigger_update(dst, now_ns);
+        if (dst->hold && !dst->keep)
+        {
+            burst_expire(&dst->burst, now_ns - trigger_pre_ns);
+        }
+    }
+
+    /* Nothing to read, catch up on the burst buffer */
+    ifunlikely(dst->burst.count && (!dst->hold || dst->keep))
+    {
+        dst->behind = false;
+        if (burst_drain(dst, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Get a slot ready to be written. The packets' timestamps are converted from
+ * cycles into UTC, and they are counted and checked for triggers. Returns the
+ * offset of the end of the last real packet.
+ */
+static int64_t slot_convert (writer_dest_t* wd, istream_state_t* istream,
+                             char* rd_buff, int64_t rd_buff_len)
+{
+    wstats_t* stats = wd->stats;
+
+    /* Update the timestamps / stats in the packets */
+    pcap_pkthdr_t* pkt_hdr = (pcap_pkthdr_t*) rd_buff;
+    expcap_pktftr_t* pkt_ftr = NULL;
+    eio_stream_t* exa_istream = istream->exa_istream;
+    struct exanic_timespecps tsps = {0,0};
+    int64_t data_end = 0; /* Offset of the end of the last real packet */
+
+#if !defined(NDEBUG) || !defined(NOIFASSERT)
+    int64_t hdrs_count = -1;
+#endif
+
+    /* With deferred timestamps the packets are left alone, the writer only
+     * notes how to convert their times later. The listener has already
+     * counted them into the block header */
+    ifunlikely(defer_ts)
+    {
+        clock_sample (&wd->dst, istream, pkt_hdr);
+        const expcap_block_t* blk = expcap_block_get (pkt_hdr);
+        stats->packets += blk ? blk->packets : 0;
+        data_end = rd_buff_len;
+        pkt_hdr = (pcap_pkthdr_t*)(rd_buff + rd_buff_len);
+    }
+
+    for(; (char*) pkt_hdr < rd_buff + rd_buff_len;  )
+    {
+        ch_log_debug2("Looking at packet %i, offset %iB, len=%li ts=%li.%09li\n",
+                      ++hdrs_count, ((char*)pkt_hdr-rd_buff), pkt_hdr->caplen,
+                      pkt_hdr->ts.ns.ts_sec, pkt_hdr->ts.ns.ts_nsec);
+
+        /* preload for performance */
+        const pcap_pkthdr_t *  pkt_hdr_next = (pcap_pkthdr_t*)PKT_OFF(pkt_hdr,pkt_hdr->caplen);
+        __builtin_prefetch(&pkt_hdr_next->caplen);
+
+        iflikely(pkt_hdr->len)
+        {
+            //We don't need to count this packet beacuse it's a dummy
+            stats->packets++;
+            stats->pcbytes += pkt_hdr->caplen - sizeof(pcap_pkthdr_t);
+            stats->plbytes += pkt_hdr->len;
+            data_end = (char*)pkt_hdr_next - rd_buff;
+
+            ifunlikely(trigger_match.len &&
+                       trigger_match_pkt(PKT(pkt_hdr), pkt_hdr->caplen -
+                                         sizeof(expcap_pktftr_t)))
+            {
+                trigger_fire();
+            }
+        }
+
+#ifndef NOIFASSERT
+        ifassert(pkt_hdr->caplen > max_pcap_rec)
+        {
+            ch_log_fatal("Packet at %li is %liB, max length is %liB\n",
+                         hdrs_count, pkt_hdr->caplen, max_pcap_rec);
+        }
+#endif
+
+
+        pkt_ftr = (expcap_pktftr_t*)((char*)pkt_hdr_next - sizeof(expcap_pktftr_t));
+
+        /* Convert the timestamp from cycles into UTC, unless the switch
+         * has given the packet a better one */
+        const exanic_cycles_t ts_cycles = pkt_hdr->ts.raw;
+        exa_rxcycles_to_timespecps(exa_istream, ts_cycles, &tsps);
+        ifunlikely(ts_trailer != TS_TRAILER_NONE && pkt_hdr->len)
+        {
+            trailer_time (pkt_hdr, pkt_ftr, &tsps);
+        }
+
+        /* Assign the corrected timestamp from one of the above modes */
+        pkt_hdr->ts.ns.ts_nsec = tsps.tv_psec / 1000;
+        pkt_hdr->ts.ns.ts_sec =  tsps.tv_sec;
+
+        pkt_ftr->ts_secs  = tsps.tv_sec;
+        pkt_ftr->ts_psecs = tsps.tv_psec;
+
+        /* Skip to the next header, these should have been preloaded by now*/
+        pkt_hdr = (pcap_pkthdr_t*)pkt_hdr_next;
+    }
+
+    /* The block header's times are those of its first and last packets */
+    expcap_block_t* blk = expcap_block_get ((pcap_pkthdr_t*)rd_buff);
+    iflikely(blk && !defer_ts && data_end > (int64_t)EXPCAP_BLOCK_REC)
+    {
+        block_times (blk, pkt_footer ((pcap_pkthdr_t*)(rd_buff +
+                                                       EXPCAP_BLOCK_REC)),
+                     (expcap_pktftr_t*)(rd_buff + data_end) - 1);
+    }
+
+    return data_end;
+}
+
+
+/* Which of two converted packets is earlier, to the picosecond */
+static inline bool pkt_before (const pcap_pkthdr_t* a, const pcap_pkthdr_t* b)
+{
+    const expcap_pktftr_t* fa = pkt_footer (a);
+    const expcap_pktftr_t* fb = pkt_footer (b);
+    return fa->ts_secs < fb->ts_secs ||
+           (fa->ts_secs == fb->ts_secs && fa->ts_psecs < fb->ts_psecs);
+}
+
+
+/*
+ * Move a ring on to its next packet to merge. Slots are held on to while their
+ * packets are merged, and released once they run out, when the next slot is
+ * looked for. Returns -1 on failure.
+ */
+static int merge_next (writer_dest_t* wd, istream_state_t* istream)
+{
+    pcap_pkthdr_t* pkt = istream->merge_pkt;
+    if (istream->merge_slot)
+    {
+        pkt = (pcap_pkthdr_t*)PKT_OFF(pkt, pkt->caplen);
+    }
+    else
+    {
+        char* rd_buff = NULL;
+        int64_t rd_buff_len = 0;
+        const eio_error_t err = eio_rd_acq (istream->istream, &rd_buff,
+                                            &rd_buff_len, NULL);
+        if (err == EIO_ETRYAGAIN)
+        {
+            return 0;
+        }
+        if (err != EIO_ENONE)
+        {
+            ch_log_error("Unexpected error %i trying to get istream buffer\n",
+                         err);
+            return -1;
+        }
+
+        istream->merge_slot = rd_buff;
+        istream->merge_end  = rd_buff + slot_convert (wd, istream, rd_buff,
+                                                      rd_buff_len);
+
+        /* Its block header is left behind, but what it says sampling left
+         * out goes into the merged blocks */
+        const expcap_block_t* blk = expcap_block_get ((pcap_pkthdr_t*)rd_buff);
+        if (blk)
+        {
+            wd->staging.blk_flags     |= blk->flags & EXPCAP_BLOCK_FLAG_SAMPLED;
+            wd->staging.skipped       += blk->skipped;
+            wd->staging.skipped_bytes += blk->skipped_bytes;
+        }
+        eio_nowns(&istream->merge_got_ns);
+        pkt = (pcap_pkthdr_t*)rd_buff;
+    }
+
+    /* Skip the block header and any other padding */
+    while ((char*)pkt < istream->merge_end && !pkt->len)
+    {
+        pkt = (pcap_pkthdr_t*)PKT_OFF(pkt, pkt->caplen);
+    }
+
+    istream->merge_pkt = pkt;
+    if ((char*)pkt >= istream->merge_end)
+    {
+        eio_rd_rel (istream->istream, NULL);
+        istream->merge_slot = NULL;
+        istream->merge_pkt  = NULL;
+    }
+    return 0;
+}
+
+
+/* Add a packet to the block being merged in the staging buffer */
+static eio_error_t merge_add (coalesce_state_t* staging, dest_state_t* dst,
+                              const pcap_pkthdr_t* pkt, wstats_t* stats)
+{
+    const int64_t rec_len = sizeof(pcap_pkthdr_t) + pkt->caplen;
+    if (staging->len + rec_len + min_pcap_rec + DISK_BLOCK > BRING_SLOT_SIZE)
+    {
+        const eio_error_t err = flush_staging (staging, dst, stats);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    if (!staging->len)
+    {
+        eio_nowns(&staging->start_ns);
+        staging->block = expcap_block_init ((pcap_pkthdr_t*)staging->buff,
+                                            EXPCAP_BLOCK_FLAG_NONE);
+        ((pcap_pkthdr_t*)staging->buff)->ts = pkt->ts;
+        staging->len = EXPCAP_BLOCK_REC;
+    }
+
+    memcpy (staging->buff + staging->len, pkt, rec_len);
+    staging->len   += rec_len;
+    staging->ts_raw = pkt->ts.raw;
+
+    const expcap_pktftr_t* ftr = pkt_footer (pkt);
+    const uint64_t ts_ns = footer_ns (ftr);
+    expcap_block_t* blk = staging->block;
+    blk->first_ts   = blk->packets ? blk->first_ts : ts_ns;
+    blk->last_ts    = ts_ns;
+    blk->port_mask |= expcap_block_port_bit (ftr->dev_id, ftr->port_id);
+    blk->packets++;
+    blk->flags         |= staging->blk_flags;
+    blk->skipped       += staging->skipped;
+    blk->skipped_bytes += staging->skipped_bytes;
+    staging->skipped       = 0;
+    staging->skipped_bytes = 0;
+    blk->length   = staging->len;
+    blk->data_len = staging->len;
+    return EIO_ENONE;
+}
 
-#ifndef NOIFASSERT
-            ifassert(pkt_hdr->caplen > max_pcap_rec)
+
+/*
+ * Merge the packets from all of the rings into time order as they are
+ * written. The earliest packet waiting is taken next, as long as every ring
+ * has a packet waiting. Otherwise it is taken once its slot has been waiting
+ * for merge_ns, by which time a quiet ring can't be holding anything earlier
+ * (listeners flush at least every flush_max_latency_ns). With "drain"
+ * everything waiting is taken. At most about a slot's worth is merged at a
+ * time. Returns 1 if there was work to do, 0 if there was not and -1 if the
+ * output has failed.
+ */
+static int writer_dest_merge (writer_dest_t* wd, bool drain)
+{
+    istream_state_t* istreams = wd->istreams;
+    int64_t now_ns = 0;
+    int64_t merged = 0;
+
+    while (merged < BRING_SLOT_SIZE)
+    {
+        istream_state_t* first = NULL;
+        bool waiting = false;
+        for (int64_t i = 0; i < wd->num_istreams; i++)
+        {
+            istream_state_t* istream = &istreams[i];
+            if (!istream->merge_slot && merge_next (wd, istream))
             {
-                ch_log_fatal("Packet at %li is %liB, max length is %liB\n",
-                             hdrs_count, pkt_hdr->caplen, max_pcap_rec);
+                return -1;
             }
-#endif
 
+            if (!istream->merge_slot)
+            {
+                waiting = true;
+            }
+            else if (!first || pkt_before (istream->merge_pkt, first->merge_pkt))
+            {
+                first = istream;
+            }
+        }
+
+        if (!first)
+        {
+            break;
+        }
 
-            pkt_ftr = (expcap_pktftr_t*)((char*)pkt_hdr_next - sizeof(expcap_pktftr_t));
+        if (waiting && !drain)
+        {
+            if (!now_ns)
+            {
+                eio_nowns(&now_ns);
+            }
+            if (now_ns - first->merge_got_ns < merge_ns)
+            {
+                break;
+            }
+        }
 
-            /* Convert the timestamp from cycles into UTC */
-            const exanic_cycles_t ts_cycles = pkt_hdr->ts.raw;
-            exa_rxcycles_to_timespecps(exa_istream, ts_cycles, &tsps);
+        merged += sizeof(pcap_pkthdr_t) + first->merge_pkt->caplen;
+        if (merge_add (&wd->staging, &wd->dst, first->merge_pkt, wd->stats) ==
+            EIO_ECLOSED || merge_next (wd, first))
+        {
+            return -1;
+        }
+    }
 
-            /* Assign the corrected timestamp from one of the above modes */
-            pkt_hdr->ts.ns.ts_nsec = tsps.tv_psec / 1000;
-            pkt_hdr->ts.ns.ts_sec =  tsps.tv_sec;
+    ifunlikely(trigger_pre_ns > 0 && merged)
+    {
+        eio_nowns(&now_ns);
+        trigger_update(&wd->dst, now_ns);
+    }
 
-            pkt_ftr->ts_secs  = tsps.tv_sec;
-            pkt_ftr->ts_psecs = tsps.tv_psec;
+    return merged ? 1 : writer_dest_quiet (wd, true);
+}
 
-            /* Skip to the next header, these should have been preloaded by now*/
-            pkt_hdr = (pcap_pkthdr_t*)pkt_hdr_next;
-        }
 
+/*
+ * Look over the rings once, carrying on from where the last look left off,
+ * and write out the first slot found. Catches up on the idle time work
+ * (flushing, rotating, triggers and the burst buffer) once per pass when the
+ * rings are empty. Returns 1 if there was work to do, 0 if there was not and
+ * -1 if the output has failed.
+ */
+static int writer_dest_poll (writer_dest_t* wd)
+{
+    istream_state_t* istreams = wd->istreams;
+    const int64_t num_istreams = wd->num_istreams;
+    wstats_t* stats = wd->stats;
+    dest_state_t* dst = &wd->dst;
+    coalesce_state_t* staging = &wd->staging;
 
+    char* rd_buff = NULL;
+    int64_t rd_buff_len = 0;
+    int64_t curr_istream = wd->curr_istream;
 
-        /* Give the input buffer over to the outputs stream (zero copy)*/
-        eio_error_t err = eio_wr_acq (ostream, &rd_buff, &rd_buff_len, NULL);
-        if (err)
+    ifunlikely(merge_ns > 0)
+    {
+        return writer_dest_merge (wd, false);
+    }
+
+    //Find a buffer
+    for (int64_t looked = 0; ; curr_istream++, looked++, stats->spins++)
+    {
+        if (looked == num_istreams)
+        {
+            wd->curr_istream = curr_istream;
+            return 0;
+        }
+
+        //ch_log_debug3("Looking at istream %li/%li\n", curr_istream,
+        //              num_istreams);
+        curr_istream = curr_istream >= num_istreams ? 0 : curr_istream;
+        eio_stream_t* istream = istreams[curr_istream].istream;
+        eio_error_t err = EIO_ETRYAGAIN;
+        if (writer_dest_unhold (wd, &istreams[curr_istream], false))
+        {
+            err = eio_rd_acq (istream, &rd_buff, &rd_buff_len, NULL);
+        }
+        if (err == EIO_ETRYAGAIN)
+        {
+            const int quiet = writer_dest_quiet (wd,
+                    curr_istream == num_istreams - 1);
+            if (quiet)
+            {
+                wd->curr_istream = curr_istream;
+                return quiet;
+            }
+
+            continue; /* Look at the next ring */
+        }
+        if (err != EIO_ENONE)
         {
             ch_log_error(
-                    "Could not get writer buffer with unexpected error %i\n",
+                    "Unexpected error %i trying to get istream buffer\n",
                     err);
-            if (err == EIO_ECLOSED)
+            return -1;
+        }
+
+        ch_log_debug1("Got buffer of size %li (0x%08x)\n", rd_buff_len,
+                      rd_buff_len);
+        ifassert(rd_buff_len == 0)
+        {
+            ch_log_error("Unexpected packet size of 0\n");
+            return -1;
+        }
+
+        break;
+    }
+
+    /* At this point we have a buffer full of packets */
+    const int64_t data_end = slot_convert (wd, &istreams[curr_istream], rd_buff,
+                                           rd_buff_len);
+
+    ifunlikely(trigger_pre_ns > 0)
+    {
+        int64_t now_ns;
+        eio_nowns(&now_ns);
+        trigger_update(dst, now_ns);
+    }
+
+    /* Is the disk keeping up with this ring? */
+    ifunlikely(dst->burst.mem && !dst->hold && istreams[curr_istream].bring)
+    {
+        const int64_t ready = bring_rd_ready (
+                istreams[curr_istream].istream, BURST_HIGH_WATER);
+        dst->behind = ready >= BURST_HIGH_WATER;
+        if (dst->burst.count && ready < BURST_LOW_WATER &&
+            burst_drain(dst, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+    }
+
+    dst->slot_seq = 0;
+    ifunlikely(staging->buff && data_end < coalesce_bytes)
+    {
+        /* Only a little data in this slot. Stage it, dropping the padding
+         * on the end, and pad it out again once when the staging buffer
+         * is written */
+        if (staging->len + data_end + min_pcap_rec + DISK_BLOCK >
+            BRING_SLOT_SIZE &&
+            flush_staging(staging, dst, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+
+        if (!staging->len)
+        {
+            eio_nowns(&staging->start_ns);
+        }
+
+        memcpy (staging->buff + staging->len, rd_buff, data_end);
+
+        /* The block ends where its packets do now */
+        if (data_end)
+        {
+            staging->block = expcap_block_get (
+                    (pcap_pkthdr_t*)(staging->buff + staging->len));
+            if (staging->block)
             {
-                goto finished;
+                staging->block->length = data_end;
             }
         }
 
-        /* Now flush to disk */
-        eio_wr_rel (ostream, rd_buff_len, NULL);
-        bytes_written += rd_buff_len;
+        staging->len   += data_end;
+        staging->ts_raw = ((pcap_pkthdr_t*)rd_buff)->ts.raw;
+    }
+    else
+    {
+        /* Anything already staged must go first to keep things in order */
+        if (flush_staging(staging, dst, stats) == EIO_ECLOSED)
+        {
+            return -1;
+        }
+
+        /* Give the input buffer over to the outputs stream (zero copy)*/
+        dst->slot     = rd_buff;
+        dst->slot_len = rd_buff_len;
+        const eio_error_t err = dest_queue(dst, rd_buff, rd_buff_len, stats);
+        dst->slot     = NULL;
+        if (err == EIO_ECLOSED)
+        {
+            return -1;
+        }
+    }
+
+    /* Release the istream, or hold on to it while it is still being written
+     * out asynchronously. Slots go back in order, so one that is already
+     * written still waits behind any held before it */
+    istream_state_t* const istream = &istreams[curr_istream];
+    if (dst->aio && (dst->slot_seq > dst->aio->completed || istream->held))
+    {
+        if (istream->bring)
+        {
+            bring_rd_keep (istream->istream);
+        }
+        istream->held_seqs[(istream->held_head + istream->held) %
+                           SLOTS_IN_FLIGHT] = dst->slot_seq;
+        istream->held++;
+    }
+    else
+    {
+        eio_rd_rel (istream->istream, NULL);
+    }
+
+    /* Make sure we look at the next ring next time for fairness */
+    wd->curr_istream = curr_istream + 1;
+    return 1;
+}
 
-        /* Release the istream */
-        eio_stream_t* istream = istreams[curr_istream].istream;
-        eio_rd_rel (istream, NULL);
-        /* Make sure we look at the next ring next time for fairness */
-        curr_istream++;
 
-        /*  Stats */
-        stats->dbytes += rd_buff_len;
+/* Write out whatever is left over, close the output and free everything */
+static void writer_dest_fini (writer_dest_t* wd)
+{
+    dest_state_t* dst = &wd->dst;
 
-        /* Is the file too big? Make a new one! */
-        ifunlikely(max_file_size > 0 && bytes_written >= max_file_size)
+    /* Flush old buffer if it exists */
+    if (dst->ostream)
+    {
+        dst->behind = false;
+        while (merge_ns > 0 && writer_dest_merge (wd, true) > 0);
+        flush_staging(&wd->staging, dst, wd->stats);
+        while (dst->burst.count && (!dst->hold || dst->keep) &&
+               burst_drain(dst, wd->stats) == EIO_ENONE);
+        stripe_flush(dst, wd->stats);
+        plain_flush(dst, wd->stats);
+    }
+    dest_aio_stop (dst);
+    clock_close (dst);
+    plain_close (dst);
+    for (int64_t i = 0; dst->aio && i < wd->num_istreams; i++)
+    {
+        writer_dest_unhold (wd, &wd->istreams[i], true);
+    }
+    for (int64_t i = 0; i < wd->num_istreams; i++)
+    {
+        if (wd->istreams[i].merge_slot)
         {
-            eio_des (ostream);
-            if (open_file (dest, wparams->dummy_ostream, &ostream,
-                           file_id ))
+            eio_rd_rel (wd->istreams[i].istream, NULL);
+            wd->istreams[i].merge_slot = NULL;
+        }
+    }
+    /* Closing trims any unused preallocation */
+    if (dst->ostream)
+    {
+        eio_des (dst->ostream);
+        dst->ostream = NULL;
+    }
+    if (dst->aio)
+    {
+        aioq_fini (dst->aio);
+        dst->aio = NULL;
+    }
+    free (wd->staging.buff);
+    wd->staging.buff = NULL;
+    free (wd->staging.spare);
+    wd->staging.spare = NULL;
+    free (dst->stripe_buff);
+    dst->stripe_buff = NULL;
+    free (dst->stripe_spare);
+    dst->stripe_spare = NULL;
+    free (dst->plain_buff);
+    dst->plain_buff = NULL;
+    free (dst->plain_spare);
+    dst->plain_spare = NULL;
+    free (dst->ftr_recs);
+    dst->ftr_recs = NULL;
+    if (dst->burst.mem)
+    {
+        munmap (dst->burst.mem, dst->burst.mem_len);
+        free (dst->burst.lens);
+        free (dst->burst.times);
+        free (dst->burst.seqs);
+        dst->burst.mem = NULL;
+    }
+    ch_log_debug1("Writer for %s finished\n", wd->wparams->destination);
+}
+
+
+/**
+ * The writer thread listens to a collection of rings for listener threads. It
+ * takes blocks 4K aliged, pcap formatted data, updates the timestamps and
+ * writes to disk as quickly as it can.
+ *
+ * A writer thread may serve several outputs, each with its own rings. It then
+ * queues writes asynchronously and moves on to the next output rather than
+ * waiting, so that one thread keeps every disk's queue full.
+ */
+void* writer_thread (void* params)
+{
+    writer_params_t* wparams = params;
+    const int64_t num_outputs = MAX(wparams->num_outputs, 1);
+    const bool async = num_outputs > 1;
+
+    writer_dest_t* wdests = calloc (num_outputs, sizeof(writer_dest_t));
+    if (!wdests)
+    {
+        ch_log_error("Could not allocate writer state for %s\n",
+                     wparams->destination);
+        return NULL;
+    }
+
+    int64_t live = 0;
+    for (int64_t i = 0; i < num_outputs; i++)
+    {
+        if (writer_dest_init (&wdests[i], wparams + i, async))
+        {
+            ch_log_error("Could not start writing to %s\n",
+                         wparams[i].destination);
+            writer_dest_fini (&wdests[i]);
+            wdests[i].failed = true;
+            continue;
+        }
+        live++;
+    }
+
+
+    //**************************************************************************
+    //Writer - Real work begins here!
+    //**************************************************************************
+
+    while (!wstop && live > 0)
+    {
+        bool busy = false;
+        for (int64_t i = 0; i < num_outputs && !wstop; i++)
+        {
+            writer_dest_t* wd = &wdests[i];
+            if (wd->failed)
             {
-                ch_log_error("Could not open new output file\n");
-                goto finished;
+                continue;
             }
-            file_id++;
-            bytes_written = 0;
+
+            const int result = writer_dest_poll (wd);
+            ifunlikely(result < 0)
+            {
+                wd->failed = true;
+                writer_dest_fini (wd);
+                live--;
+                continue;
+            }
+            busy |= result > 0;
+        }
+
+        if (!busy)
+        {
+            /* relax the CPU in this tight loop */
+            __asm__ __volatile__ ("pause");
         }
     }
 
-    finished:
-    /* Flush old buffer if it exists */
+    for (int64_t i = 0; i < num_outputs; i++)
+    {
+        if (!wdests[i].failed)
+        {
+            writer_dest_fini (&wdests[i]);
+        }
+    }
+    free (wdests);
+
     ch_log_debug1("Writer thread %s exiting\n", wparams->destination);
+    return NULL;
+}
+
+
+/* Give files the writer has taken from the pool their real names */
+static void pool_rename (file_pool_t* pool)
+{
+    for (; pool->named != pool->head; pool->named++)
+    {
+        __sync_synchronize();
+        const int64_t idx = pool->named % FILE_POOL_DEPTH;
+        char prep_name[1024] = {0};
+        file_name_prep (prep_name, sizeof(prep_name), pool->destination,
+                        pool->prep_ids[idx]);
+        if (rename (prep_name, pool->names[idx]))
+        {
+            ch_log_warn("Could not rename %s to %s: %s\n", prep_name,
+                        pool->names[idx], strerror(errno));
+        }
+    }
+}
+
+
+/* Remember a closed file, growing the history as needed */
+static void recorder_push (file_pool_t* pool, retired_file_t* retired)
+{
+    if (pool->history_count == pool->history_size)
+    {
+        const int64_t size = MAX(pool->history_size * 2, 64);
+        recorded_file_t* history = calloc (size, sizeof(recorded_file_t));
+        if (!history)
+        {
+            ch_log_fatal("Could not grow flight recorder history\n");
+        }
+        for (int64_t i = 0; i < pool->history_count; i++)
+        {
+            history[i] = pool->history[(pool->history_head + i) %
+                                       pool->history_size];
+        }
+        free (pool->history);
+        pool->history = history;
+        pool->history_size = size;
+        pool->history_head = 0;
+    }
+
+    recorded_file_t* rec = &pool->history[(pool->history_head +
+                                           pool->history_count) %
+                                          pool->history_size];
+    rec->name = strdup (retired->name);
+    rec->window_ns = retired->window_ns;
+    pool->history_count++;
+}
+
+
+/* Clock samples, with deferred timestamps, and footers, in plain pcap mode,
+ * go along with their file */
+static void sidecar_remove (const char* name)
+{
+    if (defer_ts)
+    {
+        char clk_name[1024 + sizeof(EXPCAP_CLOCK_SUFFIX)];
+        snprintf (clk_name, sizeof(clk_name), "%s%s", name,
+                  EXPCAP_CLOCK_SUFFIX);
+        unlink (clk_name);
+    }
+    if (out_format == OUT_FORMAT_PCAP)
+    {
+        char ftr_name[1024 + sizeof(EXPCAP_FOOTERS_SUFFIX)];
+        snprintf (ftr_name, sizeof(ftr_name), "%s%s", name,
+                  EXPCAP_FOOTERS_SUFFIX);
+        unlink (ftr_name);
+    }
+}
+
+
+/* Forget the oldest closed file, handing back its name */
+static char* recorder_pop (file_pool_t* pool)
+{
+    char* name = pool->history[pool->history_head].name;
+    pool->history_head = (pool->history_head + 1) % pool->history_size;
+    pool->history_count--;
+    return name;
+}
+
+
+/*
+ * Would keeping the oldest closed file, with "extra" more files on the way,
+ * break the flight recorder's limits? Apart from the closed files there is
+ * the writer's current file, plus any that are prepared or waiting to close.
+ */
+static bool recorder_over (file_pool_t* pool, int64_t extra, int64_t now_ns)
+{
+    if (!pool->history_count)
+    {
+        return false;
+    }
+
+    const int64_t files = pool->history_count + 1 + pool->tail - pool->rhead;
+    const recorded_file_t* oldest = &pool->history[pool->history_head];
+    return (ring_files > 0 && files + extra > ring_files) ||
+           (ring_ns > 0 && now_ns - (oldest->window_ns + rotate_ns) >= ring_ns);
+}
+
+
+/*
+ * Get a new file ready for the writer. In flight recorder mode the oldest
+ * file is recycled when the limits say it has to go anyway.
+ */
+static void pool_prepare (file_pool_t* pool, int64_t now_ns)
+{
+    char prep_name[1024] = {0};
+    file_name_prep (prep_name, sizeof(prep_name), pool->destination,
+                    pool->next_id);
+
+    bool overwrite = false;
+    if (recorder_over (pool, 1, now_ns))
+    {
+        char* oldest = recorder_pop (pool);
+        ch_log_debug1("Recycling %s as %s\n", oldest, prep_name);
+        sidecar_remove (oldest);
+        if (rename (oldest, prep_name))
+        {
+            ch_log_warn("Could not recycle %s: %s\n", oldest, strerror(errno));
+            unlink (oldest);
+        }
+        else
+        {
+            overwrite = true;
+        }
+        free (oldest);
+    }
+
+    eio_stream_t* ostream = NULL;
+    if (open_file (prep_name, pool->dummy_ostream, overwrite, &pool->geom,
+                   &ostream))
+    {
+        ch_log_error("Could not prepare output file %s\n", prep_name);
+        pool->failed = true;
+        return;
+    }
+
+    const int64_t idx = pool->tail % FILE_POOL_DEPTH;
+    pool->files[idx] = ostream;
+    pool->prep_ids[idx] = pool->next_id;
+    __sync_synchronize();
+    pool->tail++;
+    pool->next_id++;
+}
+
+
+/*
+ * Keep every writer's file pool topped up, name the files the writers take
+ * and close the files they have finished with, so that none of this happens
+ * on the writers' hot path. In flight recorder mode, old files beyond the
+ * limits are recycled or removed. On the way out, prepared files that were
+ * never used are removed.
+ */
+void* fileprep_thread (void* params)
+{
+    fileprep_params_t* fparams = (fileprep_params_t*)params;
+
+    while (!*fparams->stop)
+    {
+        bool idle = true;
+        const int64_t now_ns = time_now_ns();
+        for (int64_t i = 0; i < fparams->count; i++)
+        {
+            file_pool_t* pool = &fparams->pools[i];
+            if (!pool->destination)
+            {
+                continue; /* Not rotating files, e.g. a raw device */
+            }
+
+            if (pool->named != pool->head)
+            {
+                pool_rename (pool);
+                idle = false;
+            }
+
+            while (pool->rhead != pool->rtail)
+            {
+                __sync_synchronize();
+                retired_file_t* retired =
+                        &pool->retired[pool->rhead % FILE_POOL_DEPTH];
+                eio_des (retired->ostream);
+                if (ring_files > 0 || ring_ns > 0)
+                {
+                    recorder_push (pool, retired);
+                }
+                pool->rhead++;
+                idle = false;
+            }
+
+            /* Slots are only reused once the file in them has been named */
+            const bool need = !pool->failed &&
+                              pool->tail - pool->named < FILE_POOL_DEPTH;
+            if (need)
+            {
+                pool_prepare (pool, now_ns);
+                idle = false;
+            }
+
+            /* Anything else past the limits can go */
+            while (recorder_over (pool, 0, now_ns))
+            {
+                char* oldest = recorder_pop (pool);
+                ch_log_debug1("Removing old output file %s\n", oldest);
+                unlink (oldest);
+                sidecar_remove (oldest);
+                free (oldest);
+            }
+        }
+
+        if (idle)
+        {
+            usleep (1000);
+        }
+    }
+
+    for (int64_t i = 0; i < fparams->count; i++)
+    {
+        file_pool_t* pool = &fparams->pools[i];
+        pool_rename (pool);
+
+        for (; pool->rhead != pool->rtail; pool->rhead++)
+        {
+            eio_des (pool->retired[pool->rhead % FILE_POOL_DEPTH].ostream);
+        }
+
+        for (; pool->head != pool->tail; pool->head++)
+        {
+            const int64_t idx = pool->head % FILE_POOL_DEPTH;
+            eio_des (pool->files[idx]);
+
+            char prep_name[1024] = {0};
+            file_name_prep (prep_name, sizeof(prep_name), pool->destination,
+                            pool->prep_ids[idx]);
+            ch_log_debug1("Removing unused output file %s\n", prep_name);
+            unlink (prep_name);
+        }
+
+        while (pool->history_count)
+        {
+            free (recorder_pop (pool));
+        }
+        free (pool->history);
+    }
 
+    ch_log_debug1("File preparation thread exiting\n");
     return NULL;
 }
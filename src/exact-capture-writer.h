@@ -30,6 +30,9 @@
 #include "data_structs/pthread_vec.h"
 #include "data_structs/eiostream_vec.h"
 #include "data_structs/pcap-structures.h"
+#include "data_structs/expcap_block.h"
+#include "data_structs/expcap_footers.h"
+#include "data_structs/pcapng.h"
 
 #include "exactio/exactio.h"
 #include "exactio/exactio_exanic.h"
@@ -37,6 +40,26 @@
 
 #include "exact-capture.h"
 #include "utils.h"
+#include "aioq.h"
+
+/*
+ * How a destination likes to be written to. Writes are gathered into whole,
+ * aligned stripes so that RAID arrays do not have to read-modify-write, and
+ * so that devices with large sectors get whole sectors.
+ */
+typedef struct
+{
+    int64_t block;  /* Logical block size, at least DISK_BLOCK */
+    int64_t stripe; /* Size of the writes to gather data into, 0 for none */
+    int64_t writeback; /* Buffered I/O, paced in chunks this big. 0 for O_DIRECT */
+} io_geom_t;
+
+/*
+ * Ring slots that may be waiting on asynchronous writes at once, per ring.
+ * Slots are written straight from the ring, so this is how far ahead of the
+ * disk a writer can get on each ring.
+ */
+#define SLOTS_IN_FLIGHT (8)
 
 typedef struct
 {
@@ -47,7 +70,10 @@ typedef struct
     volatile bool* stop;
     bool dummy_istream;
     bool dummy_ostream;
-    int64_t wtid; /* Writer thread id */
+    int64_t wtid; /* Writer (output) id */
+    struct file_pool_s* pool; /* Prepared files to rotate to, or NULL */
+    io_geom_t geom;
+    int64_t num_outputs; /* Outputs the thread serves, this one and those after */
 } writer_params_t;
 
 typedef struct
@@ -56,9 +82,200 @@ typedef struct
     eio_stream_t* exa_istream;
     ch_word dev_id;
     ch_word port_num;
+    bool bring; /* False when replaced by a dummy stream */
+    int64_t held;     /* Slots kept until their asynchronous writes are done */
+    int64_t held_head; /* Oldest of them in held_seqs */
+    int64_t held_seqs[SLOTS_IN_FLIGHT];
+    uint32_t tick_hz; /* For clock samples, with deferred timestamps */
+    char* merge_slot; /* Slot being merged from, when merging */
+    char* merge_end;  /* End of the last real packet in it */
+    int64_t merge_got_ns; /* When it was got */
+    pcap_pkthdr_t* merge_pkt; /* Next packet to merge */
 } istream_state_t;
 
+/*
+ * DRAM FIFO of slot sized entries that absorbs bursts when disks fall behind.
+ * In trigger mode it also holds the pre-trigger history.
+ */
+typedef struct
+{
+    char* mem;
+    int64_t mem_len;
+    int64_t* lens;   /* Bytes used in each entry */
+    int64_t* times;  /* When each entry was added */
+    int64_t* seqs;   /* Last asynchronous write from each entry */
+    int64_t entries; /* Capacity */
+    int64_t head;    /* Oldest entry */
+    int64_t count;
+} burst_state_t;
+
+/*
+ * Files are opened, preallocated and given a pcap header ahead of time by the
+ * file preparation thread, so that writers can rotate files without doing any
+ * of that on their hot path. Each pool has a single producer (the file
+ * preparation thread) and a single consumer (the writer). Files are prepared
+ * under a temporary name and renamed once the writer takes them, as their
+ * final name depends on when that happens. Files the writer is done with are
+ * handed back to be closed.
+ *
+ * In flight recorder mode the helper also remembers the closed files, oldest
+ * first, and recycles or removes the oldest to stay within the limits.
+ */
+#define FILE_POOL_DEPTH (2)
+
+typedef struct
+{
+    eio_stream_t* ostream;
+    char name[1024];
+    int64_t window_ns;
+} retired_file_t;
+
+typedef struct
+{
+    char* name;
+    int64_t window_ns;
+} recorded_file_t;
+
+typedef struct file_pool_s
+{
+    char* destination;
+    bool dummy_ostream;
+    io_geom_t geom;
+
+    eio_stream_t* files[FILE_POOL_DEPTH];
+    int64_t prep_ids[FILE_POOL_DEPTH];   /* Names the files are prepared under */
+    char names[FILE_POOL_DEPTH][1024];   /* Names the writer gives them */
+    volatile int64_t head;  /* Next file the writer takes */
+    volatile int64_t tail;  /* Next file the helper prepares */
+    int64_t named;          /* Next taken file the helper renames */
+    int64_t next_id;
+
+    retired_file_t retired[FILE_POOL_DEPTH];
+    volatile int64_t rhead;
+    volatile int64_t rtail;
+
+    recorded_file_t* history; /* Helper only */
+    int64_t history_size;
+    int64_t history_head;
+    int64_t history_count;
+
+    volatile bool failed;
+} file_pool_t;
+
+typedef struct
+{
+    file_pool_t* pools;
+    int64_t count;
+    volatile bool* stop;
+} fileprep_params_t;
+
+/* A port in a pcapng file, its current interface, and the second that
+ * interface's timestamps count from */
+typedef struct
+{
+    uint16_t key; /* dev_id << 8 | port_id */
+    uint32_t if_id;
+    uint64_t ts_secs;
+} ng_if_t;
+
+/* Destinations starting with this are raw block devices, not files */
+#define RAW_DEST_PREFIX "raw:"
+
+/* Output state for a single destination */
+typedef struct
+{
+    char* destination;
+    bool dummy_ostream;
+    eio_stream_t* ostream;
+    char filename[1024];
+    int64_t window_ns; /* Start of the current time window, if rotating on time */
+    int64_t file_id;
+    int64_t bytes_written;
+    file_pool_t* pool;
+    bool raw;            /* Destination is a raw block device */
+    char ports[128];     /* Interfaces feeding this destination */
+    uint64_t port_mask;  /* and their bits, see expcap_block_port_bit() */
+
+    io_geom_t geom;
+    char* stripe_buff;   /* Data waiting for a whole stripe to build up */
+    char* stripe_spare;  /* The other half when writing asynchronously, */
+    int64_t stripe_seq;  /* and its last write, see dest_swap() */
+    int64_t stripe_cap;  /* Whole stripes that fit in stripe_buff */
+    int64_t stripe_len;
+    int64_t stripe_ts;   /* Time of the first packet in stripe_buff */
+
+    burst_state_t burst; /* Optional, sits in front of the ostream */
+    bool behind;         /* Rings are filling, divert to the burst buffer */
+    bool hold;           /* Trigger mode, keep everything in the burst buffer */
+    int64_t keep;        /* Oldest entries to write out anyway while holding */
+
+    aioq_t* aio;         /* Asynchronous writes, or NULL to write in line */
+    int64_t file_off;    /* Where the next asynchronous write goes */
+    char* slot;          /* Ring slot being written, which is held until its */
+    int64_t slot_len;    /* writes are done rather than waited on */
+    int64_t slot_seq;
+    int64_t buff_seq;    /* Last write from anything that is not a slot */
+
+    FILE* clk;           /* Clock samples, with deferred timestamps */
+
+    char* plain_buff;    /* Plain pcap(ng) waiting for a whole block, or */
+    int64_t plain_len;   /* NULL when writing expcap */
+    int64_t plain_trim;  /* Padding to trim off the end of the file */
+    char* plain_spare;   /* Double buffered like stripe_buff */
+    int64_t plain_seq;
+    expcap_footer_rec_t* ftr_recs; /* Footers of the packets being written */
+    FILE* ftr;           /* and the file they go to */
+    ng_if_t ng_ifs[MAX_ITHREADS]; /* Ports in the pcapng file so far */
+    int64_t ng_count;
+    int64_t ng_last;     /* Port of the last packet */
+    int64_t ng_ids;      /* Interfaces described in the file so far */
+} dest_state_t;
+
+/* Staging buffer used to coalesce small slots, or to merge packets into time
+ * order, before a single disk write */
+typedef struct
+{
+    char* buff;
+    int64_t len;
+    int64_t ts_raw;   /* Timestamp to use for padding records */
+    int64_t start_ns; /* Time that the oldest staged data was added */
+    expcap_block_t* block; /* Header of the last staged block */
+    uint16_t blk_flags;    /* Merged blocks' flags and packets left out by */
+    uint64_t skipped;      /* sampling, waiting for the next merged block */
+    uint64_t skipped_bytes;
+    char* spare;           /* Double buffered like stripe_buff */
+    int64_t spare_seq;
+} coalesce_state_t;
+
+/* Everything a writer thread keeps for each of the outputs it serves */
+typedef struct
+{
+    writer_params_t* wparams;
+    istream_state_t istreams[MAX_ITHREADS];
+    int64_t num_istreams;
+    int64_t curr_istream;
+    wstats_t* stats;
+    dest_state_t dst;
+    coalesce_state_t staging;
+    aioq_t aio;
+    bool failed;
+} writer_dest_t;
+
 void* writer_thread (void* params);
+void* fileprep_thread (void* params);
+
+/* Space reserved on disk for each new file */
+int64_t file_prealloc_size (const io_geom_t* geom);
+
+/* Work out the write geometry of a destination, from the device or --stripe,
+ * and whether it can be written with O_DIRECT */
+void dest_geometry (const char* destination, io_geom_t* geom);
+
+/* Largest stripe that writes will be gathered into */
+#define MAX_STRIPE (16 * 1024 * 1024)
+
+/* Dirty page cache allowed per file in buffered mode is about twice this */
+#define WRITEBACK_CHUNK (8 * 1024 * 1024)
 
 
 #endif /* SRC_EXACT_CAPTURE_WRITER_C_ */
@@ -18,6 +18,8 @@
 #include <sys/mman.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <exanic/port.h>
 
@@ -32,6 +34,7 @@
 #include "data_structs/eiostream_vec.h"
 #include "data_structs/pcap-structures.h"
 #include "data_structs/expcap.h"
+#include "data_structs/expcap_hash.h"
 
 #include "exactio/exactio.h"
 #include "exactio/exactio_exanic.h"
@@ -40,6 +43,12 @@
 #include "exact-capture.h"
 #include "exact-capture-listener.h"
 #include "exact-capture-writer.h"
+#include "numa.h"
+#include "trigger.h"
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 4 /* Linux 4.4+, may be missing from older headers */
+#endif
 
 #define EXACT_MAJOR_VER 1
 #define EXACT_MINOR_VER 0
@@ -96,10 +105,34 @@ static struct
     ch_word snaplen;
     ch_word calib_mode;
     ch_word max_file;
+    ch_word rotate_secs;
+    ch_float ring_gb;
+    ch_word ring_mins;
     ch_cstr log_file;
     ch_bool verbose;
     ch_word more_verbose_lvl;
     ch_float log_report_int_secs;
+    ch_float flush_latency_secs;
+    ch_float flush_padding;
+    ch_word coalesce_kb;
+    ch_word burst_mb;
+    ch_word stripe_kb;
+    bool buffered;
+    bool defer_timestamps;
+    bool raw_init;
+    ch_float merge_secs;
+    ch_cstr ts_trailer;
+    ch_cstr format;
+    ch_word sample_every;
+    ch_float sample_interval_secs;
+    ch_word flow_budget;
+    bool payload_hash;
+    ch_word output_writers;
+    ch_word outputs_per_writer;
+    ch_float trigger_pre_secs;
+    ch_float trigger_post_secs;
+    ch_cstr trigger_match;
+    ch_cstr trigger_socket;
     ch_bool no_log_ts;
     ch_bool no_kernel;
     ch_bool no_promisc;
@@ -107,6 +140,7 @@ static struct
     bool no_overflow_warn;
     bool debug_log;
     bool no_spinner;
+    bool mlockall;
 
 } options;
 
@@ -117,6 +151,26 @@ int64_t max_pkt_len;
 int64_t min_pcap_rec;
 int64_t max_pcap_rec;
 int64_t max_file_size;
+int64_t rotate_ns;
+int64_t ring_files;
+int64_t ring_ns;
+int64_t flush_max_latency_ns;
+double flush_max_padding;
+int64_t coalesce_bytes;
+int64_t burst_bytes;
+int64_t trigger_pre_ns;
+int64_t trigger_post_ns;
+int64_t stripe_bytes;
+bool buffered_io;
+bool defer_ts;
+bool raw_init;
+int64_t merge_ns;
+ts_trailer_t ts_trailer;
+out_format_t out_format;
+int64_t sample_every;
+int64_t sample_interval_ns;
+int64_t flow_budget;
+bool payload_hash;
 
 typedef exanic_port_stats_t pstats_t;
 
@@ -128,9 +182,20 @@ listener_params_t lparams_list[MAX_ITHREADS];
 
 volatile wstats_t wstats[MAX_ITHREADS];
 writer_params_t wparams_list[MAX_ITHREADS];
+file_pool_t file_pools[MAX_OTHREADS];
+volatile bool fstop = false;
 int device_ids[MAX_ITHREADS] = {0};
 int port_ids[MAX_OTHREADS] = {0};
 
+/* Where each thread, and the device it talks to, ended up */
+typedef struct {
+    int64_t cpu;
+    int cpu_node;
+    int dev_node; /* ExaNIC for listeners, disk for writers */
+} placement_t;
+static placement_t lplace[MAX_ITHREADS];
+static placement_t wplace[MAX_OTHREADS];
+
 
 /* Get the next valid CPU from a CPU set */
 static int64_t get_next_cpu (cpu_set_t* cpus)
@@ -149,19 +214,16 @@ static int64_t get_next_cpu (cpu_set_t* cpus)
 }
 
 /*
- * Start a thread, giving it a CPU and setting its scheduling parameters
+ * Start a thread on the given CPU and set its scheduling parameters
  */
-static int start_thread (cpu_set_t* avail_cpus, pthread_t *thread,
+static int start_thread (int64_t cpu, pthread_t *thread,
                   void *(*start_routine) (void *), void *arg)
 {
     pthread_attr_t attr;
     pthread_attr_init (&attr);
 
-    /* Figure out which core the thread will be on */
     cpu_set_t cpus;
     CPU_ZERO (&cpus);
-
-    int64_t cpu = get_next_cpu (avail_cpus);
     CPU_SET (cpu, &cpus);
     pthread_attr_setaffinity_np (&attr, sizeof(cpu_set_t), &cpus);
 
@@ -184,6 +246,13 @@ static int start_thread (cpu_set_t* avail_cpus, pthread_t *thread,
 ch_word lthreads_count = 0;
 int64_t hw_stop_ns;
 pstats_t pstats_stop [MAX_ITHREADS] = {{0}};
+static void trigger_signal_handler (int signum)
+{
+    (void)signum;
+    trigger_fire();
+}
+
+
 static void signal_handler (int signum)
 {
     ch_log_debug1("Caught signal %li, sending shut down signal\n", signum);
@@ -223,6 +292,9 @@ static inline lstats_t lstats_subtract(lstats_t* lhs, lstats_t* rhs)
     result.errors      = lhs->errors          - rhs->errors;
     result.swofl       = lhs->swofl           - rhs->swofl;
     result.hwofl       = lhs->hwofl           - rhs->hwofl;
+    result.pbytes      = lhs->pbytes          - rhs->pbytes;
+    result.skipped     = lhs->skipped         - rhs->skipped;
+    result.sbytes      = lhs->sbytes          - rhs->sbytes;
 
     return result;
 }
@@ -237,7 +309,11 @@ static inline lstats_t lstats_add(lstats_t* lhs, lstats_t* rhs)
     result.bytes_rx    = lhs->bytes_rx        + rhs->bytes_rx;
     result.dropped     = lhs->dropped         + rhs->dropped;
     result.swofl       = lhs->swofl           + rhs->swofl;
+    result.errors      = lhs->errors          + rhs->errors;
     result.hwofl       = lhs->hwofl           + rhs->hwofl;
+    result.pbytes      = lhs->pbytes          + rhs->pbytes;
+    result.skipped     = lhs->skipped         + rhs->skipped;
+    result.sbytes      = lhs->sbytes          + rhs->sbytes;
 
     return result;
 }
@@ -273,6 +349,8 @@ static inline wstats_t wstats_subtract(wstats_t* lhs, wstats_t* rhs)
     result.pcbytes = lhs->pcbytes - rhs->pcbytes;
     result.plbytes = lhs->plbytes - rhs->plbytes;
     result.packets = lhs->packets - rhs->packets;
+    result.writes  = lhs->writes  - rhs->writes;
+    result.bbytes  = lhs->bbytes  - rhs->bbytes;
     return result;
 }
 
@@ -285,6 +363,8 @@ static inline wstats_t wstats_add(wstats_t* lhs, wstats_t* rhs)
     result.pcbytes = lhs->pcbytes + rhs->pcbytes;
     result.plbytes = lhs->plbytes + rhs->plbytes;
     result.packets = lhs->packets + rhs->packets;
+    result.writes  = lhs->writes  + rhs->writes;
+    result.bbytes  = lhs->bbytes  + rhs->bbytes;
     return result;
 }
 
@@ -382,7 +462,7 @@ static void print_lstats(lstats_t lstats_delta, listener_params_t lparams,
     }
     else if(options.more_verbose_lvl == 2)
     {
-        ch_log_info("Listener:%02i %s:%i (%i.%i) -- %.2fGbps %.2fMpps (HW:%.2fiMpps) %.2fMB %li Pkts (HW:%i Pkts) [lost?:%li] (%.3fM Spins1 %.3fM SpinsP ) %lierrs %lidrp %liswofl %lihwofl\n",
+        ch_log_info("Listener:%02i %s:%i (%i.%i) -- %.2fGbps %.2fMpps (HW:%.2fiMpps) %.2fMB %li Pkts (HW:%i Pkts) [lost?:%li] (%.3fM Spins1 %.3fM SpinsP ) %.2fMB padding %lierrs %lidrp %liswofl %lihwofl\n",
                tid,
                lparams.exanic_dev,
                lparams.exanic_port,
@@ -400,6 +480,7 @@ static void print_lstats(lstats_t lstats_delta, listener_params_t lparams,
                maybe_lost,
                lstats_delta.spins1_rx / 1000.0 / 1000.0,
                lstats_delta.spinsP_rx / 1000.0 / 1000.0,
+               lstats_delta.pbytes / 1024.0 / 1024.0,
 
                lstats_delta.errors, lstats_delta.dropped, lstats_delta.swofl,
                lstats_delta.hwofl);
@@ -444,7 +525,7 @@ static void print_wstats(wstats_t wstats_delta,writer_params_t wparams, int tid,
     }
     else if(options.more_verbose_lvl == 2)
     {
-        ch_log_info("Writer:%02i %-17s -- %.2fGbps (%.2fGbps wire %.2fGbps disk) %.2fMpps %.2fMB (%.2fMB %.2fMB) %li Pkts %.3fM Spins\n",
+        ch_log_info("Writer:%02i %-17s -- %.2fGbps (%.2fGbps wire %.2fGbps disk) %.2fMpps %.2fMB (%.2fMB %.2fMB) %li Pkts %li Writes %.2fMB Burst %.3fM Spins\n",
                     tid,
                     pretty,
                     w_pcrate_gbs, w_plrate_gbs, w_drate_gbs,
@@ -453,6 +534,8 @@ static void print_wstats(wstats_t wstats_delta,writer_params_t wparams, int tid,
                     wstats_delta.plbytes / 1024.0 / 1024.0,
                     wstats_delta.dbytes / 1024.0 / 1024.0,
                     wstats_delta.packets,
+                    wstats_delta.writes,
+                    wstats_delta.bbytes / 1024.0 / 1024.0,
                     wstats_delta.spins / 1000.0 / 1000.0);
     }
 }
@@ -484,7 +567,7 @@ static void print_lstats_totals(lstats_t ldelta_total,
     }
     if(options.more_verbose_lvl == 2 )
     {
-        ch_log_info("%-27s -- %.2fGbps %.2fMpps (HW:%.2fiMpps) %.2fMB %li Pkts (HW:%i Pkts) [lost?:%li] (%.3fM Spins1 %.3fM SpinsP ) %lierrs %lidrp %liswofl %lihwofl\n",
+        ch_log_info("%-27s -- %.2fGbps %.2fMpps (HW:%.2fiMpps) %.2fMB %li Pkts (HW:%i Pkts) [lost?:%li] (%.3fM Spins1 %.3fM SpinsP ) %.2fMB padding %lierrs %lidrp %liswofl %lihwofl\n",
            "Total - All Listeners",
            sw_rx_rate_gbs,
            sw_rx_rate_mpps,
@@ -497,6 +580,7 @@ static void print_lstats_totals(lstats_t ldelta_total,
            maybe_lost,
            ldelta_total.spins1_rx / 1000.0 / 1000.0,
            ldelta_total.spinsP_rx / 1000.0 / 1000.0,
+           ldelta_total.pbytes / 1024.0 / 1024.0,
            ldelta_total.errors, ldelta_total.dropped, ldelta_total.swofl,
            ldelta_total.hwofl);
     }
@@ -523,7 +607,7 @@ static void print_wstats_totals(wstats_t wdelta_total, int64_t delta_ns )
     }
     else if(options.more_verbose_lvl == 2)
     {
-        ch_log_info("%-27s -- %.2fGbps (%.2fGbps wire %.2fGbps disk) %.2fMpps %.2fMB (%.2fMB %.2fMB) %li Pkts %.3fM Spins\n",
+        ch_log_info("%-27s -- %.2fGbps (%.2fGbps wire %.2fGbps disk) %.2fMpps %.2fMB (%.2fMB %.2fMB) %li Pkts %li Writes %.2fMB Burst %.3fM Spins\n",
                     "Total - All Writers",
                     w_pcrate_gbs, w_rate_mpps,
                     w_plrate_gbs, w_drate_gbs,
@@ -531,6 +615,8 @@ static void print_wstats_totals(wstats_t wdelta_total, int64_t delta_ns )
                     wdelta_total.plbytes / 1024.0 / 1024.0,
                     wdelta_total.dbytes / 1024.0 / 1024.0,
                     wdelta_total.packets,
+                    wdelta_total.writes,
+                    wdelta_total.bbytes / 1024.0 / 1024.0,
                     wdelta_total.spins / 1000.0 / 1000.0);
 
     }
@@ -561,20 +647,26 @@ static void print_stats_basic_totals(lstats_t ldelta_total, wstats_t wdelta_tota
 
     const double maybe_lost_hwsw_mpps = ((double) maybe_lost_hwsw) / delta_ns / 1000;
 
-    int64_t lost_rxwr_packets = ldelta_total.packets_rx - wdelta_total.packets;
+    /* Packets left out by sampling were never meant to be written */
+    int64_t lost_rxwr_packets = ldelta_total.packets_rx - ldelta_total.skipped -
+                                wdelta_total.packets;
     /* Can't have lost -ve lost packets*/
     lost_rxwr_packets = lost_rxwr_packets < 0 ? 0 : lost_rxwr_packets;
     const double lost_rxwr_mpps = ((double) lost_rxwr_packets) / delta_ns / 1000;
 
-    int64_t lost_rxwr_bytes = ldelta_total.bytes_rx - wdelta_total.pcbytes;
+    int64_t lost_rxwr_bytes = ldelta_total.bytes_rx - ldelta_total.sbytes -
+                              wdelta_total.pcbytes;
     /* Can't have lost -ve lost bytes*/
     lost_rxwr_bytes = lost_rxwr_bytes < 0 ? 0 : lost_rxwr_bytes;
     const double lost_rxwr_gbps = ((double) lost_rxwr_bytes * 8) / delta_ns;
 
     const double dropped_rate_mpps = ((double) ldelta_total.dropped ) /
             (delta_ns / 1000.0);
+    const double skipped_rate_mpps = ((double) ldelta_total.skipped ) /
+            (delta_ns / 1000.0);
     const double overflow_rate_ps = ((double) ldelta_total.swofl )
             / (delta_ns / 1000.0 / 1000.0 / 1000.0);
+    const double padding_gbps = ((double) ldelta_total.pbytes * 8) / delta_ns;
 
 
     const int col1_digits = max_digitsll(pdelta_total.rx_count,
@@ -652,12 +744,26 @@ static void print_stats_basic_totals(lstats_t ldelta_total, wstats_t wdelta_tota
                 ldelta_total.dropped ,
                 col2_digits,
                 dropped_rate_mpps);
+    if(ldelta_total.skipped)
+        fprintf(stderr,"%15s:%*li packets ( %*.3f MP/s )\n",
+                "Sampled out",
+                col1_digits,
+                ldelta_total.skipped ,
+                col2_digits,
+                skipped_rate_mpps);
     fprintf(stderr,"%15s:%*li times   ( %*.3f /s   )\n",
                 "SW Overflows",
                 col1_digits,
                 ldelta_total.swofl ,
                 col2_digits,
                 overflow_rate_ps);
+    if(options.more_verbose_lvl == 2)
+        fprintf(stderr,"%15s:%*li MB      ( %*.3f Gb/s )\n",
+                "Padding",
+                col1_digits,
+                ldelta_total.pbytes / 1024 / 1024,
+                col2_digits,
+                padding_gbps);
 
 
     /* TODO - There must be a better way to do this... */
@@ -720,12 +826,26 @@ static void print_stats_basic_totals(lstats_t ldelta_total, wstats_t wdelta_tota
                     ldelta_total.dropped ,
                     col2_digits,
                     dropped_rate_mpps);
+        if(ldelta_total.skipped)
+            ch_log_info("%15s:%*li packets ( %*.3f MP/s )\n",
+                    "Sampled out",
+                    col1_digits,
+                    ldelta_total.skipped ,
+                    col2_digits,
+                    skipped_rate_mpps);
         ch_log_info("%15s:%*li times   ( %*.3f /s   )\n",
                     "SW Overflows",
                     col1_digits,
                     ldelta_total.swofl ,
                     col2_digits,
                     overflow_rate_ps);
+        if(options.more_verbose_lvl == 2)
+            ch_log_info("%15s:%*li MB      ( %*.3f Gb/s )\n",
+                    "Padding",
+                    col1_digits,
+                    ldelta_total.pbytes / 1024 / 1024,
+                    col2_digits,
+                    padding_gbps);
 
     }
 
@@ -764,6 +884,7 @@ static CH_VECTOR(pthread)* start_listener_threads(cpu_set_t listener_cpus)
         listener_params_t* lparams = lparams_list + cap_port;
         lparams->interface      = *opt_int;
         lparams->dests          = options.dests;
+        lparams->output_writers = options.output_writers;
         lparams->stop           = &lstop;
         lparams->ltid           = lthreads->count;
         lparams->promisc        = !options.no_promisc;
@@ -810,8 +931,22 @@ static CH_VECTOR(pthread)* start_listener_threads(cpu_set_t listener_cpus)
         lparams->dummy_istream = dummy_istr;
         lparams->dummy_ostream = dummy_ostr;
 
+        /* Figure out which core the thread will be on, and place its brings
+         * on the same NUMA node */
+        placement_t* place = &lplace[cap_port];
+        place->cpu      = get_next_cpu (&listener_cpus);
+        place->cpu_node = numa_node_of_cpu (place->cpu);
+        place->dev_node = NUMA_NODE_UNKNOWN;
+        char netdev[64] = {0};
+        if (!exanic_get_interface_name (lparams->nic, lparams->exanic_port,
+                                        netdev, sizeof(netdev)))
+        {
+            place->dev_node = numa_node_of_iface (netdev);
+        }
+        lparams->numa_node = place->cpu_node;
+
         pthread_t thread = { 0 };
-        if (start_thread (&listener_cpus, &thread, listener_thread,
+        if (start_thread (place->cpu, &thread, listener_thread,
                           (void*) lparams))
         {
             ch_log_fatal("Fatal: Could not start listener thread %li\n",
@@ -841,6 +976,17 @@ static CH_VECTOR(pthread)* start_writer_threads(cpu_set_t writers)
      * from sharing cores */
     cpu_set_t writer_cpus = writers;
 
+    /* Outputs are shared out between writer threads in consecutive groups */
+    const int64_t per_writer = options.outputs_per_writer;
+    const int64_t num_writers = (options.dests->count + per_writer - 1) /
+                                per_writer;
+
+    /* Extra writers for an output only help if they have cores of their own */
+    if (options.output_writers > 1 && CPU_COUNT(&writers) < num_writers)
+    {
+        ch_log_warn("Only %i writer CPUs for %li writer threads, some will "
+                    "share cores\n", CPU_COUNT(&writers), num_writers);
+    }
 
     ch_log_debug1("Starting up writer threads\n");
     int wport = 0;
@@ -853,7 +999,7 @@ static CH_VECTOR(pthread)* start_writer_threads(cpu_set_t writers)
         wparams->destination = *opt_dest;
         wparams->interfaces = options.interfaces;
         wparams->stop = &lstop;
-        wparams->wtid = wthreads->count;
+        wparams->wtid = wport;
         wparams->exanic_dev_id = device_ids;
         wparams->exanic_port_id = port_ids;
 
@@ -880,13 +1026,55 @@ static CH_VECTOR(pthread)* start_writer_threads(cpu_set_t writers)
         wparams->dummy_istream = dummy_istr;
         wparams->dummy_ostream = dummy_ostr;
 
+        /* Rotated files are prepared ahead of time by the file preparation
+         * thread. The writer opens its first file itself. Raw devices have
+         * no files to prepare, segments are started in line. */
+        const bool raw = !strncmp (wparams->destination, RAW_DEST_PREFIX,
+                                   strlen(RAW_DEST_PREFIX));
+        if (raw && (ring_files > 0 || ring_ns > 0))
+        {
+            ch_log_fatal("Flight recorder mode is not supported on raw devices\n");
+        }
+        if (raw && defer_ts)
+        {
+            ch_log_fatal("Deferred timestamps are not supported on raw devices\n");
+        }
+        if (raw && out_format != OUT_FORMAT_EXPCAP)
+        {
+            ch_log_fatal("Plain pcap(ng) output is not supported on raw devices\n");
+        }
+        if (!raw && (max_file_size > 0 || rotate_ns > 0))
+        {
+            file_pool_t* pool = &file_pools[wport];
+            pool->destination   = wparams->destination;
+            pool->dummy_ostream = dummy_ostr;
+            pool->geom          = wparams->geom;
+            wparams->pool       = pool;
+        }
+
+        placement_t* place = &wplace[wport];
+        place->dev_node = numa_node_of_path (wparams->destination +
+                                             (raw ? strlen(RAW_DEST_PREFIX) : 0));
+
+        /* The rest of a group is served by the thread of its first output */
+        if (wport % per_writer)
+        {
+            place->cpu      = wplace[wport - 1].cpu;
+            place->cpu_node = wplace[wport - 1].cpu_node;
+            continue;
+        }
+        wparams->num_outputs = MIN(per_writer, options.dests->count - wport);
+
         pthread_t thread = { 0 };
 
         /* allow reuses of the writer CPUs*/
         if(CPU_COUNT(&writer_cpus) == 0){
             writer_cpus = writers;
         }
-        if (start_thread (&writer_cpus, &thread, writer_thread, (void*) wparams))
+        place->cpu      = get_next_cpu (&writer_cpus);
+        place->cpu_node = numa_node_of_cpu (place->cpu);
+
+        if (start_thread (place->cpu, &thread, writer_thread, (void*) wparams))
         {
             ch_log_error("Fatal: Could not start writer thread %li\n",
                          wthreads->count);
@@ -900,6 +1088,90 @@ static CH_VECTOR(pthread)* start_writer_threads(cpu_set_t writers)
 }
 
 
+/*
+ * Report where listeners, writers and their devices are, and warn about any
+ * listener/writer pair whose NIC, listener CPU (and bring), writer CPU or disk
+ * are on different NUMA nodes. Unknown nodes are ignored.
+ */
+static void check_numa_placement(void)
+{
+    for (int l = 0; options.verbose && l < options.interfaces->count; l++)
+    {
+        ch_log_info("Listener:%02i %-17s -- CPU %li (node %i) NIC node %i\n",
+                    l, options.interfaces->first[l], lplace[l].cpu,
+                    lplace[l].cpu_node, lplace[l].dev_node);
+    }
+    for (int w = 0; options.verbose && w < options.dests->count; w++)
+    {
+        ch_log_info("Writer:%02i   %-17s -- CPU %li (node %i) disk node %i\n",
+                    w, options.dests->first[w], wplace[w].cpu,
+                    wplace[w].cpu_node, wplace[w].dev_node);
+    }
+
+    for (int l = 0; l < options.interfaces->count; l++)
+    {
+        for (int w = 0; w < options.dests->count; w++)
+        {
+            const int nodes[4] = { lplace[l].dev_node, lplace[l].cpu_node,
+                                   wplace[w].cpu_node, wplace[w].dev_node };
+            int first = NUMA_NODE_UNKNOWN;
+            bool spans = false;
+            for (int i = 0; i < 4; i++)
+            {
+                if (nodes[i] == NUMA_NODE_UNKNOWN)
+                    continue;
+                if (first == NUMA_NODE_UNKNOWN)
+                    first = nodes[i];
+                spans |= nodes[i] != first;
+            }
+
+            if (spans)
+            {
+                ch_log_warn("Warning: %s -> %s spans NUMA nodes (NIC=%i listener=%i writer=%i disk=%i), performance may be affected\n",
+                            options.interfaces->first[l], options.dests->first[w],
+                            nodes[0], nodes[1], nodes[2], nodes[3]);
+            }
+        }
+    }
+}
+
+
+/*
+ * Wait for the listeners to finish creating and prefaulting their brings, and
+ * report how long it took. Returns -1 if any of them could not.
+ */
+static int wait_for_listeners(int64_t start_ns)
+{
+    int64_t slowest_ns = 0;
+    for (int tid = 0; tid < lthreads_count && !lstop; )
+    {
+        if (lparams_list[tid].failed)
+        {
+            ch_log_error("Listener on %s could not get ready\n",
+                         lparams_list[tid].interface);
+            return -1;
+        }
+
+        if (!lparams_list[tid].ready)
+        {
+            usleep(1000);
+            continue;
+        }
+
+        slowest_ns = MAX(slowest_ns, lparams_list[tid].warmup_ns);
+        tid++;
+    }
+
+    if (!lstop)
+    {
+        ch_log_info("Listeners ready after %.3fms (slowest warm up %.3fms)\n",
+                    (time_now_ns() - start_ns) / 1000.0 / 1000.0,
+                    slowest_ns / 1000.0 / 1000.0);
+    }
+    return 0;
+}
+
+
 static void remove_dups(CH_VECTOR(cstr)* opt_vec)
 {
     for(int i = 0; i < opt_vec->count; i++)
@@ -919,6 +1191,50 @@ static void remove_dups(CH_VECTOR(cstr)* opt_vec)
 
 
 
+/*
+ * Give each output several writer threads, by replacing it with that many
+ * outputs named <output>-w<n>. They share the output's disk, but each has its
+ * own rings and writes its own files. They are kept next to each other so
+ * that listeners can tell which writers belong to the same output.
+ */
+static void expand_dests(int64_t writers)
+{
+    if(writers <= 1)
+    {
+        return;
+    }
+
+    CH_VECTOR(cstr)* dests = CH_VECTOR_NEW(cstr, options.dests->count * writers,
+                                           NULL);
+    if(!dests)
+    {
+        ch_log_fatal("Could not allocate outputs vector\n");
+    }
+
+    for(int i = 0; i < options.dests->count; i++)
+    {
+        const char* dest = options.dests->first[i];
+        if(!strncmp(dest, RAW_DEST_PREFIX, strlen(RAW_DEST_PREFIX)))
+        {
+            ch_log_fatal("Raw devices only support one writer thread (%s)\n",
+                         dest);
+        }
+
+        for(int64_t w = 0; w < writers; w++)
+        {
+            char* name = NULL;
+            if(asprintf(&name, "%s-w%li", dest, w) < 0)
+            {
+                ch_log_fatal("Could not allocate output name\n");
+            }
+            dests->push_back(dests, name);
+        }
+    }
+
+    options.dests = dests;
+}
+
+
 /**
  * Main loop sets up threads and listens for stats / configuration messages.
  */
@@ -939,14 +1255,39 @@ int main (int argc, char** argv)
     ch_opt_addbi (CH_OPTION_FLAG,     'n', "no-promisc",        "Do not enable promiscuous mode on the interface",  &options.no_promisc, false);
     ch_opt_addbi (CH_OPTION_FLAG,     'k', "no-kernel",         "Do not allow packets to reach the kernel",         &options.no_kernel, false);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'm', "maxfile",           "Maximum file size (<=0 means no max)",             &options.max_file, -1);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'R', "rotate",            "Start new files every N secs of UTC time (0 means off)",  &options.rotate_secs, 0);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'G', "ring-size",         "Keep at most this many GB per output, reusing the oldest files (0 means off)",  &options.ring_gb, 0);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'M', "ring-time",         "Keep at most this many minutes per output, reusing the oldest files (0 means off)",  &options.ring_mins, 0);
     ch_opt_addsi (CH_OPTION_OPTIONAL, 'l', "logfile",           "Log file to log output to",                        &options.log_file, NULL);
     ch_opt_addfi (CH_OPTION_OPTIONAL, 't', "log-report-int",    "Log reporting interval (in secs)",                 &options.log_report_int_secs, 1);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'F', "flush-latency",     "Maximum time (in secs) to hold packets before flushing",       &options.flush_latency_secs, 1);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'P', "flush-padding",     "Target maximum fraction of padding per flush [0-1]",           &options.flush_padding, 0.05);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'C', "coalesce",          "Coalesce slots with less than this many KB of packets (0 means off)",  &options.coalesce_kb, 0);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'W', "stripe",            "Gather writes into whole stripes of this many KB (0 means detect)",   &options.stripe_kb, 0);
+    ch_opt_addbi (CH_OPTION_FLAG,     'b', "buffered",          "Write through the page cache, pacing writeback, instead of O_DIRECT", &options.buffered, false);
+    ch_opt_addbi (CH_OPTION_FLAG,     'Z', "defer-timestamps",  "Leave NIC timestamps unconverted, writing clock samples for exact-pcap-retime", &options.defer_timestamps, false);
+    ch_opt_addbi (CH_OPTION_FLAG,     'I', "raw-init",          "Start a new catalog on raw devices that have none, writing over what is on them", &options.raw_init, false);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'O', "merge",             "Merge each writer's packets into time order, waiting up to this many secs for quiet interfaces (0 means off)", &options.merge_secs, 0);
+    ch_opt_addsi (CH_OPTION_OPTIONAL, 'H', "ts-trailer",        "Take packet times from switch timestamp trailers, unless missing or over 1s from the NIC time. Valid values are [hpt]", &options.ts_trailer, NULL);
+    ch_opt_addsi (CH_OPTION_OPTIONAL, 'f', "format",            "Output file format. Valid values are [expcap, pcap, pcapng]", &options.format, "expcap");
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'e', "sample-every",      "Keep one in every this many packets on each interface (0 or 1 means all)", &options.sample_every, 0);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'E', "sample-interval",   "Keep at most one packet on each interface every this many secs (0 means off)", &options.sample_interval_secs, 0);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'Q', "flow-budget",       "Keep at most this many packets per flow per second on each interface (0 means off)", &options.flow_budget, 0);
+    ch_opt_addbi (CH_OPTION_FLAG,     'K', "payload-hash",      "Put a hash of every byte of each frame after the bytes captured (use with --snaplen to capture headers only)", &options.payload_hash, false);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'N', "output-writers",    "Writer threads per output, each writing its own files",        &options.output_writers, 1);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'D', "outputs-per-writer","Outputs each writer thread serves, with asynchronous writes if more than 1", &options.outputs_per_writer, 1);
+    ch_opt_addii (CH_OPTION_OPTIONAL, 'B', "burst-buffer",      "Size of each writer's DRAM burst buffer in MB (0 means off)",          &options.burst_mb, 0);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'x', "trigger-pre",       "Trigger mode, keep this many secs in the burst buffer until a trigger (0 means off)",  &options.trigger_pre_secs, 0);
+    ch_opt_addfi (CH_OPTION_OPTIONAL, 'y', "trigger-post",      "Secs to keep writing for after a trigger",                     &options.trigger_post_secs, 10);
+    ch_opt_addsi (CH_OPTION_OPTIONAL, 'X', "trigger-match",     "Trigger on packets with these bytes, as offset:hexbytes",      &options.trigger_match, NULL);
+    ch_opt_addsi (CH_OPTION_OPTIONAL, 'Y', "trigger-socket",    "Trigger on any message to this unix datagram socket",          &options.trigger_socket, NULL);
     ch_opt_addbi (CH_OPTION_FLAG,     'v', "verbose",           "Verbose output",                                   &options.verbose, false);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'V', "more-verbose-lvl",  "More verbose output level [1-2]",                  &options.more_verbose_lvl, 0);
     ch_opt_addbi (CH_OPTION_FLAG,     'T', "no-log-ts",         "Do not use timestamps on logs",                    &options.no_log_ts, false);
     ch_opt_addbi (CH_OPTION_FLAG,     'd', "debug-logging",     "Turn on debug logging output",                     &options.debug_log, false);
     ch_opt_addbi (CH_OPTION_FLAG,     'w', "no-warn-overflow",  "No warning on overflows",                          &options.no_overflow_warn, false);
     ch_opt_addbi (CH_OPTION_FLAG,     'S', "no-spin",           "No spinner on the output",                         &options.no_spinner, false);
+    ch_opt_addbi (CH_OPTION_FLAG,     'L', "mlockall",          "Lock all process memory into RAM",                 &options.mlockall, false);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'p', "perf-test",         "Performance test mode [0-7]",                      &options.calib_mode, 0);
 
     ch_opt_parse (argc, argv);
@@ -1003,11 +1344,217 @@ int main (int argc, char** argv)
     remove_dups(options.interfaces);
     remove_dups(options.dests);
 
+    if(options.output_writers < 1)
+    {
+        ch_log_fatal("There must be at least 1 writer thread per output\n");
+    }
+    expand_dests(options.output_writers);
+
+    if(options.outputs_per_writer < 1)
+    {
+        ch_log_fatal("Each writer thread must serve at least 1 output\n");
+    }
+
 
     max_file_size = options.max_file;
+    if(options.rotate_secs < 0)
+    {
+        ch_log_fatal("Rotation period must be 0 or more seconds\n");
+    }
+    rotate_ns = options.rotate_secs * 1000 * 1000 * 1000;
+
+    /* Writes are gathered into whole stripes of the output device, which
+     * makes each file's header and last write a little bigger */
+    stripe_bytes = options.stripe_kb * 1024;
+    if(stripe_bytes < 0 || stripe_bytes % DISK_BLOCK || stripe_bytes > MAX_STRIPE)
+    {
+        ch_log_fatal("Stripe size must be a multiple of %iKB up to %iKB\n",
+                     DISK_BLOCK / 1024, MAX_STRIPE / 1024);
+    }
+    buffered_io = options.buffered;
+    if(options.dests->count > MAX_OTHREADS)
+    {
+        ch_log_fatal("No more than %i outputs are supported\n", MAX_OTHREADS);
+    }
+    int64_t file_bytes = 0;
+    for(int w = 0; w < options.dests->count; w++)
+    {
+        dest_geometry(options.dests->first[w], &wparams_list[w].geom);
+        file_bytes = MAX(file_bytes, file_prealloc_size(&wparams_list[w].geom));
+    }
+
+    /* Flight recorder mode recycles whole files, so needs them to rotate */
+    if(options.ring_gb < 0 || options.ring_mins < 0)
+    {
+        ch_log_fatal("Ring size and time must be 0 or more\n");
+    }
+    if(options.ring_gb > 0)
+    {
+        if(max_file_size <= 0)
+        {
+            ch_log_fatal("A ring size needs a maximum file size (--maxfile)\n");
+        }
+        ring_files = (int64_t)(options.ring_gb * 1024 * 1024 * 1024) /
+                     file_bytes;
+        if(ring_files < FILE_POOL_DEPTH + 2)
+        {
+            ch_log_fatal("Ring size must hold at least %i files of %liB\n",
+                         FILE_POOL_DEPTH + 2, file_bytes);
+        }
+    }
+    if(options.ring_mins > 0)
+    {
+        if(rotate_ns <= 0)
+        {
+            ch_log_fatal("A ring time needs a rotation period (--rotate)\n");
+        }
+        ring_ns = options.ring_mins * 60 * 1000 * 1000 * 1000;
+    }
+    if(options.flush_latency_secs <= 0)
+    {
+        ch_log_fatal("Flush latency must be greater than 0\n");
+    }
+    if(options.flush_padding <= 0 || options.flush_padding > 1)
+    {
+        ch_log_fatal("Flush padding must be in the range (0,1]\n");
+    }
+    flush_max_latency_ns = (int64_t)(options.flush_latency_secs * 1000 * 1000 * 1000);
+    flush_max_padding = options.flush_padding;
+    coalesce_bytes = options.coalesce_kb * 1024;
+    burst_bytes = options.burst_mb * 1024 * 1024;
+    if(burst_bytes < 0 || (burst_bytes > 0 && burst_bytes < BRING_SLOT_SIZE))
+    {
+        ch_log_fatal("Burst buffer size must be 0 or at least %iMB\n",
+                     BRING_SLOT_SIZE / 1024 / 1024);
+    }
+
+    /* In trigger mode the burst buffer holds the pre-trigger history */
+    trigger_pre_ns = (int64_t)(options.trigger_pre_secs * 1000 * 1000 * 1000);
+    trigger_post_ns = (int64_t)(options.trigger_post_secs * 1000 * 1000 * 1000);
+    if(trigger_pre_ns < 0 || trigger_post_ns < 0)
+    {
+        ch_log_fatal("Trigger times must be 0 or more seconds\n");
+    }
+    if(trigger_pre_ns > 0 && burst_bytes == 0)
+    {
+        ch_log_fatal("Trigger mode needs a burst buffer (--burst-buffer)\n");
+    }
+    if(trigger_pre_ns == 0 && (options.trigger_match || options.trigger_socket))
+    {
+        ch_log_fatal("Trigger sources need trigger mode (--trigger-pre)\n");
+    }
+    if(options.trigger_match && trigger_match_parse(options.trigger_match))
+    {
+        ch_log_fatal("Could not parse trigger match\n");
+    }
+    if(trigger_pre_ns > 0)
+    {
+        signal (SIGUSR1, trigger_signal_handler);
+    }
+
+    if(coalesce_bytes < 0 || coalesce_bytes > BRING_SLOT_SIZE / 2)
+    {
+        ch_log_fatal("Coalesce size must be in the range [0,%li]KB\n",
+                     (int64_t)BRING_SLOT_SIZE / 2 / 1024);
+    }
+
+    /* Writers do not look at packets at all when timestamps are deferred */
+    defer_ts = options.defer_timestamps;
+    raw_init = options.raw_init;
+    if(defer_ts && (coalesce_bytes > 0 || options.trigger_match))
+    {
+        ch_log_fatal("Deferred timestamps cannot be used with --coalesce or "
+                     "--trigger-match\n");
+    }
+
+    /* Merging needs converted timestamps, and already makes full writes */
+    merge_ns = (int64_t)(options.merge_secs * 1000 * 1000 * 1000);
+    if(merge_ns < 0)
+    {
+        ch_log_fatal("Merge window must be 0 or more seconds\n");
+    }
+    if(merge_ns > 0 && (defer_ts || coalesce_bytes > 0))
+    {
+        ch_log_fatal("--merge cannot be used with --defer-timestamps or "
+                     "--coalesce\n");
+    }
+    if(merge_ns > 0 && merge_ns < flush_max_latency_ns)
+    {
+        ch_log_warn("Merge window is shorter than the flush latency, packets "
+                    "from quiet interfaces may be written out of order\n");
+    }
+
+    /* Trailers are read while converting timestamps */
+    ts_trailer = TS_TRAILER_NONE;
+    if(options.ts_trailer)
+    {
+        if(strcmp(options.ts_trailer, "hpt") == 0)
+        {
+            ts_trailer = TS_TRAILER_HPT;
+        }
+        else
+        {
+            ch_log_fatal("Unknown timestamp trailer \"%s\". Valid values are [hpt]\n",
+                         options.ts_trailer);
+        }
+    }
+    if(ts_trailer != TS_TRAILER_NONE && defer_ts)
+    {
+        ch_log_fatal("--ts-trailer cannot be used with --defer-timestamps\n");
+    }
+
+    /* Plain pcap(ng) has nowhere to keep raw timestamps until they are
+     * converted */
+    out_format = OUT_FORMAT_EXPCAP;
+    if (strcmp (options.format, "pcap") == 0)
+    {
+        out_format = OUT_FORMAT_PCAP;
+    }
+    else if (strcmp (options.format, "pcapng") == 0)
+    {
+        out_format = OUT_FORMAT_PCAPNG;
+    }
+    else if (strcmp (options.format, "expcap") != 0)
+    {
+        ch_log_fatal("Unknown output format \"%s\". Valid values are [expcap, pcap, pcapng]\n",
+                     options.format);
+    }
+    if (out_format != OUT_FORMAT_EXPCAP && defer_ts)
+    {
+        ch_log_fatal("--format %s cannot be used with --defer-timestamps\n",
+                     options.format);
+    }
+
+    /* Listeners sample packets before copying them, and say how many they left
+     * out in the block headers */
+    sample_every = options.sample_every;
+    sample_interval_ns = (int64_t)(options.sample_interval_secs * 1000 * 1000 * 1000);
+    flow_budget = options.flow_budget;
+    if (sample_every < 0 || sample_interval_ns < 0 || flow_budget < 0)
+    {
+        ch_log_fatal("--sample-every, --sample-interval and --flow-budget must "
+                     "be 0 or more\n");
+    }
+    if ((sample_every > 1 || sample_interval_ns > 0 || flow_budget > 0) &&
+        out_format != OUT_FORMAT_EXPCAP)
+    {
+        ch_log_warn("--format %s has no block headers, so will not say how many "
+                    "packets sampling left out\n", options.format);
+    }
+
+    /* Listeners hash frames as they copy them, so that a short snap length
+     * still leaves something to tell them apart by */
+    payload_hash = options.payload_hash;
+    if (payload_hash && out_format != OUT_FORMAT_EXPCAP)
+    {
+        ch_log_fatal("--format %s has no footers to put payload hashes in, use "
+                     "expcap with --payload-hash\n", options.format);
+    }
+
     max_pkt_len = options.snaplen;
     min_pcap_rec = MIN(sizeof(pcap_pkthdr_t) + sizeof(expcap_pktftr_t),MIN_ETH_PKT);
-    max_pcap_rec = min_pcap_rec + max_pkt_len;
+    max_pcap_rec = min_pcap_rec + max_pkt_len +
+                   (payload_hash ? EXPCAP_HASH_LEN : 0);
 
     cpus_t cpus = {{{0}}};
     parse_cpus(options.cpus_str, &cpus);
@@ -1032,17 +1579,59 @@ int main (int argc, char** argv)
     }
 
 
+    /* Lock what is mapped now, and lock later mappings as they are faulted in.
+     * Locking later mappings eagerly (without MCL_ONFAULT) would fault in the
+     * brings before they can be bound to a NUMA node */
+    if (options.mlockall &&
+        (mlockall(MCL_CURRENT) || mlockall(MCL_FUTURE | MCL_ONFAULT)))
+    {
+        ch_log_warn("Warning: Could not lock process memory: %s\n",
+                    strerror(errno));
+    }
+
+    /* Flush timeouts and other fast path timing use the TSC where possible */
+    if (!eio_clock_init() && options.verbose)
+    {
+        ch_log_info("Invariant TSC not available, timing with clock_gettime()\n");
+    }
+
+    const int64_t threads_start_ns = time_now_ns();
     CH_VECTOR(pthread)* lthreads = start_listener_threads(cpus.listeners);
     lthreads_count = lthreads->count;
 
     CH_VECTOR(pthread)* wthreads = start_writer_threads(cpus.writers);
 
+    check_numa_placement();
+    if (wait_for_listeners(threads_start_ns))
+    {
+        ch_log_fatal("Could not start listener threads\n");
+    }
+
     /* Set the management thread CPU core */
     if (sched_setaffinity (0, sizeof(cpu_set_t), &cpus.management))
     {
         ch_log_fatal("Could not set management CPU affinity\n");
     }
 
+    if (options.trigger_socket && trigger_socket_start(options.trigger_socket))
+    {
+        ch_log_fatal("Could not start trigger socket\n");
+    }
+
+    /* Runs on the management CPU, inherited from this thread */
+    pthread_t fthread = { 0 };
+    fileprep_params_t fparams = { 0 };
+    if (max_file_size > 0 || rotate_ns > 0)
+    {
+        fparams.pools = file_pools;
+        fparams.count = options.dests->count;
+        fparams.stop  = &fstop;
+        if (pthread_create (&fthread, NULL, fileprep_thread, &fparams))
+        {
+            ch_log_fatal("Could not start file preparation thread\n");
+        }
+    }
+
     /*************************************************************************/
     /* Main thread - Real work begins here!                                  */
     /*************************************************************************/
@@ -1108,8 +1697,14 @@ int main (int argc, char** argv)
 
         /* Grab the begining of the next time sample once everything is done */
         sample_start_ns = time_now_ns();
-        usleep(sleep_time_ns/1000);
-        now_ns = time_now_ns();
+
+        /* Keep the fast path clock on the wall clock while waiting */
+        const int64_t wake_ns = sample_start_ns + sleep_time_ns;
+        for (now_ns = sample_start_ns; now_ns < wake_ns; now_ns = time_now_ns())
+        {
+            usleep(MIN(wake_ns - now_ns, EIO_CLOCK_SYNC_NS) / 1000);
+            eio_clock_sync();
+        }
         delta_ns = now_ns - sample_start_ns;
 
         /* Collect data as close together as possible before starting processing */
@@ -1120,7 +1715,7 @@ int main (int argc, char** argv)
                                   &pstats_now[tid]);
             lstats_now[tid] = lstats_all[tid];
         }
-        for (int tid = 0; tid < wthreads->count; tid++)
+        for (int tid = 0; tid < options.dests->count; tid++)
         {
             wstats_now[tid] = wstats[tid];
         }
@@ -1162,7 +1757,7 @@ int main (int argc, char** argv)
         /* Process the writer thread stats */
         wdelta_total = wempty;
         for (int tid = 0;
-                (options.more_verbose_lvl || options.verbose) && tid < wthreads->count;
+                (options.more_verbose_lvl || options.verbose) && tid < options.dests->count;
                 wstats_prev[tid] = wstats_now[tid], tid++)
         {
             wstats_t wstats_delta = wstats_subtract(&wstats_now[tid], &wstats_prev[tid]);
@@ -1212,6 +1807,14 @@ int main (int argc, char** argv)
     }
     ch_log_debug1("All writer threads dead.\n");
 
+    trigger_socket_stop();
+
+    if (max_file_size > 0 || rotate_ns > 0)
+    {
+        fstop = true;
+        pthread_join (fthread, NULL);
+    }
+
 
     now_ns = time_now_ns();
     delta_ns = now_ns - start_ns;
@@ -1244,7 +1847,7 @@ int main (int argc, char** argv)
 
     /* Process the writer thread stats */
     wdelta_total = wempty;
-    for (int tid = 0; tid < wthreads->count; tid++)
+    for (int tid = 0; tid < options.dests->count; tid++)
     {
         wstats_t wstats_delta = wstats[tid];
         wdelta_total = wstats_add(&wdelta_total, &wstats_delta);
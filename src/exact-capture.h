@@ -33,12 +33,47 @@
 #define BRING_NAME_LEN (512)
 /*Must be a multiple of disk block size. 512 * 4096 = 2MB */
 #define BRING_SLOT_SIZE (512 * DISK_BLOCK)
-#define BRING_SLOT_COUNT (128)
+/*
+ * BRINGs only carry data from listeners to writers, so they are created
+ * unidirectional. This buys twice the slots for the memory a bidirectional
+ * ring of 128 slots would need. 256 * 2MB = 512MB per listener/writer pair.
+ */
+#define BRING_SLOT_COUNT (256)
+
+/*
+ * Writers with a burst buffer divert slots into it once this many slots are
+ * waiting in a ring, and only drain it to disk while rings are below the low
+ * water mark (or idle).
+ */
+#define BURST_HIGH_WATER (BRING_SLOT_COUNT / 4)
+#define BURST_LOW_WATER  (BRING_SLOT_COUNT / 16)
 
 /*Maximum number of input and output threads/cores*/
 #define MAX_OTHREADS   (64)
 #define MAX_ITHREADS   (64)
 
+/*
+ * Listeners never flush a partially filled slot sooner than this, even when the
+ * adaptive flush policy would allow it. This keeps the number of slots (and
+ * disk writes) per second bounded at moderate packet rates.
+ */
+#define FLUSH_MIN_NS (100 * 1000 * 1000) /* 100ms */
+
+/* Formats that writers can write output files in */
+typedef enum
+{
+    OUT_FORMAT_EXPCAP = 0, /* Pcap with expcap footers and padding records */
+    OUT_FORMAT_PCAP,       /* Plain nanosecond pcap, footers in a sidecar */
+    OUT_FORMAT_PCAPNG,     /* Pcapng, an interface per port, picosecond times */
+} out_format_t;
+
+/* Switch timestamp trailers that writers can take packet times from */
+typedef enum
+{
+    TS_TRAILER_NONE = 0,
+    TS_TRAILER_HPT,     /* Fusion high precision timestamp trailer */
+} ts_trailer_t;
+
 typedef struct
 {
     int64_t swofl;
@@ -49,6 +84,9 @@ typedef struct
     int64_t spinsP_rx;
     int64_t bytes_rx;
     int64_t packets_rx;
+    int64_t pbytes;  /* padding bytes added when flushing */
+    int64_t skipped; /* packets left out by sampling */
+    int64_t sbytes;  /* wire length bytes left out by sampling */
 
 } lstats_t  __attribute__( ( aligned ( 8 ) ) );
 
@@ -61,6 +99,8 @@ typedef struct
     int64_t dbytes;  /* to disk bytes */
     int64_t packets;
     int64_t spins;
+    int64_t writes;  /* disk write operations */
+    int64_t bbytes;  /* bytes diverted through the burst buffer */
 
 } wstats_t  __attribute__( ( aligned ( 8 ) ) );
 
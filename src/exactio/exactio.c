@@ -15,6 +15,7 @@
 #include "exactio_dummy.h"
 #include "exactio_exanic.h"
 #include "exactio_bring.h"
+#include "exactio_raw.h"
 
 int eio_new(eio_args_t* args, eio_stream_t** result)
 {
@@ -24,6 +25,7 @@ int eio_new(eio_args_t* args, eio_stream_t** result)
         case EIO_DUMMY: return NEW_IOSTREAM(dummy,result,&args->args.dummy);
         case EIO_EXA:  return NEW_IOSTREAM(exa,result,&args->args.exa);
         case EIO_BRING:return NEW_IOSTREAM(bring,result,&args->args.bring);
+        case EIO_RAW:  return NEW_IOSTREAM(raw,result,&args->args.raw);
     }
 
     return -1;
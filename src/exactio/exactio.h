@@ -19,6 +19,7 @@
 #include "exactio_stream.h"
 #include "exactio_dummy.h"
 #include "exactio_exanic.h"
+#include "exactio_raw.h"
 
 #include "../data_structs/timespecps.h"
 
@@ -27,6 +28,7 @@ typedef enum {
     EIO_FILE,
     EIO_EXA,
     EIO_BRING,
+    EIO_RAW,
 } exactio_stream_type_t;
 
 
@@ -37,6 +39,7 @@ typedef struct {
         dummy_args_t dummy;
         file_args_t file;
         bring_args_t bring;
+        raw_args_t raw;
     } args;
 } eio_args_t;
 
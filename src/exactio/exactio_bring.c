@@ -23,6 +23,9 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
 
 
 #include <chaste/chaste.h>
@@ -30,6 +33,7 @@
 
 #include "exactio_bring.h"
 #include "exactio_timing.h"
+#include "../numa.h"
 
 
 
@@ -54,8 +58,17 @@ typedef struct slot_header_s{
 #define BRING_MAGIC_SERVER 0xC5f7C37C69627EFLL //Any value here is good as long as it's not zero
 #define BRING_MAGIC_CLIENT ~(BRING_MAGIC_SERVER) //Any value here is good as long as it's not zero and not the same as above
 
+//Handshake states. These live in a 32bit word so that both sides can sleep on
+//it with a futex rather than polling
+#define BRING_HS_NONE   0
+#define BRING_HS_SERVER 1
+#define BRING_HS_CLIENT 2
+
+#define BRING_HS_POLL_NS (100 * 1000 * 1000)
+
 typedef struct bring_header {
     volatile int64_t magic;                  //Is this memory ready yet?
+    volatile int32_t handshake;              //Which side has connected
     int64_t total_mem;              //Total amount of memory needed in the mmapped region
 
 
@@ -87,12 +100,26 @@ typedef struct bring_priv {
     int64_t slot_count;
 
     bool expand;
+    bool unidirectional;
+    bool defer_connect;
+    int64_t numa_node;
 
     volatile bring_header_t* bring_head;
+    //Local copies of the ring geometry from the header, swapped over for the
+    //client so that these always describe this end's read and write rings
+    int64_t rd_slots;
+    int64_t rd_slots_size;
+    int64_t rd_slot_usr_size;
+    int64_t wr_slots;
+    int64_t wr_slots_size;
+    int64_t wr_slot_usr_size;
+
     //Read side variables
     char* rd_mem;          //Underlying memory to support shared mem transport
     int64_t rd_sync_counter;        //Synchronization counter to protect against loop around
     int64_t rd_index;               //Current index receiving data
+    int64_t rd_kept;                //Slots read but not yet given back, see bring_rd_keep()
+    int64_t rd_kept_index;          //Oldest of them
 
     //Write side variables
     char* wr_mem;          //Underlying memory for the shared memory transport
@@ -110,6 +137,28 @@ typedef struct bring_priv {
 
 } bring_priv_t;
 
+//Sleep until *word is no longer val, someone wakes us, or the timeout expires.
+//If the futex can't be used at all, just sleep for the timeout so that callers
+//polling *word don't spin.
+static inline void bring_futex_wait(volatile int32_t* word, int32_t val, int64_t timeout_ns)
+{
+    struct timespec timeout = {
+        .tv_sec  = timeout_ns / (1000 * 1000 * 1000),
+        .tv_nsec = timeout_ns % (1000 * 1000 * 1000)
+    };
+    if(syscall(SYS_futex, word, FUTEX_WAIT, val, &timeout, NULL, 0) &&
+       errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT){
+        ch_log_debug1("Futex wait failed, sleeping instead. Error=%s\n", strerror(errno));
+        nanosleep(&timeout, NULL);
+    }
+}
+
+static inline void bring_futex_wake(volatile int32_t* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+
 static void bring_destroy(eio_stream_t* this)
 {
 
@@ -155,12 +204,17 @@ static inline eio_error_t bring_read_acquire(eio_stream_t* this, char** buffer,
         return EIO_ERELEASE;
     }
 
-    //ch_log_debug3("Doing read acquire, looking at index=%li/%li\n", priv->rd_index, priv->bring_head->rd_slots );
+    //There is nothing to read on the server side of a unidirectional bring
+    ifunlikely(!priv->rd_head){
+        return EIO_EINVALID;
+    }
+
+    //ch_log_debug3("Doing read acquire, looking at index=%li/%li\n", priv->rd_index, priv->rd_slots );
     const bring_slot_header_t* curr_slot_head = priv->rd_head;
 
-    ifassert( (volatile int64_t)(curr_slot_head->data_size) > priv->bring_head->rd_slot_usr_size){
+    ifassert( (volatile int64_t)(curr_slot_head->data_size) > priv->rd_slot_usr_size){
         ch_log_fatal("Data size (%li)(0x%016X) is larger than memory size (%li), corruption has happened!\n",
-                     curr_slot_head->data_size,curr_slot_head->data_size, priv->bring_head->rd_slot_usr_size);
+                     curr_slot_head->data_size,curr_slot_head->data_size, priv->rd_slot_usr_size);
         return EIO_ETOOBIG;
     }
 
@@ -183,7 +237,7 @@ static inline eio_error_t bring_read_acquire(eio_stream_t* this, char** buffer,
     (void)ts;
     //eio_nowns(ts);
 
-    ch_log_debug2("Got a valid slot seq=%li (%li/%li)\n", curr_slot_head->seq_no, priv->rd_index, priv->bring_head->rd_slots);
+    ch_log_debug2("Got a valid slot seq=%li (%li/%li)\n", curr_slot_head->seq_no, priv->rd_index, priv->rd_slots);
     *buffer = (char*)(curr_slot_head + 1);
     *len    = curr_slot_head->data_size;
 
@@ -199,20 +253,25 @@ static inline eio_error_t bring_read_release(eio_stream_t* this,  int64_t* ts)
         return EIO_EACQUIRE;
     }
 
+    ifassert(priv->rd_kept){
+        ch_log_fatal( "Error, free kept slots before releasing\n");
+        return EIO_ERELEASE;
+    }
+
     const bring_slot_header_t * curr_slot_head = priv->rd_head;
 
     //Apply an atomic update to tell the write end that we received this data
     //Do a word aligned single word write (atomic)
     (*(volatile uint64_t*)&curr_slot_head->seq_no) = 0x0ULL;
 
-    //ch_log_debug3("Done doing read release, at %p index=%li/%li, curreslot seq=%li\n", curr_slot_head, priv->rd_index, priv->bring_head->rd_slots, curr_slot_head->seq_no);
+    //ch_log_debug3("Done doing read release, at %p index=%li/%li, curreslot seq=%li\n", curr_slot_head, priv->rd_index, priv->rd_slots, curr_slot_head->seq_no);
 
     priv->reading = false;
 
     //We're done. Increment the buffer index and wrap around if necessary -- this is faster than using a modulus (%)
     priv->rd_index++;
-    priv->rd_index = priv->rd_index < priv->bring_head->rd_slots ? priv->rd_index : 0;
-    priv->rd_head = (bring_slot_header_t*)(priv->rd_mem + (priv->bring_head->rd_slots_size * priv->rd_index));
+    priv->rd_index = priv->rd_index < priv->rd_slots ? priv->rd_index : 0;
+    priv->rd_head = (bring_slot_header_t*)(priv->rd_mem + (priv->rd_slots_size * priv->rd_index));
     priv->rd_sync_counter++; //Assume this will never overflow. ~200 years for 1 nsec per op
 
     //Grab time stamp for this operation
@@ -242,8 +301,13 @@ static inline eio_error_t bring_write_acquire(eio_stream_t* this, char** buffer,
         return EIO_ERELEASE;
     }
 
+    //There is nothing to write on the client side of a unidirectional bring
+    ifunlikely(!priv->wr_head){
+        return EIO_EINVALID;
+    }
+
     //Is there a new slot ready for writing?
-    ch_log_debug3("Doing write acquire, looking at index=%li/%li %p %li\n", priv->wr_index, priv->bring_head->wr_slots, priv->wr_head, (char*)priv->wr_head - (char*)priv->bring_head );
+    ch_log_debug3("Doing write acquire, looking at index=%li/%li %p %li\n", priv->wr_index, priv->wr_slots, priv->wr_head, (char*)priv->wr_head - (char*)priv->bring_head );
     const bring_slot_header_t * curr_slot_head = priv->wr_head;
 
     //ch_log_debug3("Doing write acquire, looking at %p index=%li, curreslot seq=%li\n",  hdr_mem, priv->wr_index,  curr_slot_head.seq_no);
@@ -252,7 +316,7 @@ static inline eio_error_t bring_write_acquire(eio_stream_t* this, char** buffer,
         return EIO_ETRYAGAIN;
     }
 
-    ifassert(*len > priv->bring_head->wr_slot_usr_size){
+    ifassert(*len > priv->wr_slot_usr_size){
         return EIO_ETOOBIG;
     }
 
@@ -260,10 +324,10 @@ static inline eio_error_t bring_write_acquire(eio_stream_t* this, char** buffer,
     (void)ts;
     //eio_nowns(ts);
     *buffer = (char*)(curr_slot_head + 1);
-    *len    = priv->bring_head->wr_slot_usr_size;
+    *len    = priv->wr_slot_usr_size;
     priv->writing = true;
 
-    ch_log_debug3(" Write acquire success - new buffer of size %li at %p (index=%li/%li)\n",   *len, *buffer, priv->wr_index, priv->bring_head->wr_slots);
+    ch_log_debug3(" Write acquire success - new buffer of size %li at %p (index=%li/%li)\n",   *len, *buffer, priv->wr_index, priv->wr_slots);
     return EIO_ENONE;
 }
 
@@ -281,8 +345,8 @@ static inline eio_error_t bring_write_release(eio_stream_t* this, int64_t len,
         return EIO_EACQUIRE;
     }
 
-    ifassert(len > priv->bring_head->wr_slot_usr_size){
-        ch_log_fatal("Error: length supplied (%li) is larger than length of buffer (%li). Corruption likely. Aborting\n",  len, priv->bring_head->wr_slot_usr_size );
+    ifassert(len > priv->wr_slot_usr_size){
+        ch_log_fatal("Error: length supplied (%li) is larger than length of buffer (%li). Corruption likely. Aborting\n",  len, priv->wr_slot_usr_size );
         exit(-1);
     }
 
@@ -306,12 +370,12 @@ static inline eio_error_t bring_write_release(eio_stream_t* this, int64_t len,
     __sync_synchronize();
 
 
-    ch_log_debug2("Done doing write release, at %p index=%li/%li, curreslot seq=%li (%li)\n", curr_slot_head, priv->wr_index, priv->bring_head->wr_slots, curr_slot_head->seq_no, priv->wr_sync_counter);
+    ch_log_debug2("Done doing write release, at %p index=%li/%li, curreslot seq=%li (%li)\n", curr_slot_head, priv->wr_index, priv->wr_slots, curr_slot_head->seq_no, priv->wr_sync_counter);
 
     //Increment and wrap around if necessary, this is faster than a modulus
     priv->wr_index++;
-    priv->wr_index = priv->wr_index < priv->bring_head->wr_slots ? priv->wr_index : 0;
-    priv->wr_head = (bring_slot_header_t*)(priv->wr_mem + (priv->bring_head->wr_slots_size * priv->wr_index));
+    priv->wr_index = priv->wr_index < priv->wr_slots ? priv->wr_index : 0;
+    priv->wr_head = (bring_slot_header_t*)(priv->wr_mem + (priv->wr_slots_size * priv->wr_index));
     priv->writing = false;
 
     (void)ts;
@@ -363,8 +427,10 @@ static inline eio_error_t eio_bring_server_connect(eio_stream_t* this)
     const int64_t slot_aligned_size = round_up(mem_per_slot, getpagesize());
     //Figure out the total memory commitment for slots
     const int64_t mem_per_ring      = slot_aligned_size * priv->slot_count;
-    //Allocate for both server-->client and client-->server connections
-    const int64_t total_ring_mem    = mem_per_ring * 2;
+    //Allocate for both server-->client and client-->server connections, unless
+    //only the server-->client direction is needed
+    const int64_t rd_ring_mem       = priv->unidirectional ? 0 : mem_per_ring;
+    const int64_t total_ring_mem    = rd_ring_mem + mem_per_ring;
     //Include the memory required for the headers -- Make sure there's a place for the synchronization pointer
     const int64_t header_mem        = round_up(sizeof(bring_header_t),getpagesize());
     //All memory required
@@ -380,11 +446,12 @@ static inline eio_error_t eio_bring_server_connect(eio_stream_t* this)
     ch_log_debug1("total_mem_req  %li\n",   total_mem_req);
     ch_log_debug1("-------------------------\n");
 
-    //Resize the file
-    if(ftruncate(bring_fd,sizeof(bring_header_t))){
+    //Resize the file to its full size now so that the server can fault in the
+    //ring memory before the client arrives
+    if(ftruncate(bring_fd,total_mem_req)){
         ch_log_error( "Could not resize shared region \"%s\" to size=%li. Error=%s\n",
                 priv->name,
-                sizeof(bring_header_t),
+                total_mem_req,
                 strerror(errno)
         );
         result = EIO_EINVALID;
@@ -407,13 +474,31 @@ static inline eio_error_t eio_bring_server_connect(eio_stream_t* this)
         goto  close_file_error;
     }
 
+    //Nothing has touched the memory yet. Bind it now, otherwise the pages end
+    //up on whichever node the client happens to be on when it mlocks them.
+    if(priv->numa_node != NUMA_NODE_UNKNOWN){
+        numa_bind_mem(mem, total_mem_req, priv->numa_node);
+    }
+
+    //Fault in and pin every page now, rather than in the listener's hot loop
+    //the first time it goes around the ring. If we're not allowed to lock this
+    //much memory, at least touch every page.
+    if(mlock(mem,total_mem_req)){
+        ch_log_warn("Could not lock bring memory for \"%s\", prefaulting only. Error=%s\n",
+                    priv->name, strerror(errno));
+        for(int64_t off = 0; off < total_mem_req; off += getpagesize()){
+            volatile char* page = (volatile char*)mem + off;
+            *page = *page;
+        }
+    }
+
 
     //Populate all the right offsets
     volatile bring_header_t* bring_head = (volatile void*)mem;;
     priv->bring_head                    = bring_head;
     bring_head->total_mem               = total_mem_req;
     bring_head->rd_mem_start_offset     = header_mem;
-    bring_head->rd_mem_len              = priv->expand ? round_up(mem_per_ring,getpagesize()) : mem_per_ring;
+    bring_head->rd_mem_len              = priv->expand ? round_up(rd_ring_mem,getpagesize()) : rd_ring_mem;
     bring_head->rd_slots_size           = slot_aligned_size;
     bring_head->rd_slot_usr_size        = priv->slot_size;
     bring_head->rd_slots                = bring_head->rd_mem_len / bring_head->rd_slots_size;
@@ -451,9 +536,9 @@ static inline eio_error_t eio_bring_server_connect(eio_stream_t* this)
 
     ch_log_debug1("Done creating bring called %s with %lu slots of size %lu, usable size %lu\n",
             priv->name,
-            priv->bring_head->rd_slots,
-            priv->bring_head->rd_slots_size,
-            priv->bring_head->rd_slots_size - sizeof(bring_slot_header_t)
+            priv->bring_head->wr_slots,
+            priv->bring_head->wr_slots_size,
+            priv->bring_head->wr_slots_size - sizeof(bring_slot_header_t)
     );
 
     priv->fd = bring_fd;
@@ -464,42 +549,125 @@ static inline eio_error_t eio_bring_server_connect(eio_stream_t* this)
     //2 - Do a word aligned single word write (atomic)
     priv->bring_head->magic = BRING_MAGIC_SERVER;
     __sync_synchronize();
+    //3 - Wake up any client that got here first
+    priv->bring_head->handshake = BRING_HS_SERVER;
+    __sync_synchronize();
+    bring_futex_wake(&priv->bring_head->handshake);
+
+    priv->closed = 0;
+    result = EIO_ENONE;
+    return result;
+
+close_file_error:
+    close(bring_fd);
+    return result;
 
+error_no_cleanup:
+    return result;
+
+}
+
+static eio_error_t eio_bring_server_wait(eio_stream_t* this)
+{
+    bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
 
     ch_log_debug1("Waiting for client to connect to bring %s...\n",  priv->name);
-    for(int i = 0; ; i++){
-        __sync_synchronize();
-        if( priv->bring_head->magic == BRING_MAGIC_CLIENT){
-            break;
-        }
-        __sync_synchronize();
+    for(int i = 0; priv->bring_head->handshake != BRING_HS_CLIENT; i++){
+        bring_futex_wait(&priv->bring_head->handshake, BRING_HS_SERVER, BRING_HS_POLL_NS);
 
-        usleep(100*1000);
         if(i > 100 && i % 100 == 0){
-            ch_log_warn("Still waiting for client to connect magic=%li, expecting %lli\n",
-                        priv->bring_head->magic,BRING_MAGIC_CLIENT);
+            ch_log_warn("Still waiting for client to connect to bring %s\n", priv->name);
         }
 
         if( i > 1000){
             ch_log_error("Timed out waiting for client to connect\n");
-            goto close_file_error;
+            return EIO_ECLOSED;
         }
     }
     ch_log_debug1("Waiting for client to connect to bring %s...Done\n", priv->name);
 
-    priv->closed = 0;
-    result = EIO_ENONE;
-    return result;
+    return EIO_ENONE;
+}
 
-close_file_error:
-    close(bring_fd);
-    return result;
 
-error_no_cleanup:
-    return result;
+eio_error_t bring_wait_client(eio_stream_t* this)
+{
+    bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    ifassert(!priv->isserver){
+        return EIO_EINVALID;
+    }
+
+    return eio_bring_server_wait(this);
+}
+
+
+eio_error_t bring_rd_keep(eio_stream_t* this)
+{
+    bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    ifassert(!priv->reading){
+        ch_log_fatal( "Error, acquire before keep\n");
+        return EIO_EACQUIRE;
+    }
+
+    //Move on as a release would, but leave the sequence number alone so that
+    //the write end cannot reuse the slot yet
+    if(!priv->rd_kept){
+        priv->rd_kept_index = priv->rd_index;
+    }
+    priv->rd_kept++;
+
+    priv->reading = false;
+    priv->rd_index++;
+    priv->rd_index = priv->rd_index < priv->rd_slots ? priv->rd_index : 0;
+    priv->rd_head = (bring_slot_header_t*)(priv->rd_mem + (priv->rd_slots_size * priv->rd_index));
+    priv->rd_sync_counter++;
+    return EIO_ENONE;
+}
+
+
+eio_error_t bring_rd_free(eio_stream_t* this)
+{
+    bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    ifassert(!priv->rd_kept){
+        ch_log_fatal( "Error, no kept slot to free\n");
+        return EIO_EACQUIRE;
+    }
+
+    bring_slot_header_t* slot_head =
+            (bring_slot_header_t*)(priv->rd_mem + priv->rd_slots_size * priv->rd_kept_index);
+    (*(volatile uint64_t*)&slot_head->seq_no) = 0x0ULL;
+
+    priv->rd_kept--;
+    priv->rd_kept_index++;
+    priv->rd_kept_index = priv->rd_kept_index < priv->rd_slots ? priv->rd_kept_index : 0;
+    return EIO_ENONE;
+}
+
+
+int64_t bring_rd_ready(eio_stream_t* this, int64_t max)
+{
+    bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    ifunlikely(!priv->rd_head){
+        return 0;
+    }
+
+    int64_t index = priv->rd_index;
+    int64_t seq   = priv->rd_sync_counter;
+    int64_t ready = 0;
+    for(; ready < max && ready < priv->rd_slots; ready++, seq++){
+        const bring_slot_header_t* slot_head =
+                (bring_slot_header_t*)(priv->rd_mem + priv->rd_slots_size * index);
+        if((volatile int64_t)slot_head->seq_no < seq){
+            break;
+        }
+        index++;
+        index = index < priv->rd_slots ? index : 0;
+    }
 
+    return ready;
 }
 
+
 static eio_error_t eio_bring_client_connect(eio_stream_t* this)
 {
     int64_t result = 0;
@@ -516,16 +684,21 @@ static eio_error_t eio_bring_client_connect(eio_stream_t* this)
 
     ch_log_debug1("Doing bring connect client on %s\n",   priv->name);
 
-    //Resize the file big enough to read the bring header only
-    if(ftruncate(bring_fd,sizeof(bring_header_t))){
-        ch_log_error( "Could not resize shared region \"%s\" to size=%li. Error=%s\n",
+    //The server sizes the file. Wait until it has, rather than resizing it
+    //here and throwing away pages that the server has already faulted in
+    struct stat bring_stat;
+    if(fstat(bring_fd, &bring_stat)){
+        ch_log_error( "Could not stat shared region \"%s\". Error=%s\n",
                 priv->name,
-                sizeof(bring_header_t),
                 strerror(errno)
         );
         result = EIO_EINVALID;
         goto error_close_file;
     }
+    if(bring_stat.st_size < (off_t)sizeof(bring_header_t)){
+        result = EIO_ETRYAGAIN;
+        goto error_close_file;
+    }
 
     //Map the file into memory
     void* mem_tmp = mmap( NULL, sizeof(bring_header_t), PROT_READ, MAP_SHARED, bring_fd, 0);
@@ -547,9 +720,8 @@ static eio_error_t eio_bring_client_connect(eio_stream_t* this)
     ch_log_debug1("Looking for bring header on %s\n", priv->name);
     bring_header_t* header_tmp_ptr = mem_tmp;
     __sync_synchronize();
-    while(header_tmp_ptr->magic != BRING_MAGIC_SERVER){
-        __sync_synchronize();
-        usleep(100 * 1000);
+    while(header_tmp_ptr->handshake != BRING_HS_SERVER){
+        bring_futex_wait(&header_tmp_ptr->handshake, BRING_HS_NONE, BRING_HS_POLL_NS);
     }
     ch_log_debug1("Looking for bring header... Done.\n");
 
@@ -622,6 +794,10 @@ static eio_error_t eio_bring_client_connect(eio_stream_t* this)
     //2 - Do a word aligned single word write (atomic)
     priv->bring_head->magic = BRING_MAGIC_CLIENT;
     __sync_synchronize();
+    //3 - Wake up the server
+    priv->bring_head->handshake = BRING_HS_CLIENT;
+    __sync_synchronize();
+    bring_futex_wake(&priv->bring_head->handshake);
 
     ch_log_debug1("Done connecting to bring called %s with %lu slots of size %lu, usable size %lu\n",
             priv->name,
@@ -663,6 +839,7 @@ static eio_error_t bring_construct(eio_stream_t* this, bring_args_t* args)
     const uint64_t slot_count  = args->slot_count;
     const uint64_t isserver    = args->isserver;
     const uint64_t dontexpand  = args->dontexpand;
+    const uint64_t unidirectional = args->unidirectional;
 
     bring_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
 
@@ -681,6 +858,9 @@ static eio_error_t bring_construct(eio_stream_t* this, bring_args_t* args)
     priv->isserver   = isserver;
     priv->eof        = 0;
     priv->expand     = !dontexpand;
+    priv->unidirectional = unidirectional;
+    priv->numa_node  = args->numa_bind ? args->numa_node : NUMA_NODE_UNKNOWN;
+    priv->defer_connect = args->defer_connect;
     priv->rd_sync_counter = 1; //This will be the first valid value
     ch_log_debug3("priv->rd_sync_counter=%i\n", priv->rd_sync_counter);
 
@@ -692,8 +872,20 @@ static eio_error_t bring_construct(eio_stream_t* this, bring_args_t* args)
             if(!err){
                 priv->rd_mem  = (char*)priv->bring_head + priv->bring_head->rd_mem_start_offset;
                 priv->wr_mem  = (char*)priv->bring_head + priv->bring_head->wr_mem_start_offset;
+                priv->rd_slots          = priv->bring_head->rd_slots;
+                priv->rd_slots_size     = priv->bring_head->rd_slots_size;
+                priv->rd_slot_usr_size  = priv->bring_head->rd_slot_usr_size;
+                priv->wr_slots          = priv->bring_head->wr_slots;
+                priv->wr_slots_size     = priv->bring_head->wr_slots_size;
+                priv->wr_slot_usr_size  = priv->bring_head->wr_slot_usr_size;
                 priv->rd_head = (bring_slot_header_t*)priv->rd_mem;
                 priv->wr_head = (bring_slot_header_t*)priv->wr_mem;
+                if(!priv->bring_head->rd_slots){
+                    priv->rd_head = NULL;
+                }
+                if(!priv->defer_connect){
+                    err = eio_bring_server_wait(this);
+                }
                 return err;
             }
         }
@@ -703,8 +895,17 @@ static eio_error_t bring_construct(eio_stream_t* this, bring_args_t* args)
                 //Swap read and write pointers here for the client
                 priv->wr_mem = (char*)priv->bring_head + priv->bring_head->rd_mem_start_offset;
                 priv->rd_mem = (char*)priv->bring_head + priv->bring_head->wr_mem_start_offset;
+                priv->wr_slots          = priv->bring_head->rd_slots;
+                priv->wr_slots_size     = priv->bring_head->rd_slots_size;
+                priv->wr_slot_usr_size  = priv->bring_head->rd_slot_usr_size;
+                priv->rd_slots          = priv->bring_head->wr_slots;
+                priv->rd_slots_size     = priv->bring_head->wr_slots_size;
+                priv->rd_slot_usr_size  = priv->bring_head->wr_slot_usr_size;
                 priv->rd_head = (bring_slot_header_t*)priv->rd_mem;
                 priv->wr_head = (bring_slot_header_t*)priv->wr_mem;
+                if(!priv->bring_head->rd_slots){
+                    priv->wr_head = NULL;
+                }
                 return err;
             }
         }
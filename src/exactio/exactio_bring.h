@@ -22,8 +22,27 @@ typedef struct  {
     uint64_t slot_size;
     uint64_t slot_count;
     uint64_t dontexpand;
+    uint64_t unidirectional; //Only allocate the server-->client ring
+    uint64_t numa_bind;      //Prefer allocating ring memory from numa_node
+    int64_t numa_node;
+    uint64_t defer_connect;  //Don't wait for the client, use bring_wait_client()
 } bring_args_t;
 
 NEW_IOSTREAM_DECLARE(bring,bring_args_t);
 
+//Wait for the client to connect to a server bring made with defer_connect.
+//This allows a server to create many brings before waiting on any of them.
+eio_error_t bring_wait_client(eio_stream_t* this);
+
+//Move on to the next read slot without giving the current one back to the
+//write end, so that it can still be used after later slots are read. Kept
+//slots are given back oldest first with bring_rd_free(), and must all be given
+//back before the next eio_rd_rel().
+eio_error_t bring_rd_keep(eio_stream_t* this);
+eio_error_t bring_rd_free(eio_stream_t* this);
+
+//Count the slots ready to read, starting at the current read slot, stopping
+//at max. Lets a reader tell how far behind the writer it is.
+int64_t bring_rd_ready(eio_stream_t* this, int64_t max);
+
 #endif /* EXACTIO_BRING_H_ */
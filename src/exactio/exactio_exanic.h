@@ -166,6 +166,12 @@ static inline eio_error_t exa_rxcycles_to_timespecps(eio_stream_t* this, exanic_
 }
 
 
+//Frequency of the NIC's timestamp counter
+static inline uint32_t exa_rx_tick_hz(eio_stream_t* this)
+{
+    exa_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    return exanic_get_tick_hz(priv->rx_nic);
+}
 
 
 static inline eio_error_t exa_read_release(eio_stream_t* this, int64_t* ts)
@@ -66,6 +66,12 @@ typedef struct file_priv {
 
     int64_t filesize;
     int64_t blocksize;
+    bool preallocated;
+    bool overwrite;
+
+    int64_t writeback;   //Writeback chunk size, 0 when not pacing
+    int64_t write_off;   //End of the data written so far
+    int64_t wb_off;      //Writeback has been started up to here
 
     exactio_file_mod_t on_mod; //0 ignore, 1 reset, 2, tail
     int notify_fd;
@@ -74,6 +80,29 @@ typedef struct file_priv {
 } file_priv_t;
 
 
+/*
+ * Buffered writes leave dirty pages behind in the page cache, which the kernel
+ * writes back in big bursts that stall the writer. Instead, start writeback of
+ * each chunk as soon as it is complete, then wait for the chunk before it and
+ * drop it from the page cache. That keeps about two chunks dirty at any time,
+ * and the wait is usually over by the time it is made.
+ */
+static void file_writeback(file_priv_t* priv)
+{
+    const int64_t chunk = priv->writeback;
+    while(priv->write_off - priv->wb_off >= chunk){
+        const int64_t off = priv->wb_off;
+        sync_file_range(priv->fd, off, chunk, SYNC_FILE_RANGE_WRITE);
+        if(off >= chunk){
+            sync_file_range(priv->fd, off - chunk, chunk,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(priv->fd, off - chunk, chunk, POSIX_FADV_DONTNEED);
+        }
+        priv->wb_off += chunk;
+    }
+}
+
+
 static void file_destroy(eio_stream_t* this)
 {
     file_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
@@ -94,14 +123,27 @@ static void file_destroy(eio_stream_t* this)
         close(priv->notify_fd);
     }
 
-    if(priv->filename){
-        free(priv->filename);
+    //Start writing out the rest, without waiting for it
+    if(priv->fd > 0 && priv->writeback && priv->write_off > priv->wb_off){
+        sync_file_range(priv->fd, priv->wb_off, priv->write_off - priv->wb_off, SYNC_FILE_RANGE_WRITE);
     }
 
     if(priv->fd){
+        //Give back whatever part of the preallocation was not written, and
+        //drop anything left over past the end of an overwritten file
+        const off_t end = lseek(priv->fd, 0, SEEK_CUR);
+        if((priv->preallocated || priv->overwrite) && end >= 0){
+            if(ftruncate(priv->fd, end)){
+                ch_log_warn("Could not trim preallocated file \"%s\". Error=%s\n", priv->filename, strerror(errno));
+            }
+        }
         close(priv->fd);
     }
 
+    if(priv->filename){
+        free(priv->filename);
+    }
+
     priv->closed = true;
 
 }
@@ -319,6 +361,11 @@ static eio_error_t file_write_release(eio_stream_t* this, int64_t len, int64_t*
         bytes_written += result;
     }
 
+    ifunlikely(priv->writeback){
+        priv->write_off += bytes_written;
+        file_writeback(priv);
+    }
+
     priv->writing = false;
     eio_nowns(ts);
     return EIO_ENONE;
@@ -375,13 +422,51 @@ static eio_error_t file_construct(eio_stream_t* this, file_args_t* args)
         }
     }
 
-    priv->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, (mode_t)(0666));
+    priv->overwrite = args->overwrite;
+    priv->writeback = args->writeback;
+    const int trunc = args->overwrite ? 0 : O_TRUNC;
+    priv->fd = open(filename, O_RDWR | O_CREAT | trunc, (mode_t)(0666));
     if(priv->fd < 0){
         ch_log_error("Could not open file \"%s\". Error=%s\n", filename, strerror(errno));
         file_destroy(this);
         return -7;
     }
 
+    //A file written over in place keeps its blocks but not what was in them,
+    //so that a crash part way through can't leave old packets after the new.
+    //Zeroing marks the blocks unwritten without freeing them, the file is cut
+    //to its new size when it is closed
+    if(args->overwrite){
+        struct stat old;
+        if(fstat(priv->fd, &old)){
+            ch_log_error("Could not stat file \"%s\". Error=%s\n", filename, strerror(errno));
+            file_destroy(this);
+            return -7;
+        }
+        if(old.st_size &&
+           fallocate(priv->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, 0, old.st_size)){
+            //Not every file system can do this, dropping the old contents
+            //instead gives the blocks back, to be allocated again below
+            ch_log_debug1("Could not zero file \"%s\" in place. Error=%s\n", filename, strerror(errno));
+            if(ftruncate(priv->fd, 0)){
+                ch_log_error("Could not clear file \"%s\". Error=%s\n", filename, strerror(errno));
+                file_destroy(this);
+                return -7;
+            }
+        }
+    }
+
+    //Allocate the blocks now rather than as each write extends the file. The
+    //file size is left alone so readers only see what has been written.
+    if(args->prealloc_size){
+        if(fallocate(priv->fd, FALLOC_FL_KEEP_SIZE, 0, args->prealloc_size)){
+            ch_log_debug1("Could not preallocate file \"%s\". Error=%s\n", filename, strerror(errno));
+        }
+        else{
+            priv->preallocated = true;
+        }
+    }
+
     struct stat st;
     if(fstat(priv->fd,&st) < 0){
         ch_log_error("Cannot stat file \"%s\". Error=%s\n", filename, strerror(errno));
@@ -19,6 +19,9 @@ typedef struct  {
     uint64_t read_buff_size;
     uint64_t write_buff_size;
     uint64_t on_mod;
+    uint64_t prealloc_size; //Reserve this much disk space when opening
+    bool overwrite; //Write over an existing file in place, reusing its blocks
+    uint64_t writeback; //Buffered writes, push out and drop each chunk of this many bytes (0 means off)
 } file_args_t;
 
 NEW_IOSTREAM_DECLARE(file, file_args_t);
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Implementation of a raw block device writer using the exactio abstract I/O
+ *  interface. Each stream appends one segment to the device and keeps its
+ *  catalog entry up to date. Catalog updates go to the device alongside the
+ *  data writes, so that they cost the writer no extra waiting.
+ */
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <chaste/chaste.h>
+
+#include "exactio_raw.h"
+#include "exactio_timing.h"
+
+#include "../data_structs/raw_catalog.h"
+#include "../aioq.h"
+
+/* How often the catalog is brought up to date while writing */
+#define RAW_SYNC_NS (1000 * 1000 * 1000)
+
+typedef struct raw_priv {
+    int fd;
+    char* device;
+    bool closed;
+    bool writing;
+
+    char* usr_write_buff;
+    int64_t usr_write_buff_size;
+    int64_t usr_write_ts;
+
+    int64_t dev_size;
+    int64_t offset;       //Where the next write goes
+    int64_t last_sync_ns;
+
+    raw_catalog_hdr_t* hdr; //Catalog header block
+    char* seg_block;        //Catalog block holding this segment's entry
+    raw_segment_t* seg;
+
+    aioq_t aio;             //Data and catalog writes in flight together
+
+} raw_priv_t;
+
+
+static int raw_pwrite_block(raw_priv_t* priv, void* block, int64_t offset)
+{
+    if(pwrite(priv->fd, block, RAW_BLOCK, offset) != RAW_BLOCK){
+        ch_log_error("Could not write catalog on \"%s\". Error=%s\n", priv->device, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+//Bring this segment's entry, and the header that points past it, up to the
+//data written so far
+static void raw_catalog_update(raw_priv_t* priv)
+{
+    priv->seg->end = priv->offset;
+    priv->hdr->data_end = priv->offset;
+    eio_nowns(&priv->last_sync_ns);
+}
+
+
+//Update the catalog and write it out now
+static int raw_sync(raw_priv_t* priv)
+{
+    raw_catalog_update(priv);
+
+    const int64_t seg_idx = priv->hdr->segments - 1;
+    if(raw_pwrite_block(priv, priv->seg_block, RAW_SEG_BLOCK_OFF(seg_idx))){
+        return -1;
+    }
+    return raw_pwrite_block(priv, priv->hdr, 0);
+}
+
+
+static void raw_destroy(eio_stream_t* this)
+{
+    raw_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+
+    if(priv->fd > 0 && priv->seg){
+        priv->seg->flags &= ~RAW_SEG_OPEN;
+        raw_sync(priv);
+    }
+
+    aioq_fini(&priv->aio);
+    if(priv->fd > 0){
+        close(priv->fd);
+        priv->fd = -1;
+    }
+
+    free(priv->hdr);
+    priv->hdr = NULL;
+    free(priv->seg_block);
+    priv->seg_block = NULL;
+    free(priv->device);
+    priv->device = NULL;
+
+    priv->closed = true;
+}
+
+
+//Read operations
+static eio_error_t raw_read_acquire(eio_stream_t* this, char** buffer, int64_t* len, int64_t* ts )
+{
+    (void)this;
+    (void)buffer;
+    (void)len;
+    (void)ts;
+    return EIO_ENOTIMPL;
+}
+
+static eio_error_t raw_read_release(eio_stream_t* this, int64_t* ts)
+{
+    (void)this;
+    (void)ts;
+    return EIO_ENOTIMPL;
+}
+
+
+//Write operations
+static eio_error_t raw_write_acquire(eio_stream_t* this, char** buffer, int64_t* len, int64_t* ts)
+{
+    raw_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+
+    ifunlikely(priv->closed){
+        return EIO_ECLOSED;
+    }
+
+    ifassert(priv->writing){
+        ch_log_error("Call write release before calling write acquire\n");
+        return EIO_ERELEASE;
+    }
+
+    //There is no internal buffer, writes always come from the user
+    ifunlikely(!buffer || !len || !*buffer || !*len){
+        return EIO_ENOTIMPL;
+    }
+
+    priv->usr_write_buff = *buffer;
+    priv->usr_write_buff_size = *len;
+    priv->usr_write_ts = ts ? *ts : 0;
+    priv->writing = true;
+    return EIO_ENONE;
+}
+
+static eio_error_t raw_write_release(eio_stream_t* this, int64_t len, int64_t* ts)
+{
+    raw_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+
+    ifassert(!priv->writing){
+        ch_log_fatal("Call write release before calling write acquire\n");
+        return EIO_ERELEASE;
+    }
+
+    ifassert(len > priv->usr_write_buff_size){
+        ch_log_fatal("Error length (%li) is too big for user buffer size (%li). Data corruption is likely\n",
+                len,
+                priv->usr_write_buff_size);
+        return EIO_ETOOBIG;
+    }
+
+    priv->writing = false;
+    if(len == 0){
+        eio_nowns(ts);
+        return EIO_ENONE;
+    }
+
+    ifunlikely(priv->offset + len > priv->dev_size){
+        ch_log_error("Raw device \"%s\" is full\n", priv->device);
+        raw_destroy(this);
+        return EIO_ECLOSED;
+    }
+
+    aioq_write(&priv->aio, priv->fd, priv->usr_write_buff, len, priv->offset);
+
+    //Now and then, write the catalog out beside this write rather than after
+    //it. It only covers what was written before, so it never points past
+    //data that may not be there yet.
+    int64_t now;
+    eio_nowns(&now);
+    ifunlikely(now - priv->last_sync_ns >= RAW_SYNC_NS){
+        raw_catalog_update(priv);
+        const int64_t seg_idx = priv->hdr->segments - 1;
+        aioq_write(&priv->aio, priv->fd, priv->seg_block, RAW_BLOCK, RAW_SEG_BLOCK_OFF(seg_idx));
+        aioq_write(&priv->aio, priv->fd, (char*)priv->hdr, RAW_BLOCK, 0);
+    }
+
+    aioq_reap(&priv->aio, priv->aio.submitted);
+    ifunlikely(priv->aio.failed){
+        ch_log_error("Unexpected error writing to raw device \"%s\"\n", priv->device);
+        raw_destroy(this);
+        return EIO_ECLOSED;
+    }
+
+    //Rough time range, from the first packet of each write. The pcap file
+    //header has no time so is skipped.
+    const uint64_t first_ns = priv->usr_write_ts;
+    if(first_ns){
+        priv->seg->first_ns = priv->seg->first_ns ? priv->seg->first_ns : first_ns;
+        priv->seg->last_ns  = first_ns;
+    }
+    priv->offset += len;
+
+    if(ts){
+        *ts = now;
+    }
+    return EIO_ENONE;
+}
+
+
+static eio_error_t raw_construct(eio_stream_t* this, raw_args_t* args)
+{
+    raw_priv_t* priv = IOSTREAM_GET_PRIVATE(this);
+    priv->fd = -1;
+
+    if(aioq_init(&priv->aio)){
+        ch_log_error("Could not set up writes to raw device \"%s\"\n", args->device);
+        return -1;
+    }
+
+    priv->device = strdup(args->device);
+    priv->hdr = aligned_alloc(RAW_BLOCK, RAW_BLOCK);
+    priv->seg_block = aligned_alloc(RAW_BLOCK, RAW_BLOCK);
+    if(!priv->device || !priv->hdr || !priv->seg_block){
+        ch_log_error("Could not allocate catalog buffers for \"%s\"\n", args->device);
+        raw_destroy(this);
+        return -1;
+    }
+
+    //Exclusive, so that a device that is mounted, or that another output is
+    //writing to under another name, is refused (EBUSY)
+    priv->fd = open(priv->device, O_RDWR | O_DIRECT | O_EXCL);
+    if(priv->fd < 0){
+        ch_log_error("Could not open raw device \"%s\". Error=%s\n", priv->device, strerror(errno));
+        raw_destroy(this);
+        return -2;
+    }
+
+    //Regular files are allowed too, which is handy for testing
+    struct stat st;
+    uint64_t dev_size = 0;
+    if(fstat(priv->fd, &st) == 0 && S_ISREG(st.st_mode)){
+        dev_size = st.st_size;
+    }
+    else if(ioctl(priv->fd, BLKGETSIZE64, &dev_size)){
+        ch_log_error("Could not get size of raw device \"%s\". Error=%s\n", priv->device, strerror(errno));
+        raw_destroy(this);
+        return -3;
+    }
+    priv->dev_size = dev_size;
+    if(priv->dev_size <= RAW_DATA_START){
+        ch_log_error("Raw device \"%s\" is too small (%liB)\n", priv->device, priv->dev_size);
+        raw_destroy(this);
+        return -4;
+    }
+
+    if(pread(priv->fd, priv->hdr, RAW_BLOCK, 0) != RAW_BLOCK){
+        ch_log_error("Could not read catalog on \"%s\". Error=%s\n", priv->device, strerror(errno));
+        raw_destroy(this);
+        return -5;
+    }
+
+    //Start a new catalog if there isn't one we understand, but only if asked
+    //to, as this writes over whatever was on the device
+    const bool found = !memcmp(priv->hdr->magic, RAW_CATALOG_MAGIC, sizeof(priv->hdr->magic));
+    if(!found || priv->hdr->version != RAW_CATALOG_VERSION){
+        if(!args->init){
+            if(found){
+                ch_log_error("Catalog on \"%s\" is version %u, not %u\n", priv->device,
+                             priv->hdr->version, RAW_CATALOG_VERSION);
+            }
+            else{
+                ch_log_error("No catalog found on \"%s\". Is it the right device? "
+                             "Use --raw-init to start a new one, losing what is on it\n", priv->device);
+            }
+            raw_destroy(this);
+            return -5;
+        }
+        ch_log_warn("No catalog found on \"%s\", starting a new one\n", priv->device);
+        memset(priv->hdr, 0, RAW_BLOCK);
+        memcpy(priv->hdr->magic, RAW_CATALOG_MAGIC, sizeof(priv->hdr->magic));
+        priv->hdr->version      = RAW_CATALOG_VERSION;
+        priv->hdr->block_size   = RAW_BLOCK;
+        priv->hdr->data_start   = RAW_DATA_START;
+        priv->hdr->data_end     = RAW_DATA_START;
+        priv->hdr->segments     = 0;
+        priv->hdr->max_segments = RAW_MAX_SEGMENTS;
+    }
+
+    if(priv->hdr->segments >= priv->hdr->max_segments){
+        ch_log_error("Catalog on \"%s\" is full (%li segments)\n", priv->device, priv->hdr->segments);
+        raw_destroy(this);
+        return -6;
+    }
+
+    const int64_t seg_idx = priv->hdr->segments;
+    if(seg_idx % RAW_SEGS_PER_BLOCK == 0){
+        memset(priv->seg_block, 0, RAW_BLOCK);
+    }
+    else if(pread(priv->fd, priv->seg_block, RAW_BLOCK, RAW_SEG_BLOCK_OFF(seg_idx)) != RAW_BLOCK){
+        ch_log_error("Could not read catalog on \"%s\". Error=%s\n", priv->device, strerror(errno));
+        raw_destroy(this);
+        return -7;
+    }
+
+    priv->seg = (raw_segment_t*)priv->seg_block + seg_idx % RAW_SEGS_PER_BLOCK;
+    memset(priv->seg, 0, sizeof(raw_segment_t));
+    priv->seg->start = priv->hdr->data_end;
+    if(args->align > 0){
+        priv->seg->start = (priv->seg->start + args->align - 1) / args->align * args->align;
+    }
+    priv->seg->flags = RAW_SEG_OPEN;
+    priv->seg->port_mask = args->port_mask;
+    if(args->ports){
+        snprintf(priv->seg->ports, sizeof(priv->seg->ports), "%s", args->ports);
+    }
+    priv->offset = priv->seg->start;
+    priv->hdr->segments++;
+
+    if(raw_sync(priv)){
+        priv->seg = NULL;
+        raw_destroy(this);
+        return -8;
+    }
+
+    priv->closed = false;
+    this->fd = priv->fd;
+    return 0;
+}
+
+
+NEW_IOSTREAM_DEFINE(raw, raw_args_t, raw_priv_t)
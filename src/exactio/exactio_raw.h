@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description:
+ *  Write only stream that appends a new segment to a raw block device, using
+ *  the catalog described in data_structs/raw_catalog.h. No file system is
+ *  involved, writes go straight to the device with O_DIRECT.
+ *
+ *  Write acquire takes the time of the first packet in the buffer (ns since
+ *  the epoch, 0 if unknown) through its "ts" argument, for the catalog.
+ */
+
+#ifndef EXACTIO_RAW_H_
+#define EXACTIO_RAW_H_
+
+#include "exactio_stream.h"
+
+typedef struct  {
+    char* device;
+    char* ports; //Recorded in the catalog entry for the segment
+    uint64_t port_mask; //Likewise, see expcap_block_port_bit()
+    bool init; //Start a new catalog if the device has none
+    int64_t align; //Start the segment on a multiple of this (e.g. RAID stripe)
+} raw_args_t;
+
+NEW_IOSTREAM_DECLARE(raw, raw_args_t);
+
+#endif /* EXACTIO_RAW_H_ */
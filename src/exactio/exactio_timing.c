@@ -13,33 +13,95 @@
 
 #include <time.h>
 #include <math.h>
+#include <cpuid.h>
+
+#include <chaste/log/log.h>
 
 #include "exactio_timing.h"
 #include "exactio.h"
 
 
-//static inline uint64_t rdtscp( uint32_t *aux )
-//{
-//    uint64_t rax,rdx;
-//    __asm__ __volatile__( "rdtscp\n" : "=a" (rax), "=d" (rdx), "=c" (aux) : : );
-//    return (rdx << 32) + rax;
-//}
+eio_clock_t eio_clock = { 0 };
+
+#define NS_PER_SEC (1000LL * 1000 * 1000)
+#define CALIBRATION_NS (20 * 1000 * 1000)
 
-void eio_nowns(int64_t* ts)
+static inline int64_t clock_ns(clockid_t clock)
 {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
 
 
-    iflikely(!ts){
-        return;
+//CPUID leaf 0x80000007, EDX bit 8: the TSC runs at a constant rate in all
+//ACPI P-, C- and T-states, so it can be used as a wall clock
+static bool tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007){
+        return false;
     }
 
-    struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now );
-    *ts =  now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 8);
+}
+
+
+bool eio_clock_init(void)
+{
+    eio_clock.use_tsc = false;
+    if(!tsc_is_invariant()){
+        ch_log_debug1("TSC is not invariant, using clock_gettime()\n");
+        return false;
+    }
+
+    //Count cycles over a short interval of the monotonic clock
+    const int64_t start_ns  = clock_ns(CLOCK_MONOTONIC);
+    const uint64_t start_tsc = eio_rdtsc();
+    int64_t end_ns = start_ns;
+    while(end_ns - start_ns < CALIBRATION_NS){
+        end_ns = clock_ns(CLOCK_MONOTONIC);
+    }
+    const uint64_t end_tsc = eio_rdtsc();
+
+    const double tsc_hz = (double)(end_tsc - start_tsc) * NS_PER_SEC /
+                          (end_ns - start_ns);
+    if(tsc_hz < 1e6){
+        ch_log_warn("Implausible TSC frequency %.0fHz, using clock_gettime()\n",
+                    tsc_hz);
+        return false;
+    }
+
+    eio_clock.tsc_hz   = tsc_hz;
+    eio_clock.mult     = (uint64_t)((double)NS_PER_SEC * (1ULL << EIO_CLOCK_SHIFT) / tsc_hz);
+    eio_clock.tsc_base = eio_rdtsc();
+    eio_clock.ns_base  = clock_ns(CLOCK_REALTIME);
+    __sync_synchronize();
+    eio_clock.use_tsc  = true;
+
+    ch_log_debug1("Using invariant TSC clock at %.6fGHz\n", tsc_hz / 1e9);
+    return true;
+}
+
+
+void eio_clock_sync(void)
+{
+    if(!eio_clock.use_tsc){
+        return;
+    }
 
-//    uint32_t aux;
-//    ts->tv_sec = 0;
-//    ts->tv_psec = rdtscp(&aux); // * 1000 / 3.5;
+    //Take the two readings as close together as we can, and apart from the
+    //update, so that readers are not held up by clock_gettime()
+    const int64_t ns_base   = clock_ns(CLOCK_REALTIME);
+    const uint64_t tsc_base = eio_rdtsc();
+
+    eio_clock.seq++;
+    __sync_synchronize();
+    eio_clock.tsc_base = tsc_base;
+    eio_clock.ns_base  = ns_base;
+    __sync_synchronize();
+    eio_clock.seq++;
 }
 
 
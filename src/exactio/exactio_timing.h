@@ -11,12 +11,79 @@
 #ifndef SRC_EXACTIO_EXACTIO_TIMING_H_
 #define SRC_EXACTIO_EXACTIO_TIMING_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <chaste/utils/util.h>
 #include "../data_structs/timespecps.h"
 
+//Conversion from TSC cycles to nanoseconds, set up by eio_clock_init()
+typedef struct {
+    bool use_tsc;       //False until calibrated, or if the TSC is not invariant
+    volatile uint32_t seq; //Odd while the base below is being moved
+    uint64_t tsc_base;  //TSC value at the last anchor
+    int64_t ns_base;    //CLOCK_REALTIME at the last anchor
+    uint64_t mult;      //ns = (cycles * mult) >> EIO_CLOCK_SHIFT
+    double tsc_hz;
+} eio_clock_t;
+
+#define EIO_CLOCK_SHIFT 32
+
+//How often eio_clock_sync() should be called. The calibrated rate is only
+//good to a few ppm, and CLOCK_REALTIME is slewed by NTP, so the TSC clock
+//drifts off the wall clock if it is left to run.
+#define EIO_CLOCK_SYNC_NS (100 * 1000 * 1000)
+
+extern eio_clock_t eio_clock;
+
+//Check for an invariant TSC and calibrate it against CLOCK_REALTIME. Call
+//once at startup, before any threads use eio_nowns(). Returns true if the TSC
+//will be used, otherwise eio_nowns() falls back to clock_gettime()
+bool eio_clock_init(void);
+
+//Anchor the TSC clock to CLOCK_REALTIME again. Call from one thread only,
+//every EIO_CLOCK_SYNC_NS or so, while others use eio_nowns()
+void eio_clock_sync(void);
+
+static inline uint64_t eio_rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 
 //Some handy time related utils
-//Get the current time in timespecps format
-void eio_nowns(int64_t* ts);
+//Get the current time in nanoseconds since the epoch
+static inline void eio_nowns(int64_t* ts)
+{
+    iflikely(!ts){
+        return;
+    }
+
+    iflikely(eio_clock.use_tsc){
+        __extension__ typedef unsigned __int128 u128_t;
+        uint32_t seq;
+        uint64_t tsc_base;
+        int64_t ns_base;
+        do{
+            seq = eio_clock.seq;
+            __asm__ __volatile__ ("" ::: "memory");
+            tsc_base = eio_clock.tsc_base;
+            ns_base  = eio_clock.ns_base;
+            __asm__ __volatile__ ("" ::: "memory");
+        } while((seq & 1) || seq != eio_clock.seq);
+
+        const uint64_t cycles = eio_rdtsc() - tsc_base;
+        *ts = ns_base +
+              (int64_t)(((u128_t)cycles * eio_clock.mult) >> EIO_CLOCK_SHIFT);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now );
+    *ts =  now.tv_sec * 1000 * 1000 * 1000 + now.tv_nsec;
+}
 
 //Convert a timespec ps to int64 nanoseconds
 //int64_t eio_tspstonsll(timespecps_t* ts);
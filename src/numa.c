@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: NUMA topology discovery and memory binding
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+#include <chaste/log/log.h>
+
+#include "numa.h"
+
+/* From linux/mempolicy.h, defined here to avoid a libnuma dependency */
+#define MPOL_PREFERRED 1
+
+
+/* Read a single integer from a sysfs file */
+static int read_sysfs_int(const char* filename, int* value)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f)
+    {
+        return -1;
+    }
+
+    const int result = fscanf(f, "%i", value) == 1 ? 0 : -1;
+    fclose(f);
+    return result;
+}
+
+
+/*
+ * Walk up the sysfs device tree from path until a device with a numa_node
+ * attribute is found. Block devices and network interfaces sit below the PCIe
+ * function that they belong to, which is where the numa_node attribute lives.
+ */
+static int numa_node_of_sysfs(const char* path)
+{
+    char dev_path[PATH_MAX];
+    if (!realpath(path, dev_path))
+    {
+        ch_log_debug1("Could not resolve sysfs path %s: %s\n", path,
+                      strerror(errno));
+        return NUMA_NODE_UNKNOWN;
+    }
+
+    char filename[PATH_MAX + 16];
+    while (strlen(dev_path) > strlen("/sys/devices"))
+    {
+        int node = NUMA_NODE_UNKNOWN;
+        snprintf(filename, sizeof(filename), "%s/numa_node", dev_path);
+        if (!read_sysfs_int(filename, &node))
+        {
+            return node < 0 ? NUMA_NODE_UNKNOWN : node;
+        }
+
+        char* slash = strrchr(dev_path, '/');
+        if (!slash)
+        {
+            break;
+        }
+        *slash = '\0';
+    }
+
+    return NUMA_NODE_UNKNOWN;
+}
+
+
+int numa_node_of_cpu(int64_t cpu)
+{
+    char filename[128];
+    for (int node = 0; node < NUMA_MAX_NODES; node++)
+    {
+        snprintf(filename, sizeof(filename),
+                 "/sys/devices/system/node/node%i/cpu%li", node, cpu);
+        if (!access(filename, F_OK))
+        {
+            return node;
+        }
+    }
+
+    return NUMA_NODE_UNKNOWN;
+}
+
+
+int numa_node_of_iface(const char* iface)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device", iface);
+    return numa_node_of_sysfs(path);
+}
+
+
+int numa_node_of_path(const char* path)
+{
+    struct stat st;
+    if (stat(path, &st))
+    {
+        /* Output files are named from a prefix, so look at the directory */
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        if (stat(dirname(dir), &st))
+        {
+            return NUMA_NODE_UNKNOWN;
+        }
+    }
+
+    const dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    if (major(dev) == 0)
+    {
+        /* Not backed by a block device (e.g. tmpfs or /dev/null) */
+        return NUMA_NODE_UNKNOWN;
+    }
+
+    char sys_path[128];
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", major(dev),
+             minor(dev));
+    return numa_node_of_sysfs(sys_path);
+}
+
+
+int numa_bind_mem(void* mem, int64_t len, int node)
+{
+    if (node < 0 || node >= NUMA_MAX_NODES)
+    {
+        return -1;
+    }
+
+    unsigned long mask[NUMA_MAX_NODES / (sizeof(unsigned long) * 8)] = {0};
+    mask[node / (sizeof(unsigned long) * 8)] =
+            1UL << (node % (sizeof(unsigned long) * 8));
+
+    /* The kernel ignores the last bit of maxnode, hence the + 1 */
+    if (syscall(SYS_mbind, mem, len, MPOL_PREFERRED, mask,
+                sizeof(mask) * 8 + 1, 0))
+    {
+        ch_log_warn("Could not bind memory to NUMA node %i: %s\n", node,
+                    strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Discovery of the NUMA nodes that CPUs, NICs and disks are
+ *  attached to, and binding of memory to nodes. Uses sysfs and the raw mbind
+ *  system call so that there is no dependency on libnuma.
+ */
+
+
+#ifndef SRC_NUMA_H_
+#define SRC_NUMA_H_
+
+#include <stdint.h>
+
+/* Returned when the node cannot be determined (e.g. single socket machines) */
+#define NUMA_NODE_UNKNOWN (-1)
+#define NUMA_MAX_NODES (64)
+
+/* NUMA node that a CPU belongs to */
+int numa_node_of_cpu(int64_t cpu);
+
+/* NUMA node of the PCIe device behind a network interface (e.g. "eth2") */
+int numa_node_of_iface(const char* iface);
+
+/* NUMA node of the PCIe device holding the file system that path is on. If
+ * path does not exist, the directory containing it is used instead */
+int numa_node_of_path(const char* path);
+
+/* Prefer allocating pages in [mem, mem + len) from the given node. Must be
+ * called before the memory is first touched. Returns 0 on success */
+int numa_bind_mem(void* mem, int64_t len, int node);
+
+#endif /* SRC_NUMA_H_ */
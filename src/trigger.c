@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Capture triggers from signals, a control socket and packets
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <chaste/log/log.h>
+
+#include "exactio/exactio_timing.h"
+#include "trigger.h"
+
+volatile int64_t trigger_ns = 0;
+trigger_match_t trigger_match = {0};
+
+static int trigger_fd = -1;
+static char trigger_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static pthread_t trigger_thread;
+static volatile bool trigger_stop = false;
+
+
+void trigger_fire(void)
+{
+    int64_t now;
+    eio_nowns(&now);
+    trigger_ns = now;
+}
+
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+int trigger_match_parse(const char* spec)
+{
+    char* hex = NULL;
+    const long offset = strtol(spec, &hex, 0);
+    if (hex == spec || *hex != ':' || offset < 0)
+    {
+        ch_log_error("Trigger match \"%s\" is not in the form offset:hexbytes\n",
+                     spec);
+        return -1;
+    }
+    hex++;
+
+    const int64_t hex_len = strlen(hex);
+    if (hex_len == 0 || hex_len % 2 || hex_len / 2 > TRIGGER_MATCH_MAX)
+    {
+        ch_log_error("Trigger match needs 1 to %i whole bytes of hex\n",
+                     TRIGGER_MATCH_MAX);
+        return -1;
+    }
+
+    for (int64_t i = 0; i < hex_len / 2; i++)
+    {
+        const int hi = hex_nibble(hex[2 * i]);
+        const int lo = hex_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            ch_log_error("Trigger match \"%s\" has bad hex\n", spec);
+            return -1;
+        }
+        trigger_match.bytes[i] = (char)(hi << 4 | lo);
+    }
+
+    trigger_match.offset = offset;
+    trigger_match.len = hex_len / 2;
+    return 0;
+}
+
+
+/* Wait for messages, waking up now and then to check if it is time to stop */
+static void* trigger_socket_thread(void* params)
+{
+    (void)params;
+    char msg[256];
+    while (!trigger_stop)
+    {
+        const ssize_t len = recv(trigger_fd, msg, sizeof(msg), 0);
+        if (len < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                ch_log_error("Trigger socket failed: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        trigger_fire();
+        ch_log_info("Trigger from control socket %s\n", trigger_path);
+    }
+
+    return NULL;
+}
+
+
+int trigger_socket_start(const char* path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        ch_log_error("Trigger socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(trigger_path, path);
+
+    trigger_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (trigger_fd < 0)
+    {
+        ch_log_error("Could not create trigger socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Replace any socket left over from an earlier run */
+    unlink(path);
+    if (bind(trigger_fd, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        ch_log_error("Could not bind trigger socket %s: %s\n", path,
+                     strerror(errno));
+        goto error;
+    }
+
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+    setsockopt(trigger_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (pthread_create(&trigger_thread, NULL, trigger_socket_thread, NULL))
+    {
+        ch_log_error("Could not start trigger socket thread\n");
+        unlink(path);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    close(trigger_fd);
+    trigger_fd = -1;
+    return -1;
+}
+
+
+void trigger_socket_stop(void)
+{
+    if (trigger_fd < 0)
+    {
+        return;
+    }
+
+    trigger_stop = true;
+    pthread_join(trigger_thread, NULL);
+    close(trigger_fd);
+    unlink(trigger_path);
+    trigger_fd = -1;
+}
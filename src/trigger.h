@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: Triggers for pre-trigger capture. A trigger can come from a
+ *  signal, a message on a control socket or a packet matching a pattern. All
+ *  of them just record the time of the most recent trigger, the writers
+ *  decide what to do with it.
+ */
+
+
+#ifndef SRC_TRIGGER_H_
+#define SRC_TRIGGER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define TRIGGER_MATCH_MAX (64)
+
+/* Look for these bytes at this offset into each packet */
+typedef struct
+{
+    int64_t offset;
+    int64_t len; /* 0 means no matching */
+    char bytes[TRIGGER_MATCH_MAX];
+} trigger_match_t;
+
+/* Time of the most recent trigger (see eio_nowns()), 0 if never triggered */
+extern volatile int64_t trigger_ns;
+extern trigger_match_t trigger_match;
+
+/* Record a trigger now. Safe to call from a signal handler */
+void trigger_fire(void);
+
+/* Parse a match in the form "offset:hexbytes", e.g. "12:88f7" */
+int trigger_match_parse(const char* spec);
+
+static inline bool trigger_match_pkt(const char* pkt, int64_t len)
+{
+    return trigger_match.offset + trigger_match.len <= len &&
+           !memcmp(pkt + trigger_match.offset, trigger_match.bytes,
+                   trigger_match.len);
+}
+
+/* Listen for triggers on a unix datagram socket at path. Any message fires a
+ * trigger */
+int trigger_socket_start(const char* path);
+void trigger_socket_stop(void);
+
+#endif /* SRC_TRIGGER_H_ */
@@ -17,10 +17,17 @@
 #include <exanic/port.h>
 #include <exanic/config.h>
 
+#include <chaste/log/log.h>
+
 #include "data_structs/expcap.h"
+#include "data_structs/pcap-structures.h"
 
+#include "exact-capture.h"
 #include "utils.h"
 
+extern int64_t min_pcap_rec;
+extern int64_t max_pcap_rec;
+
 
 
 
@@ -45,6 +52,78 @@ void init_dummy_data(char* dummy_data, int len)
 }
 
 
+static inline void add_dummy_packet(char* buff, int64_t dummy_rec_len,
+                                    int64_t ts_raw)
+{
+    const int64_t dummy_payload_len = dummy_rec_len - sizeof(pcap_pkthdr_t) -
+            sizeof(expcap_pktftr_t);
+
+    ch_log_debug1("Adding dummy of pcap record of len=%li (payload=%li) to %p\n",
+                  dummy_rec_len, dummy_payload_len, buff);
+
+    pcap_pkthdr_t* dummy_hdr = (pcap_pkthdr_t*) (buff);
+    buff += sizeof(pcap_pkthdr_t);
+
+    //Use the last ts value so the writer thread doesn't break
+    dummy_hdr->ts.raw = ts_raw;
+    dummy_hdr->caplen = dummy_rec_len - sizeof(pcap_pkthdr_t);
+    dummy_hdr->len = 0; /*This is an invalid dummy packet, 0 wire length */
+
+    memset(buff, 0xFF, dummy_payload_len + sizeof(expcap_pktftr_t));
+}
+
+
+int64_t pad_to_block(char* buff, int64_t used, int64_t buff_len, int64_t ts_raw)
+{
+    return pad_to_size(buff, used, buff_len, DISK_BLOCK, ts_raw);
+}
+
+
+int64_t pad_to_size(char* buff, int64_t used, int64_t buff_len, int64_t block,
+                    int64_t ts_raw)
+{
+    /* What is the minimum sized packet that we can squeeze in?
+     * Just a header and a footer, no content */
+    ch_log_debug1("max pcap record=%li min pcap record=%li\n", max_pcap_rec,
+                  min_pcap_rec);
+
+    /* Find the next disk block boundary with space for adding a minimum packet*/
+    const int64_t block_bytes = round_up(used + min_pcap_rec, block);
+
+    ch_log_debug1("Block bytes=%li\n", block_bytes);
+    if(block_bytes > buff_len)
+    {
+        ch_log_fatal("Assumption violated %li > %li\n", block_bytes, buff_len);
+    }
+
+    /* How many bytes do we need to write? */
+    const int64_t padding = block_bytes - used;
+    int64_t remain = padding;
+
+    /* Fill out the remaining space with packets no smaller than min_packet, and
+     * no larger than max_packet. Assume that remain is at least as big as a
+     * minimum sized packet (which is enforced above).
+     */
+    while(remain > 0)
+    {
+        int64_t dummy_len = max_pcap_rec;
+        if(remain <= max_pcap_rec){
+            dummy_len = remain;
+        }
+        else if(remain - max_pcap_rec < min_pcap_rec){
+            dummy_len = min_pcap_rec;
+        }
+
+        add_dummy_packet(buff + used, dummy_len, ts_raw);
+        ch_log_debug1("Added dummy of size %li\n", dummy_len);
+        used   += dummy_len;
+        remain -= dummy_len;
+    }
+
+    return padding;
+}
+
+
 void print_flags(uint8_t flags)
 {
     if(flags & EXPCAP_FLAG_ABRT)    printf("ABRT ");
@@ -32,6 +32,14 @@ int64_t time_now_ns();
 
 void init_dummy_data(char* dummy_data, int len);
 
+/* Fill buff from offset "used" up to the next disk block boundary with dummy
+ * (len == 0) pcap records. Returns the number of padding bytes added */
+int64_t pad_to_block(char* buff, int64_t used, int64_t buff_len, int64_t ts_raw);
+
+/* As above, but up to the next multiple of "block" bytes */
+int64_t pad_to_size(char* buff, int64_t used, int64_t buff_len, int64_t block,
+                    int64_t ts_raw);
+
 void print_flags(uint8_t flags);
 
 int parse_device (const char* interface,
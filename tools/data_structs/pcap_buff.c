@@ -7,6 +7,9 @@
 #include <chaste/log/log.h>
 #include <errno.h>
 #include "pcap_buff.h"
+#include "../../src/data_structs/expcap_block.h"
+#include "../../src/data_structs/expcap_hash.h"
+#include "../../src/data_structs/pcapng.h"
 
 buff_error_t pcap_buff_init(char* filename, int64_t snaplen, int64_t max_filesize, bool usec,
                            bool conserve_fds, bool allow_duplicates, pcap_buff_t* pcap_buffo)
@@ -17,6 +20,7 @@ buff_error_t pcap_buff_init(char* filename, int64_t snaplen, int64_t max_filesiz
     pcap_buffo->_buff = buff;
     pcap_buffo->snaplen = snaplen;
     pcap_buffo->usec = usec;
+    pcap_buffo->_ng_block = NULL;
 
     /* Generate the output file header */
     pcap_file_header_t* hdr = (pcap_file_header_t*)malloc(sizeof(pcap_file_header_t));
@@ -40,6 +44,35 @@ buff_error_t pcap_buff_init(char* filename, int64_t snaplen, int64_t max_filesiz
     return BUFF_ENONE;
 }
 
+buff_error_t pcap_buff_init_ng(char* filename, int64_t snaplen, int64_t max_filesize,
+                               bool conserve_fds, bool allow_duplicates, pcap_buff_t* pcap_buffo)
+{
+    buff_t* buff = NULL;
+    BUFF_TRY(buff_init(filename, max_filesize, conserve_fds, allow_duplicates, &buff));
+
+    pcap_buffo->_buff = buff;
+    pcap_buffo->snaplen = snaplen;
+    pcap_buffo->usec = false;
+    pcap_buffo->_ng_seg = buff->file_seg;
+    pcap_buffo->_ng_count = 0;
+    pcap_buffo->_ng_ids = 0;
+    pcap_buffo->_ng_block_size = snaplen + PCAPNG_EPB_MAX;
+    pcap_buffo->_ng_block = (char*)malloc(pcap_buffo->_ng_block_size);
+
+    /* Every file starts with a section header */
+    char* hdr = (char*)malloc(PCAPNG_SHB_LEN);
+    if(!hdr || !pcap_buffo->_ng_block){
+        ch_log_fatal("Failed to allocate memory for file header!\n");
+    }
+
+    buff->file_header = hdr;
+    buff->header_size = pcapng_shb(hdr);
+
+    BUFF_TRY(buff_new_file(buff));
+
+    return BUFF_ENONE;
+}
+
 buff_error_t pcap_buff_from_file(pcap_buff_t* pcap_buff, char* filename, bool is_expcap)
 {
     pcap_buff->expcap = is_expcap;
@@ -65,6 +98,12 @@ pkt_info_t pcap_buff_get_info(pcap_buff_t* pcap_buff)
     }
 
     if(pcap_buff->hdr->len == 0){
+        /* Note where the block's packets end, to skip the padding after them */
+        const expcap_block_t* blk = pcap_buff->expcap ? expcap_block_get(pcap_buff->hdr) : NULL;
+        if(blk && blk->length <= buff->filesize - offset){
+            pcap_buff->_blk_data_end = (char*)pcap_buff->hdr + blk->data_len;
+            pcap_buff->_blk_end = (char*)pcap_buff->hdr + blk->length;
+        }
         return PKT_PADDING;
     }
 
@@ -72,18 +111,30 @@ pkt_info_t pcap_buff_get_info(pcap_buff_t* pcap_buff)
         return PKT_RUNT;
     }
 
+    /* Snapped packets have footers too, captures with payload hashes are
+     * usually all snapped */
+    if(pcap_buff->expcap){
+        pcap_buff->ftr = (expcap_pktftr_t*)(pcap_buff->pkt + pcap_buff->hdr->caplen - sizeof(expcap_pktftr_t));
+        pcap_buff->hash = pcap_buff->ftr->flags & EXPCAP_FLAG_HASH ? expcap_hash_get(pcap_buff->ftr) : 0;
+    } else {
+        pcap_buff->ftr = NULL;
+    }
+
+    /* The snap length limits the packet data captured, not counting the
+     * footer or payload hash, and not the packet's length on the wire */
+    const int64_t data_len = pcap_buff->ftr ?
+            expcap_data_len(pcap_buff->hdr->caplen, pcap_buff->ftr) :
+            pcap_buff->hdr->caplen;
     pcap_file_header_t* hdr = (pcap_file_header_t*)buff->file_header;
-    if(pcap_buff->hdr->len > hdr->snaplen){
+    if(data_len > hdr->snaplen){
         return PKT_OVER_SNAPLEN;
     }
 
-    if(pcap_buff->hdr->len > pcap_buff->hdr->caplen){
+    if(pcap_buff->hdr->len > data_len){
         return PKT_SNAPPED;
     }
 
     if(pcap_buff->expcap){
-        pcap_buff->ftr = (expcap_pktftr_t*)(pcap_buff->pkt + pcap_buff->hdr->caplen - sizeof(expcap_pktftr_t));
-
         if(pcap_buff->ftr->foot.extra.dropped > 0){
             ch_log_warn("%li packets were droped before this one\n",
                 pcap_buff->ftr->foot.extra.dropped);
@@ -95,8 +146,6 @@ pkt_info_t pcap_buff_get_info(pcap_buff_t* pcap_buff)
 
             return PKT_ERROR;
         }
-    } else {
-        pcap_buff->ftr = NULL;
     }
 
     return PKT_OK;
@@ -110,8 +159,19 @@ pkt_info_t pcap_buff_next_packet(pcap_buff_t* pcap_buff)
         pcap_buff->hdr = (pcap_pkthdr_t*)(pcap_buff->_buff->data + sizeof(pcap_file_header_t));
         pcap_buff->idx = 0;
     } else {
+        /* Count what sampling left out as each block header is passed */
+        const expcap_block_t* blk = pcap_buff->expcap && !curr_hdr->len ? expcap_block_get(curr_hdr) : NULL;
+        if(blk){
+            pcap_buff->skipped += blk->skipped;
+            pcap_buff->skipped_bytes += blk->skipped_bytes;
+        }
+
         const int64_t curr_cap_len = curr_hdr->caplen;
         pcap_pkthdr_t* next_hdr = (pcap_pkthdr_t*)((char*)(curr_hdr+1) + curr_cap_len);
+        if(pcap_buff->_blk_end && (char*)next_hdr >= pcap_buff->_blk_data_end){
+            next_hdr = (pcap_pkthdr_t*)pcap_buff->_blk_end;
+            pcap_buff->_blk_end = NULL;
+        }
         pcap_buff->hdr = next_hdr;
         pcap_buff->idx++;
     }
@@ -134,10 +194,10 @@ buff_error_t pcap_buff_flush_to_disk(pcap_buff_t* pcap_buff){
     return buff_flush_to_disk(pcap_buff->_buff);
 }
 
-buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len, expcap_pktftr_t* ftr)
+/* Make room for a record of up to pcap_record_bytes, moving on to a new file if needed */
+static buff_error_t pcap_buff_make_room(pcap_buff_t* pcap_buff, int64_t pcap_record_bytes)
 {
     buff_t* buff = pcap_buff->_buff;
-    const int64_t pcap_record_bytes = sizeof(pcap_pkthdr_t) + data_len + (ftr ? sizeof(expcap_pktftr_t) : 0);
 
     // there isn't enough space in the buff_t. must flush to disk.
     int64_t bytes_remaining;
@@ -157,9 +217,22 @@ buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* d
         }
     }
 
+    return BUFF_ENONE;
+}
+
+/* Write a record, with a payload hash before the footer if "hash" is set */
+static buff_error_t pcap_buff_write_rec(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len,
+                                        const uint64_t* hash, expcap_pktftr_t* ftr)
+{
+    buff_t* buff = pcap_buff->_buff;
+    const int64_t hash_bytes = hash ? EXPCAP_HASH_LEN : 0;
+    const int64_t pcap_record_bytes = sizeof(pcap_pkthdr_t) + data_len + hash_bytes + (ftr ? sizeof(expcap_pktftr_t) : 0);
+
+    BUFF_TRY(pcap_buff_make_room(pcap_buff, pcap_record_bytes));
+
     /* Flush the buffer if we need to */
     if(ftr){
-        hdr->caplen += sizeof(expcap_pktftr_t);
+        hdr->caplen += hash_bytes + sizeof(expcap_pktftr_t);
     }
 
     ch_log_debug1("header bytes=%li\n", sizeof(pcap_pkthdr_t));
@@ -169,6 +242,10 @@ buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* d
     BUFF_TRY(buff_copy_bytes(buff, hdr, sizeof(pcap_pkthdr_t)));
     BUFF_TRY(buff_copy_bytes(buff, data, data_len));
 
+    if(hash){
+        BUFF_TRY(buff_copy_bytes(buff, (void*)hash, EXPCAP_HASH_LEN));
+    }
+
     if(ftr){
         BUFF_TRY(buff_copy_bytes(buff, ftr, sizeof(expcap_pktftr_t)));
     }
@@ -176,7 +253,70 @@ buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* d
     return BUFF_ENONE;
 }
 
+buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len, expcap_pktftr_t* ftr)
+{
+    return pcap_buff_write_rec(pcap_buff, hdr, data, data_len, NULL, ftr);
+}
+
+buff_error_t pcap_buff_write_hash(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len,
+                                  uint64_t hash, expcap_pktftr_t* ftr)
+{
+    ftr->flags |= EXPCAP_FLAG_HASH;
+    return pcap_buff_write_rec(pcap_buff, hdr, data, data_len, &hash, ftr);
+}
+
+buff_error_t pcap_buff_write_ng(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len,
+                                expcap_pktftr_t* ftr)
+{
+    buff_t* buff = pcap_buff->_buff;
+    BUFF_TRY(pcap_buff_make_room(pcap_buff, PCAPNG_IDB_MAX + PCAPNG_EPB_MAX + data_len));
+
+    /* Each new file describes its ports again */
+    if(pcap_buff->_ng_seg != buff->file_seg){
+        pcap_buff->_ng_seg = buff->file_seg;
+        pcap_buff->_ng_count = 0;
+        pcap_buff->_ng_ids = 0;
+    }
+
+    const uint16_t key = (uint16_t)ftr->dev_id << 8 | ftr->port_id;
+    int64_t if_id = 0;
+    while(if_id < pcap_buff->_ng_count && pcap_buff->_ng_keys[if_id] != key){
+        if_id++;
+    }
+    if(if_id == PCAP_BUFF_NG_IFS){
+        ch_log_fatal("Too many ports for one pcapng file (max %i)\n", PCAP_BUFF_NG_IFS);
+    }
+
+    /* A port gets a new interface if a time does not fit its current one */
+    if(if_id == pcap_buff->_ng_count || !pcapng_ts_fits(ftr->ts_secs, pcap_buff->_ng_secs[if_id])){
+        char idb[PCAPNG_IDB_MAX];
+        const uint64_t if_secs = pcapng_if_secs(ftr->ts_secs);
+        const int64_t idb_len = pcapng_idb(idb, pcap_buff->snaplen, ftr->dev_id, ftr->port_id, if_secs);
+        BUFF_TRY(buff_copy_bytes(buff, idb, idb_len));
+        pcap_buff->_ng_keys[if_id] = key;
+        pcap_buff->_ng_ifs[if_id] = pcap_buff->_ng_ids++;
+        pcap_buff->_ng_secs[if_id] = if_secs;
+        pcap_buff->_ng_count += if_id == pcap_buff->_ng_count;
+    }
+
+    if((int64_t)data_len + PCAPNG_EPB_MAX > pcap_buff->_ng_block_size){
+        pcap_buff->_ng_block_size = data_len + PCAPNG_EPB_MAX;
+        pcap_buff->_ng_block = (char*)realloc(pcap_buff->_ng_block, pcap_buff->_ng_block_size);
+        if(!pcap_buff->_ng_block){
+            ch_log_fatal("Failed to allocate memory for pcapng block!\n");
+        }
+    }
+
+    const int64_t epb_len = pcapng_epb(pcap_buff->_ng_block, pcap_buff->_ng_ifs[if_id], ftr->ts_secs, ftr->ts_psecs,
+                                       pcap_buff->_ng_secs[if_id], data, data_len, hdr->len, ftr);
+    BUFF_TRY(buff_copy_bytes(buff, pcap_buff->_ng_block, epb_len));
+
+    return BUFF_ENONE;
+}
+
 buff_error_t pcap_buff_close(pcap_buff_t* pcap_buff){
+    free(pcap_buff->_ng_block);
+    pcap_buff->_ng_block = NULL;
     return buff_close(pcap_buff->_buff);
 }
 
@@ -3,15 +3,31 @@
 #include "../../src/data_structs/pcap-structures.h"
 #include "buff.h"
 
+/* Most ports a pcapng output can describe */
+#define PCAP_BUFF_NG_IFS 256
+
 typedef struct {
     pcap_pkthdr_t* hdr; // header
     char* pkt;          // packet data
     expcap_pktftr_t* ftr; // footer
+    uint64_t hash;      // payload hash, if the footer has EXPCAP_FLAG_HASH
     uint64_t idx;       // index
     int64_t snaplen;
     int64_t max_filesize;
     bool usec;
     bool expcap;
+    int64_t skipped;    // packets left out by sampling, from the block headers read
+    int64_t skipped_bytes;
+    char* _blk_data_end; // _private end of the current block's packets.
+    char* _blk_end;      // _private end of the current block.
+    int _ng_seg;         // _private file segment the pcapng ports are for.
+    int64_t _ng_count;   // _private pcapng ports described so far,
+    uint16_t _ng_keys[PCAP_BUFF_NG_IFS]; // _private as dev_id << 8 | port_id,
+    uint32_t _ng_ifs[PCAP_BUFF_NG_IFS];  // _private their current interfaces,
+    uint64_t _ng_secs[PCAP_BUFF_NG_IFS]; // _private and their time offsets.
+    int64_t _ng_ids;     // _private pcapng interfaces described so far.
+    char* _ng_block;     // _private pcapng packet block being built.
+    int64_t _ng_block_size;
     buff_t* _buff; // _private buff_t.
 } pcap_buff_t;
 
@@ -29,6 +45,10 @@ typedef enum {
 buff_error_t pcap_buff_init(char* filename, int64_t snaplen, int64_t max_filesize, bool usec,
                            bool conserve_fds, bool allow_duplicates, pcap_buff_t* pcap_buffo);
 
+/* Initialize a packet buffer for writing pcapng, see src/data_structs/pcapng.h. */
+buff_error_t pcap_buff_init_ng(char* filename, int64_t snaplen, int64_t max_filesize,
+                               bool conserve_fds, bool allow_duplicates, pcap_buff_t* pcap_buffo);
+
 /* Read in a pcap from disk. */
 /* The underlying buff is read only */
 buff_error_t pcap_buff_from_file(pcap_buff_t* pcap_buff, char* filename, bool is_expcap);
@@ -37,6 +57,7 @@ buff_error_t pcap_buff_from_file(pcap_buff_t* pcap_buff, char* filename, bool is
 pkt_info_t pcap_buff_get_info(pcap_buff_t* pcap_buff);
 
 /* Adjust hdr, data, idx, ftr to point to the next packet and return packet information */
+/* In expcap files the padding at the end of each block is skipped over. */
 pkt_info_t pcap_buff_next_packet(pcap_buff_t* pcap_buff);
 
 /* Get the filename used by the buff_t. */
@@ -46,6 +67,16 @@ char* pcap_buff_get_filename(pcap_buff_t* pcap_buff);
 /* Header caplen will be adjusted to account for the presence of a footer.. */
 buff_error_t pcap_buff_write(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len, expcap_pktftr_t* ftr);
 
+/* Write a full packet with a payload hash between the data and the footer, */
+/* which is required. The footer gets EXPCAP_FLAG_HASH set. */
+buff_error_t pcap_buff_write_hash(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len,
+                                  uint64_t hash, expcap_pktftr_t* ftr);
+
+/* Write a packet to a pcapng buffer, describing its port first if it is new to */
+/* the file. The footer gives the port, time and options, and is required. */
+buff_error_t pcap_buff_write_ng(pcap_buff_t* pcap_buff, pcap_pkthdr_t* hdr, char* data, size_t data_len,
+                                expcap_pktftr_t* ftr);
+
 /* Flushes _buff to disk. */
 buff_error_t pcap_buff_flush_to_disk(pcap_buff_t* pcap_buff);
 
@@ -157,7 +157,7 @@ int64_t load_trace(bool expcap, timespecps_t* trace_start, timespecps_t* trace_s
         case PKT_EOF:
             goto analysis_done;
         case PKT_OVER_SNAPLEN:
-            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (data len is %d)\n", pkt_num, buff.snaplen, buff.hdr->len);
+            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (caplen is %d)\n", pkt_num, buff.snaplen, buff.hdr->caplen);
             break;
         case PKT_SNAPPED:
             if(options.verbose){
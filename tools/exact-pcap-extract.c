@@ -25,7 +25,6 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <byteswap.h>
-#include <math.h>
 #include <sys/resource.h>
 #include <inttypes.h>
 
@@ -42,7 +41,8 @@
 
 #include "../src/data_structs/pcap-structures.h"
 #include "../src/data_structs/expcap.h"
-#include "data_structs/fusion_hpt.h"
+#include "../src/data_structs/expcap_hash.h"
+#include "../src/data_structs/fusion_hpt.h"
 #include "data_structs/vlan_ethhdr.h"
 #include "data_structs/pcap_buff.h"
 
@@ -77,7 +77,8 @@ static struct
 enum out_format_type {
     EXTR_OPT_FORM_UNKNOWN,
     EXTR_OPT_FORM_PCAP,
-    EXTR_OPT_FORM_EXPCAP
+    EXTR_OPT_FORM_EXPCAP,
+    EXTR_OPT_FORM_PCAPNG
 };
 
 enum steer_type {
@@ -97,13 +98,15 @@ typedef struct {
     enum steer_type type;
 } steer_t;
 
-#define OUT_FORMATS_COUNT 5
+#define OUT_FORMATS_COUNT 7
 out_format_t out_formats[OUT_FORMATS_COUNT] = {
         {"pcap",  EXTR_OPT_FORM_PCAP},
         {"PCAP",  EXTR_OPT_FORM_PCAP},
         {"expcap",EXTR_OPT_FORM_EXPCAP},
         {"exPCAP",EXTR_OPT_FORM_EXPCAP},
-        {"EXPCAP",EXTR_OPT_FORM_EXPCAP}
+        {"EXPCAP",EXTR_OPT_FORM_EXPCAP},
+        {"pcapng",EXTR_OPT_FORM_PCAPNG}, /* After "pcap", which it also matches */
+        {"PCAPNG",EXTR_OPT_FORM_PCAPNG}
 };
 
 #define STEER_RULES_COUNT 7
@@ -309,7 +312,7 @@ static inline char* format_steer_key(enum steer_type rule, uint16_t key)
     return format_str;
 }
 
-static pcap_buff_t* init_wr_buff(char* filename, bool conserve_fds)
+static pcap_buff_t* init_wr_buff(char* filename, enum out_format_type format, bool conserve_fds)
 {
     pcap_buff_t* buff = (pcap_buff_t*)malloc(sizeof(pcap_buff_t));
     char* full_filename = NULL;
@@ -329,8 +332,14 @@ static pcap_buff_t* init_wr_buff(char* filename, bool conserve_fds)
         full_filename = options.write;
     }
 
-    buff_error_t err = pcap_buff_init(full_filename, options.snaplen, options.max_file, options.usec, conserve_fds,
-                                      options.allow_duplicates, buff);
+    buff_error_t err;
+    if(format == EXTR_OPT_FORM_PCAPNG){
+        err = pcap_buff_init_ng(full_filename, options.snaplen, options.max_file, conserve_fds,
+                                options.allow_duplicates, buff);
+    } else {
+        err = pcap_buff_init(full_filename, options.snaplen, options.max_file, options.usec, conserve_fds,
+                             options.allow_duplicates, buff);
+    }
     if(err != BUFF_ENONE){
         ch_log_fatal("Failed to create a new write buffer: %s\n", buff_strerror(err));
     }
@@ -358,7 +367,7 @@ int main (int argc, char** argv)
     ch_opt_addii (CH_OPTION_OPTIONAL, 'p', "port",     "Port number to extract", &options.port,-1);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'd', "device",   "Device number to extract", &options.device,-1);
     ch_opt_addbi (CH_OPTION_FLAG,     'a', "all",      "Output packets from all ports/devices", &options.all, false);
-    ch_opt_addsi (CH_OPTION_OPTIONAL, 'f', "format",   "Output format. Valid values are [pcap, expcap]", &options.format, "expcap");
+    ch_opt_addsi (CH_OPTION_OPTIONAL, 'f', "format",   "Output format. Valid values are [pcap, expcap, pcapng]", &options.format, "expcap");
     ch_opt_addii (CH_OPTION_OPTIONAL, 'c', "count",    "Maxium number of packets to output (<=0 means no max)", &options.max_count, 0);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'M', "maxfile",  "Maximum file size in MB (<=0 means no max)", &options.max_file, 0); //128M
     ch_opt_addii (CH_OPTION_OPTIONAL, 'u', "usecpcap", "PCAP output in microseconds", &options.usec, false);
@@ -523,8 +532,8 @@ int main (int argc, char** argv)
                 }
                 continue;
             case PKT_OVER_SNAPLEN:
-                 ch_log_fatal("Packet with index %d (%s) does not comply with snaplen: %d (data len is %d)\n",
-                              pkt_idx, cur_filename, rd_buffs[buff_idx].snaplen, rd_buffs[buff_idx].hdr->len);
+                 ch_log_fatal("Packet with index %d (%s) does not comply with snaplen: %d (caplen is %d)\n",
+                              pkt_idx, cur_filename, rd_buffs[buff_idx].snaplen, rd_buffs[buff_idx].hdr->caplen);
             case PKT_SNAPPED: // Fall through
                 if(options.verbose){
                     ch_log_warn("Packet has been snapped shorter (%d) than it's wire length (%d) [%s].\n",
@@ -543,7 +552,7 @@ int main (int argc, char** argv)
         const char* pkt_data = rd_buffs[min_idx].pkt;
         const int64_t trailer_size = options.hpt_trailer ? sizeof(fusion_hpt_trailer_t) : 0;
         pcap_pkthdr_t wr_pkt_hdr;
-        int64_t packet_copy_bytes = MIN(options.snaplen, (ch_word)pkt_hdr->caplen - (ch_word)sizeof(expcap_pktftr_t) - trailer_size);
+        int64_t packet_copy_bytes = MIN(options.snaplen, expcap_data_len(pkt_hdr->caplen, rd_buffs[min_idx].ftr) - trailer_size);
 #ifndef NDEBUG
         const int64_t pcap_record_bytes = sizeof(pcap_pkthdr_t) + packet_copy_bytes + sizeof(expcap_pktftr_t);
 #endif
@@ -555,18 +564,17 @@ int main (int argc, char** argv)
             wr_buff = hmit.value;
         } else {
             char* format_str = format_steer_key(steer_rule, key);
-            wr_buff = init_wr_buff(format_str, conserve_fds);
-            hash_map_push(hmap, &key, sizeof(uint16_t), wr_buff);
+            pcap_buff_t* new_buff = init_wr_buff(format_str, format, conserve_fds);
+            /* The map keeps a copy, which is the one to write through from now on */
+            wr_buff = hash_map_push(hmap, &key, sizeof(uint16_t), new_buff).value;
+            free(new_buff);
         }
 
         uint64_t hpt_secs = 0;
         uint64_t hpt_psecs = 0;
         if(options.hpt_trailer){
-            double hpt_frac = 0;
             fusion_hpt_trailer_t* hpt_trailer = (fusion_hpt_trailer_t*)(pkt_data + pkt_len - trailer_size);
-            hpt_frac = ldexp((double)be40toh(hpt_trailer->frac_seconds), -40);
-            hpt_psecs = hpt_frac * 1000 * 1000 * 1000 * 1000;
-            hpt_secs = bswap_32(hpt_trailer->seconds_since_epoch);
+            fusion_hpt_time(hpt_trailer, &hpt_secs, &hpt_psecs);
         }
 
 #ifndef NDEBUG
@@ -589,17 +597,27 @@ int main (int argc, char** argv)
         wr_pkt_hdr.ts.ns.ts_nsec = nsecs;
 
         expcap_pktftr_t wr_pkt_ftr;
-        /* Include the footer (if we want it) */
-        if(format == EXTR_OPT_FORM_EXPCAP){
+        /* Include the footer (if we want it), pcapng takes its options from it */
+        if(format != EXTR_OPT_FORM_PCAP){
             wr_pkt_ftr = *pkt_ftr;
             wr_pkt_ftr.ts_secs = secs;
             wr_pkt_ftr.ts_psecs = psecs;
+            /* Only expcap has somewhere to put the payload hash */
+            wr_pkt_ftr.flags &= ~EXPCAP_FLAG_HASH;
         }
 
         /* Copy the packet header, and upto snap len packet data bytes */
         ch_log_debug1("Copying %li bytes from buffer %li at index=%li into buffer at offset=%li\n", pcap_record_bytes, min_idx, rd_buffs[min_idx].pkt_idx, wr_buff.offset);
 
-        buff_err = pcap_buff_write(wr_buff, &wr_pkt_hdr, rd_buffs[min_idx].pkt, packet_copy_bytes, &wr_pkt_ftr);
+        if(format == EXTR_OPT_FORM_PCAPNG){
+            buff_err = pcap_buff_write_ng(wr_buff, &wr_pkt_hdr, rd_buffs[min_idx].pkt, packet_copy_bytes, &wr_pkt_ftr);
+        } else if(format == EXTR_OPT_FORM_EXPCAP && (pkt_ftr->flags & EXPCAP_FLAG_HASH)){
+            buff_err = pcap_buff_write_hash(wr_buff, &wr_pkt_hdr, rd_buffs[min_idx].pkt, packet_copy_bytes,
+                                            rd_buffs[min_idx].hash, &wr_pkt_ftr);
+        } else {
+            buff_err = pcap_buff_write(wr_buff, &wr_pkt_hdr, rd_buffs[min_idx].pkt, packet_copy_bytes,
+                                       format == EXTR_OPT_FORM_EXPCAP ? &wr_pkt_ftr : NULL);
+        }
 
         if(buff_err != BUFF_ENONE){
             ch_log_fatal("Failed to write packet data: %s\n", buff_strerror(buff_err));
@@ -616,6 +634,17 @@ extract_done:
 
     ch_log_info("Finished writing %li packets total (Runts=%li, Errors=%li, Padding=%li). Closing\n", packets_total, dropped_runts, dropped_errors, dropped_padding);
 
+    int64_t skipped = 0;
+    int64_t skipped_bytes = 0;
+    for(int i = 0; i < rd_buffs_count; i++){
+        skipped += rd_buffs[i].skipped;
+        skipped_bytes += rd_buffs[i].skipped_bytes;
+    }
+    if(skipped){
+        ch_log_info("Sampling at capture time left %li packets (%0.2fMB) out of the blocks read, scale counts up to account for them\n",
+                    skipped, skipped_bytes / 1024.0 / 1024.0);
+    }
+
     ch_hash_map_it hmit = hash_map_first(hmap);
     buff_error_t err;
     while(hmit.value){
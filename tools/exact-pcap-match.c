@@ -19,6 +19,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
 #include <chaste/types/types.h>
 #include <chaste/data_structs/vector/vector_std.h>
@@ -29,6 +30,7 @@
 
 #include "../src/data_structs/pcap-structures.h"
 #include "../src/data_structs/expcap.h"
+#include "../src/data_structs/expcap_hash.h"
 #include "data_structs/pcap_buff.h"
 
 USE_CH_LOGGER_DEFAULT;
@@ -51,12 +53,14 @@ struct
     ch_word max_inp;
     bool verbose;
     ch_word max_dupes;
+    bool hash;
 } options;
 
 typedef struct
 {
     pcap_pkthdr_t pkt_hdr;
     expcap_pktftr_t pkt_ftr;
+    char* pkt;
     bool matched_once;
 } value_t;
 
@@ -144,6 +148,37 @@ int snprint_packet (char* out, int max, bool expcap, pcap_pkthdr_t* pkt_hdr,
     return n;
 }
 
+/*
+ * Find the key to match a packet on: all of its captured data or, with --hash,
+ * its payload hash. Packets captured with --payload-hash have one already,
+ * others are hashed here, which needs all of them. Returns false if the packet
+ * has been snapped and has no hash.
+ */
+static bool packet_key (pcap_buff_t* buff, bool expcap, char** key,
+                        int64_t* key_len, uint64_t* hash)
+{
+    const int64_t caplen = expcap ? expcap_data_len (buff->hdr->caplen, buff->ftr) : buff->hdr->caplen;
+    if (!options.hash){
+        *key = buff->pkt;
+        *key_len = caplen;
+        return true;
+    }
+
+    if (expcap && (buff->ftr->flags & EXPCAP_FLAG_HASH)){
+        *hash = buff->hash;
+    }
+    else if (caplen >= buff->hdr->len){
+        *hash = expcap_hash (buff->pkt, buff->hdr->len);
+    }
+    else{
+        return false;
+    }
+
+    *key = (char*)hash;
+    *key_len = sizeof(*hash);
+    return true;
+}
+
 int main (int argc, char** argv)
 {
     signal (SIGHUP, signal_handler);
@@ -166,6 +201,7 @@ int main (int argc, char** argv)
     ch_opt_addii (CH_OPTION_OPTIONAL, 'm', "max-inp", "Max items in input file to match (<0 means all)", &options.max_inp, -1);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'n', "num-chars", "Number of bytes from matched packets to output (<0 means all)", &options.num, 64);
     ch_opt_addii (CH_OPTION_OPTIONAL, 'd', "max-dupes", "Maximum number of duplicate matches allowed for a single packet (default is 0).", &options.max_dupes, 0);
+    ch_opt_addbi (CH_OPTION_FLAG, 'H', "hash", "Match packets by payload hash rather than by content (see exact-capture --payload-hash)", &options.hash, false);
     ch_opt_addbi (CH_OPTION_FLAG, 'v', "verbose", "Printout verbose output", &options.verbose, false);
     ch_opt_parse (argc, argv);
     ch_log_info("Starting PCAP Matcher\n");
@@ -217,8 +253,17 @@ int main (int argc, char** argv)
         options.max_inp = INT64_MAX;
     }
 
-    ch_hash_map* hmap = ch_hash_map_new (128 * 1024 * 1024, sizeof(value_t),
-                                         NULL);
+    /* Size the hash map to the reference file, at most one packet per 64B
+     * of it, rather than always taking 8GB for the largest */
+    struct stat ref_stat;
+    if(stat(options.ref, &ref_stat)){
+        ch_log_fatal("Could not stat reference file %s: %s\n", options.ref, strerror(errno));
+    }
+    const int64_t hmap_size = MAX(1024, MIN(128 * 1024 * 1024, ref_stat.st_size / 64));
+    ch_hash_map* hmap = ch_hash_map_new (hmap_size, sizeof(value_t), NULL);
+    if(!hmap){
+        ch_log_fatal("Could not allocate a hash map for %li packets\n", hmap_size);
+    }
 
     /* Load up the reference file into the hashmap*/
     pcap_buff_t ref_buff = {0};
@@ -245,6 +290,8 @@ int main (int argc, char** argv)
 
     int64_t pkt_num = 0;
     int64_t loaded = 0;
+    int64_t unhashed_ref = 0;
+    int64_t unhashed_inp = 0;
     for (pkt_num = 0; !stop && pkt_num < options.max_ref + options.offset_ref; pkt_num++){
         if (pkt_num && pkt_num % (1000 * 1000) == 0){
             ch_log_info("Loaded %li,000,000 packets\n", pkt_num / 1000 / 1000);
@@ -257,7 +304,7 @@ int main (int argc, char** argv)
         case PKT_EOF:
             goto ref_pcap_loaded;
         case PKT_OVER_SNAPLEN:
-            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (data len is %d)\n", pkt_num, ref_buff.snaplen, ref_buff.hdr->len);
+            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (caplen is %d)\n", pkt_num, ref_buff.snaplen, ref_buff.hdr->caplen);
             break;
         case PKT_SNAPPED:
             if(options.verbose){
@@ -286,14 +333,21 @@ int main (int argc, char** argv)
         value_t val;
         bzero (&val, sizeof(val));
         val.pkt_hdr = *ref_hdr;
+        val.pkt = ref_buff.pkt;
         if (expcap){
             val.pkt_ftr = *ref_buff.ftr;
         }
 
-        const int64_t caplen = expcap ? ref_hdr->caplen - sizeof(expcap_pktftr_t) : ref_hdr->caplen;
+        char* key;
+        int64_t key_len;
+        uint64_t hash;
+        if (!packet_key (&ref_buff, expcap, &key, &key_len, &hash)){
+            unhashed_ref++;
+            continue;
+        }
 
-        /*Use the whole packet as the key, and the header as the value */
-        hash_map_push (hmap, ref_buff.pkt, caplen, &val);
+        /*Use the whole packet (or its hash) as the key, and the header as the value */
+        hash_map_push (hmap, key, key_len, &val);
 
         loaded++;
     }
@@ -341,7 +395,7 @@ ref_pcap_loaded:
         case PKT_EOF:
             goto find_input_misses;
         case PKT_OVER_SNAPLEN:
-            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (data len is %d)\n", pkt_num, inp_buff.snaplen, inp_buff.hdr->len);
+            ch_log_fatal("Packet with index %d does not comply with snaplen: %d (caplen is %d)\n", pkt_num, inp_buff.snaplen, inp_buff.hdr->caplen);
             break;
         case PKT_SNAPPED:
             if (options.verbose){
@@ -367,8 +421,14 @@ ref_pcap_loaded:
         }
 
         /* Look for this packet in the hash map */
-        const int64_t caplen = expcap ? inp_hdr->caplen - sizeof(expcap_pktftr_t) : inp_hdr->caplen;
-        ch_hash_map_it hmit = hash_map_get_first (hmap, inp_buff.pkt, caplen);
+        char* key;
+        int64_t key_len;
+        uint64_t hash;
+        if (!packet_key (&inp_buff, expcap, &key, &key_len, &hash)){
+            unhashed_inp++;
+            continue;
+        }
+        ch_hash_map_it hmit = hash_map_get_first (hmap, key, key_len);
         if(hmit.key)
         {
             ch_word num_matches = 0;
@@ -395,7 +455,7 @@ ref_pcap_loaded:
         }
 
         total_matched++;
-        char* ref_pkt = (char*) hmit.key;
+        char* ref_pkt = val->pkt;
         pcap_pkthdr_t* ref_hdr = &val->pkt_hdr;
         expcap_pktftr_t* ref_ftr = &val->pkt_ftr;
 
@@ -464,11 +524,11 @@ find_input_misses:
         if (!val->matched_once){
             missing_input++;
             if (fd_ref_miss > 0){
-                dprint_packet (fd_ref_miss, expcap, &val->pkt_hdr, &val->pkt_ftr, hmit.key, true, true);
+                dprint_packet (fd_ref_miss, expcap, &val->pkt_hdr, &val->pkt_ftr, val->pkt, true, true);
             }
 
             if(options.ref_miss_pcap){
-                pcap_buff_write(ref_miss_buff, &val->pkt_hdr, hmit.key, val->pkt_hdr.caplen, NULL);
+                pcap_buff_write(ref_miss_buff, &val->pkt_hdr, val->pkt, val->pkt_hdr.caplen, NULL);
 	    }
         }
 
@@ -479,6 +539,10 @@ find_input_misses:
     ch_log_info("%-12li packets from input file found in reference file.\n", total_matched);
     ch_log_info("%-12li packets from input file never found in reference file\n", total_lost);
     ch_log_info("%-12li packets in reference were never matched with input\n\n", missing_input);
+    if (unhashed_ref || unhashed_inp){
+        ch_log_warn("%li reference and %li input packets were snapped with no payload hash, and left out\n",
+                    unhashed_ref, unhashed_inp);
+    }
 
     pcap_buff_close(&ref_buff);
     pcap_buff_close(&inp_buff);
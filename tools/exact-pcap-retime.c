@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: A tool for converting the raw NIC timestamps in files written
+ *               with --defer-timestamps into UTC, in place, using the clock
+ *               samples written next to them.
+ *
+ */
+
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <chaste/types/types.h>
+#include <chaste/options/options.h>
+#include <chaste/log/log.h>
+#include <chaste/utils/util.h>
+
+#include "data_structs/pcap-structures.h"
+#include "data_structs/expcap.h"
+#include "data_structs/expcap_clock.h"
+#include "data_structs/expcap_block.h"
+
+
+USE_CH_LOGGER_DEFAULT;
+USE_CH_OPTIONS;
+
+#define PS_PER_SEC (1000LL * 1000 * 1000 * 1000)
+
+
+struct {
+    char* input;
+    char* clock;
+    bool keep;
+} options;
+
+
+static int sample_cmp(const void* a, const void* b)
+{
+    const expcap_clock_sample_t* sa = a;
+    const expcap_clock_sample_t* sb = b;
+    if(sa->dev_id != sb->dev_id){
+        return sa->dev_id - sb->dev_id;
+    }
+    if(sa->port_id != sb->port_id){
+        return sa->port_id - sb->port_id;
+    }
+    return sa->cycles < sb->cycles ? -1 : sa->cycles > sb->cycles;
+}
+
+
+static expcap_clock_sample_t* read_samples(const char* filename, int64_t* count)
+{
+    FILE* f = fopen(filename, "r");
+    if(!f){
+        ch_log_fatal("Could not open clock file %s: %s\n", filename, strerror(errno));
+    }
+
+    expcap_clock_hdr_t hdr;
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+       memcmp(hdr.magic, EXPCAP_CLOCK_MAGIC, sizeof(hdr.magic))){
+        ch_log_fatal("%s is not a clock file\n", filename);
+    }
+    if(hdr.version != EXPCAP_CLOCK_VERSION || hdr.sample_size != sizeof(expcap_clock_sample_t)){
+        ch_log_fatal("Unsupported clock file version %u in %s\n", hdr.version, filename);
+    }
+
+    struct stat st;
+    fstat(fileno(f), &st);
+    const int64_t max = (st.st_size - sizeof(hdr)) / sizeof(expcap_clock_sample_t);
+    expcap_clock_sample_t* samples = calloc(max + 1, sizeof(expcap_clock_sample_t));
+    if(!samples){
+        ch_log_fatal("Could not allocate memory for %li clock samples\n", max);
+    }
+
+    *count = fread(samples, sizeof(expcap_clock_sample_t), max, f);
+    fclose(f);
+
+    qsort(samples, *count, sizeof(expcap_clock_sample_t), sample_cmp);
+    return samples;
+}
+
+
+/* Samples for one port, sorted by NIC timestamp */
+typedef struct {
+    const expcap_clock_sample_t* first;
+    int64_t count;
+} port_samples_t;
+
+static port_samples_t find_port(const expcap_clock_sample_t* samples, int64_t count,
+                                uint8_t dev_id, uint8_t port_id)
+{
+    port_samples_t port = { NULL, 0 };
+    for(int64_t i = 0; i < count; i++){
+        if(samples[i].dev_id == dev_id && samples[i].port_id == port_id){
+            if(!port.first){
+                port.first = &samples[i];
+            }
+            port.count++;
+        }
+    }
+    return port;
+}
+
+
+/*
+ * Times between two samples are interpolated between them, which follows any
+ * adjustments made to the NIC clock while capturing. Times outside the samples
+ * are extrapolated from the nearest two, or from the NIC's tick rate if there
+ * is only one.
+ */
+static void convert(const port_samples_t* port, uint64_t cycles, int64_t* secs, int64_t* psecs)
+{
+    int64_t lo = 0;
+    int64_t hi = port->count;
+    while(hi - lo > 1){
+        const int64_t mid = (lo + hi) / 2;
+        if(port->first[mid].cycles <= cycles){
+            lo = mid;
+        }
+        else{
+            hi = mid;
+        }
+    }
+
+    if(lo + 1 >= port->count && lo > 0){
+        lo--;
+    }
+
+    const expcap_clock_sample_t* s0 = &port->first[lo];
+    const expcap_clock_sample_t* s1 = lo + 1 < port->count ? &port->first[lo + 1] : NULL;
+    const long double dcycles = (long double)((int64_t)(cycles - s0->cycles));
+
+    long double delta_ps = 0;
+    if(s1 && s1->cycles > s0->cycles){
+        const long double span_ps = (long double)((int64_t)(s1->ts_secs - s0->ts_secs)) * PS_PER_SEC +
+                                    ((int64_t)s1->ts_psecs - (int64_t)s0->ts_psecs);
+        delta_ps = dcycles * span_ps / (s1->cycles - s0->cycles);
+    }
+    else if(s0->tick_hz){
+        delta_ps = dcycles * PS_PER_SEC / s0->tick_hz;
+    }
+
+    int64_t ps = s0->ts_psecs + (int64_t)delta_ps;
+    int64_t sec = s0->ts_secs + ps / PS_PER_SEC;
+    ps %= PS_PER_SEC;
+    if(ps < 0){
+        ps += PS_PER_SEC;
+        sec--;
+    }
+    *secs = sec;
+    *psecs = ps;
+}
+
+
+static inline uint64_t footer_ns(const expcap_pktftr_t* ftr)
+{
+    return ftr->ts_secs * 1000ULL * 1000 * 1000 + ftr->ts_psecs / 1000;
+}
+
+
+/*
+ * Once all of a block's packets are done its times are taken from them, the
+ * first from the block header's own record, then it is marked as converted.
+ */
+static void finish_block(expcap_block_t* blk, uint64_t last_pkt_ns, bool missing)
+{
+    if(missing){
+        return;
+    }
+
+    const expcap_pktftr_t* ftr = (expcap_pktftr_t*)(blk + 1);
+    blk->first_ts = footer_ns(ftr);
+    blk->last_ts = blk->packets && last_pkt_ns ? last_pkt_ns : blk->first_ts;
+    blk->flags &= ~EXPCAP_BLOCK_FLAG_RAWTS;
+}
+
+
+int main(int argc, char** argv)
+{
+    ch_opt_addsu(CH_OPTION_REQUIRED,'i',"input","Expcap file written with --defer-timestamps, converted in place", &options.input);
+    ch_opt_addsi(CH_OPTION_OPTIONAL,'c',"clock","Clock samples for the file (default <input>" EXPCAP_CLOCK_SUFFIX ")", &options.clock, NULL);
+    ch_opt_addbi(CH_OPTION_FLAG,'k',"keep","Keep the clock file afterwards (converting twice is not possible)", &options.keep, false);
+
+    ch_opt_parse(argc,argv);
+
+    char clock_name[4096];
+    snprintf(clock_name, sizeof(clock_name), "%s%s", options.input, EXPCAP_CLOCK_SUFFIX);
+    if(options.clock){
+        snprintf(clock_name, sizeof(clock_name), "%s", options.clock);
+    }
+
+    int64_t count = 0;
+    expcap_clock_sample_t* samples = read_samples(clock_name, &count);
+    if(!count){
+        ch_log_fatal("No clock samples in %s\n", clock_name);
+    }
+
+    const int fd = open(options.input, O_RDWR);
+    if(fd < 0){
+        ch_log_fatal("Could not open %s: %s\n", options.input, strerror(errno));
+    }
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(pcap_file_header_t)){
+        ch_log_fatal("%s is too small to be a pcap file\n", options.input);
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED){
+        ch_log_fatal("Could not map %s: %s\n", options.input, strerror(errno));
+    }
+
+    const pcap_file_header_t* fhdr = (pcap_file_header_t*)data;
+    const bool nsec = fhdr->magic == NSEC_TCPDUMP_MAGIC;
+    if(!nsec && fhdr->magic != TCPDUMP_MAGIC){
+        ch_log_fatal("%s is not a pcap file\n", options.input);
+    }
+
+    port_samples_t port = find_port(samples, count, samples[0].dev_id, samples[0].port_id);
+    int dev_id = samples[0].dev_id;
+    int port_id = samples[0].port_id;
+
+    /*
+     * This can be stopped and run again. Blocks are converted one at a time,
+     * and their RAWTS flag is only cleared once all of their packets are done,
+     * so blocks without it are skipped. Within a block, each footer's time is
+     * zero until it is filled in, and is filled in before the pcap header's,
+     * so packets that an earlier run got to are not converted twice.
+     */
+    expcap_block_t* blk = NULL;     /* Block being converted */
+    int64_t blk_end = 0;
+    bool blk_missing = false;
+    expcap_pktftr_t last = {0};     /* Time of the last record converted */
+    bool have_last = false;
+    uint64_t last_pkt_ns = 0;       /* and of the last real packet */
+
+    int64_t packets = 0;
+    int64_t missing = 0;
+    int64_t off = sizeof(pcap_file_header_t);
+    while(off + (int64_t)sizeof(pcap_pkthdr_t) <= st.st_size){
+        if(blk && off >= blk_end){
+            finish_block(blk, last_pkt_ns, blk_missing);
+            blk = NULL;
+        }
+
+        pcap_pkthdr_t* hdr = (pcap_pkthdr_t*)(data + off);
+        const int64_t rec_off = off;
+        const int64_t rec_len = sizeof(pcap_pkthdr_t) + hdr->caplen;
+        if(hdr->caplen < sizeof(expcap_pktftr_t) || off + rec_len > st.st_size){
+            ch_log_warn("Truncated record at offset %li, stopping\n", off);
+            break;
+        }
+        expcap_pktftr_t* ftr = (expcap_pktftr_t*)(data + off + rec_len - sizeof(expcap_pktftr_t));
+        off += rec_len;
+
+        /* The dummy record in the file header has no time */
+        if(!hdr->ts.raw){
+            continue;
+        }
+
+        expcap_block_t* next = expcap_block_get(hdr);
+        if(next){
+            if(blk){
+                finish_block(blk, last_pkt_ns, blk_missing);
+                blk = NULL;
+            }
+            if(!(next->flags & EXPCAP_BLOCK_FLAG_RAWTS)){
+                if(next->length >= rec_len && rec_off + next->length <= st.st_size){
+                    off = rec_off + next->length;
+                }
+                last.ts_secs = next->last_ts / (1000ULL * 1000 * 1000);
+                last.ts_psecs = next->last_ts % (1000ULL * 1000 * 1000) * 1000;
+                have_last = true;
+                continue;
+            }
+            blk = next;
+            blk_end = rec_off + next->length;
+            blk_missing = false;
+            last_pkt_ns = 0;
+        }
+
+        /* Padding records take the time of whatever came before them. Their
+         * footers are filled with 0xFF, so are no use for telling whether
+         * they are done */
+        if(!hdr->len && !next){
+            if(!have_last){
+                missing++;
+                blk_missing = true;
+                continue;
+            }
+            ftr->ts_secs = last.ts_secs;
+            ftr->ts_psecs = last.ts_psecs;
+        }
+        else{
+            /* Block headers carry the port of the packets that follow them */
+            if(ftr->dev_id != dev_id || ftr->port_id != port_id){
+                dev_id = ftr->dev_id;
+                port_id = ftr->port_id;
+                port = find_port(samples, count, dev_id, port_id);
+            }
+            if(!ftr->ts_secs){
+                if(!port.count){
+                    missing++;
+                    blk_missing = true;
+                    have_last = false;
+                    continue;
+                }
+
+                int64_t secs = 0;
+                int64_t psecs = 0;
+                convert(&port, hdr->ts.raw, &secs, &psecs);
+                ftr->ts_psecs = psecs;
+                ftr->ts_secs = secs;
+                packets += hdr->len != 0;
+            }
+            if(hdr->len){
+                last_pkt_ns = footer_ns(ftr);
+            }
+        }
+
+        hdr->ts.ns.ts_sec = ftr->ts_secs;
+        hdr->ts.ns.ts_nsec = nsec ? ftr->ts_psecs / 1000 : ftr->ts_psecs / 1000 / 1000;
+        last = *ftr;
+        have_last = true;
+    }
+    if(blk){
+        finish_block(blk, last_pkt_ns, blk_missing);
+    }
+
+    if(missing){
+        ch_log_warn("%li records are from ports with no clock samples, left unconverted\n", missing);
+    }
+
+    msync(data, st.st_size, MS_SYNC);
+    munmap(data, st.st_size);
+    close(fd);
+    free(samples);
+
+    ch_log_info("Converted %li packets in %s using %li clock samples\n", packets, options.input, count);
+    if(!options.keep && !missing && unlink(clock_name)){
+        ch_log_warn("Could not remove %s: %s\n", clock_name, strerror(errno));
+    }
+    return missing ? 1 : 0;
+}
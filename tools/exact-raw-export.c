@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2026 All rights reserved.
+ * See LICENSE.txt for full details.
+ *
+ *  Created:     18 Oct. 2026
+ *  Description: A tool for listing the segments that Exact Capture has
+ *               written to a raw block device, and exporting them back out
+ *               to .expcap files.
+ *
+ */
+
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <chaste/types/types.h>
+#include <chaste/options/options.h>
+#include <chaste/log/log.h>
+#include <chaste/utils/util.h>
+
+#include "data_structs/raw_catalog.h"
+
+
+USE_CH_LOGGER_DEFAULT;
+USE_CH_OPTIONS;
+
+
+struct {
+    char* device;
+    char* output;
+    bool list;
+    ch_word segment;
+    ch_float begin;
+    ch_float end;
+} options;
+
+
+static volatile bool stop = false;
+void signal_handler(int signum)
+{
+    ch_log_warn("Caught signal %li, shutting down\n", signum);
+    if(stop == 1){
+        ch_log_fatal("Hard exit\n");
+    }
+    stop = 1;
+}
+
+
+static void format_ns(char* buff, int len, uint64_t ns)
+{
+    if(!ns){
+        snprintf(buff, len, "-");
+        return;
+    }
+
+    struct tm tm;
+    const time_t secs = ns / (1000 * 1000 * 1000);
+    gmtime_r(&secs, &tm);
+    const int n = strftime(buff, len, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buff + n, len - n, ".%09luZ", ns % (1000 * 1000 * 1000));
+}
+
+
+/* The segment's interfaces, from its port mask if the list was cut short */
+static void format_ports(char* buff, int len, const raw_segment_t* seg)
+{
+    const int max = sizeof(seg->ports);
+    if(strnlen(seg->ports, max) < max - 1 || !seg->port_mask){
+        snprintf(buff, len, "%.*s", max, seg->ports);
+        return;
+    }
+
+    int n = 0;
+    for(int bit = 0; bit < 64 && n < len; bit++){
+        if(seg->port_mask & (1ULL << bit)){
+            n += snprintf(buff + n, len - n, "%sexanic%i:%i", n ? "," : "", bit / 8, bit % 8);
+        }
+    }
+}
+
+
+/*
+ * Does the segment overlap the requested time range? The catalog only has the
+ * time of the start of a segment's last write, so the start of the following
+ * segment is used as the end of this one.
+ */
+static bool segment_selected(int64_t idx, const raw_segment_t* seg,
+                             const raw_segment_t* next)
+{
+    if(options.segment >= 0){
+        return idx == options.segment;
+    }
+
+    const uint64_t begin_ns = options.begin * 1000 * 1000 * 1000;
+    const uint64_t end_ns = options.end * 1000 * 1000 * 1000;
+    if(end_ns && seg->first_ns > end_ns){
+        return false;
+    }
+    if(begin_ns && next && next->first_ns && next->first_ns < begin_ns){
+        return false;
+    }
+    return true;
+}
+
+
+static int export_segment(int dev_fd, int64_t idx, const raw_segment_t* seg)
+{
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s-%li.expcap", options.output, idx);
+
+    if(seg->flags & RAW_SEG_OPEN){
+        ch_log_warn("Segment %li was not closed cleanly, exporting up to its last catalog update\n", idx);
+    }
+
+    const int out_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)(0666));
+    if(out_fd < 0){
+        ch_log_error("Could not open output file %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    const int64_t buff_size = 1024 * 1024;
+    char* buff = malloc(buff_size);
+    if(!buff){
+        ch_log_fatal("Could not allocate copy buffer\n");
+    }
+
+    int result = 0;
+    for(uint64_t off = seg->start; off < seg->end && !stop; ){
+        const int64_t len = MIN((uint64_t)buff_size, seg->end - off);
+        const ssize_t rd = pread(dev_fd, buff, len, off);
+        if(rd <= 0){
+            ch_log_error("Could not read device at %lu: %s\n", off, strerror(errno));
+            result = -1;
+            break;
+        }
+        if(write(out_fd, buff, rd) != rd){
+            ch_log_error("Could not write to %s: %s\n", filename, strerror(errno));
+            result = -1;
+            break;
+        }
+        off += rd;
+    }
+
+    free(buff);
+    close(out_fd);
+    ch_log_info("Exported segment %li (%.2fMB) to %s\n", idx,
+                (double)(seg->end - seg->start) / 1024 / 1024, filename);
+    return result;
+}
+
+
+int main(int argc, char** argv)
+{
+    signal(SIGHUP, signal_handler);
+    signal(SIGINT, signal_handler);
+    signal(SIGPIPE, signal_handler);
+    signal(SIGALRM, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    ch_opt_addsu(CH_OPTION_REQUIRED,'d',"device","Raw device (or image file) to read", &options.device);
+    ch_opt_addbi(CH_OPTION_FLAG,'l',"list","List the segments on the device", &options.list, false);
+    ch_opt_addsi(CH_OPTION_OPTIONAL,'o',"output","Export to files named <output>-<segment>.expcap", &options.output, NULL);
+    ch_opt_addii(CH_OPTION_OPTIONAL,'s',"segment","Only export this segment (<0 means all)", &options.segment, -1);
+    ch_opt_addfi(CH_OPTION_OPTIONAL,'b',"begin","Only export segments with packets after this time (secs since the epoch)", &options.begin, 0);
+    ch_opt_addfi(CH_OPTION_OPTIONAL,'e',"end","Only export segments with packets before this time (secs since the epoch)", &options.end, 0);
+
+    ch_opt_parse(argc,argv);
+
+    if(!options.list && !options.output){
+        ch_log_fatal("Nothing to do. Use --list and/or --output\n");
+    }
+
+    const int dev_fd = open(options.device, O_RDONLY);
+    if(dev_fd < 0){
+        ch_log_fatal("Could not open %s: %s\n", options.device, strerror(errno));
+    }
+
+    raw_catalog_hdr_t hdr;
+    if(pread(dev_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+       memcmp(hdr.magic, RAW_CATALOG_MAGIC, sizeof(hdr.magic))){
+        ch_log_fatal("No Exact Capture catalog found on %s\n", options.device);
+    }
+    if(hdr.version != RAW_CATALOG_VERSION){
+        ch_log_fatal("Unsupported catalog version %u on %s\n", hdr.version, options.device);
+    }
+
+    if(options.list){
+        printf("%-5s %-14s %-14s %-10s %-30s %-30s %s\n", "seg", "start", "end", "MB",
+               "first", "last", "ports");
+    }
+
+    const uint64_t count = MIN(hdr.segments, hdr.max_segments);
+    raw_segment_t* segs = calloc(count + 1, sizeof(raw_segment_t));
+    if(!segs){
+        ch_log_fatal("Could not allocate memory for %lu catalog entries\n", count);
+    }
+    for(uint64_t i = 0; i < count; i++){
+        const int64_t off = RAW_SEG_BLOCK_OFF(i) + (i % RAW_SEGS_PER_BLOCK) * sizeof(raw_segment_t);
+        if(pread(dev_fd, &segs[i], sizeof(raw_segment_t), off) != sizeof(raw_segment_t)){
+            ch_log_fatal("Could not read catalog entry %lu: %s\n", i, strerror(errno));
+        }
+    }
+
+    int result = 0;
+    for(uint64_t i = 0; i < count && !stop; i++){
+        const raw_segment_t seg = segs[i];
+        if(!segment_selected(i, &seg, i + 1 < count ? &segs[i + 1] : NULL)){
+            continue;
+        }
+
+        if(options.list){
+            char first[64], last[64], ports[1024];
+            format_ns(first, sizeof(first), seg.first_ns);
+            format_ns(last, sizeof(last), seg.last_ns);
+            format_ports(ports, sizeof(ports), &seg);
+            printf("%-5lu %-14lu %-14lu %-10.2f %-30s %-30s %s%s\n", i, seg.start, seg.end,
+                   (double)(seg.end - seg.start) / 1024 / 1024, first, last, ports,
+                   seg.flags & RAW_SEG_OPEN ? " (open)" : "");
+        }
+
+        if(options.output && export_segment(dev_fd, i, &seg)){
+            result = 1;
+        }
+    }
+
+    free(segs);
+    close(dev_fd);
+    return result;
+}